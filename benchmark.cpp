@@ -0,0 +1,392 @@
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <format>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <optional>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+
+// Benchmarks of both parts, run from the top of the repository once the
+// Makefile there built them, for tracking regressions.
+//
+// Workloads: the generator at each size, uniform and clustered, then
+// haversine on what it generated in each compute mode and input engine, then
+// sim8086 on every listing in each of its modes, its check of the fused kernels
+// once (-k, the same whatever the program), and its own benchmark mode and
+// equivalence check on the bench programs that were assembled. Each run is a process, timed from
+// fork to exit, its resource usage as counters; a workload is repeated and
+// keeps its fastest run's counters. A run failing or past the timeout (sim8086
+// simulating a listing that loops forever) is reported, not timed.
+//
+// Results are json, a line per workload. Against a baseline in the same
+// format, a workload whose fastest run is slower than the baseline's by more
+// than the threshold is a regression, unless by less than the resolution: the
+// listings take milliseconds, mostly starting the process, and vary by more
+// than any threshold. One failing that did not is one too, and the exit
+// status is 1.
+
+
+using u64 = uint64_t;
+using f64 = double;
+
+
+struct Run {
+    bool ok {false};
+    std::string error;
+    f64 seconds {0};
+    rusage usage {};
+};
+
+
+struct Result {
+    std::string name;
+    u64 repetitions {0};
+    f64 min {0};
+    std::optional<f64> median, mean;
+    f64 throughput {0};
+    std::string unit;
+    std::vector<std::pair<std::string, f64>> counters;
+    std::string error;  // not timed when set
+};
+
+
+// args[0] run in dir with stdout to out (/dev/null when empty), killed by
+// SIGALRM after timeout seconds: the alarm survives exec
+Run run_once(const std::vector<std::string> &args, const std::string &dir, const unsigned &timeout, const std::string &out = "") {
+    std::vector<char*> argv;
+    for (const std::string &arg : args)
+        argv.push_back(const_cast<char*>(arg.c_str()));
+    argv.push_back(nullptr);
+
+    Run run;
+    const auto start = std::chrono::steady_clock::now();
+    const pid_t pid {fork()};
+    if (pid < 0)
+        throw std::runtime_error{"fork failed"};
+    if (pid == 0) {
+        const int null {open("/dev/null", O_WRONLY)};
+        const int stdout_fd {out.empty() ? null : open(out.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644)};
+        dup2(stdout_fd, STDOUT_FILENO);
+        dup2(null, STDERR_FILENO);
+        if (chdir(dir.c_str()) != 0)
+            _exit(127);
+        alarm(timeout);
+        execv(argv[0], argv.data());
+        _exit(127);
+    }
+    int status;
+    wait4(pid, &status, 0, &run.usage);
+    run.seconds = std::chrono::duration<f64>(std::chrono::steady_clock::now() - start).count();
+    if (WIFSIGNALED(status))
+        run.error = WTERMSIG(status) == SIGALRM ? std::format("timed out after {} s", timeout) : std::format("killed by signal {}", WTERMSIG(status));
+    else if (WEXITSTATUS(status) != 0)
+        run.error = std::format("exit status {}", WEXITSTATUS(status));
+    run.ok = run.error.empty();
+    return run;
+}
+
+
+// min and median of repetitions runs, throughput of units per second at the
+// fastest, stopping at the first failing run
+Result repeat(const std::string &name, const std::vector<std::string> &args, const std::string &dir, const u64 &repetitions,
+              const unsigned &timeout, const f64 &units, const std::string &unit) {
+    Result result {.name = name, .unit = unit};
+    std::vector<f64> seconds;
+    Run fastest;
+    for (u64 r = 0; r < repetitions; ++r) {
+        const Run run {run_once(args, dir, timeout)};
+        if (!run.ok) {
+            result.error = run.error;
+            std::cerr << std::format("{}: {}", name, run.error) << std::endl;
+            return result;
+        }
+        if (seconds.empty() || run.seconds < fastest.seconds)
+            fastest = run;
+        seconds.push_back(run.seconds);
+    }
+    std::sort(seconds.begin(), seconds.end());
+    const size_t n {seconds.size()};
+    result.repetitions = n;
+    result.min = seconds[0];
+    result.median = n % 2 == 1 ? seconds[n / 2] : (seconds[n / 2 - 1] + seconds[n / 2]) / 2;
+    result.throughput = units / result.min;
+    auto time = [](const timeval &t) { return t.tv_sec + t.tv_usec * 1e-6; };
+    const rusage &u {fastest.usage};
+    result.counters = {
+        {"user_s", time(u.ru_utime)}, {"sys_s", time(u.ru_stime)}, {"max_rss_kb", (f64)u.ru_maxrss},
+        {"minor_faults", (f64)u.ru_minflt}, {"major_faults", (f64)u.ru_majflt},
+        {"context_switches", (f64)(u.ru_nvcsw + u.ru_nivcsw)},
+    };
+    std::cerr << std::format("{}: min {:.6f} s, median {:.6f} s", name, result.min, *result.median) << std::endl;
+    return result;
+}
+
+
+// sim8086 -t on a bench program, a result per mode from its csv:
+// workload,mode,instructions,repetitions,min_ns_per_instr,avg_ns_per_instr,max_instr_per_s,avg_instr_per_s
+std::vector<Result> sim_benchmark(const std::string &sim, const std::string &program, const std::string &name, const std::string &out) {
+    const Run run {run_once({sim, program, "-t"}, ".", 600, out)};
+    if (!run.ok)
+        return {{.name = name, .error = run.error}};
+    std::vector<Result> results;
+    std::ifstream csv(out);
+    for (std::string line; std::getline(csv, line);) {
+        std::vector<std::string> fields;
+        std::stringstream stream(line);
+        for (std::string field; std::getline(stream, field, ',');)
+            fields.push_back(field);
+        if (fields.size() != 8)
+            continue;
+        const f64 instructions {strtod(fields[2].c_str(), nullptr)};
+        results.push_back({
+            .name = std::format("{}/{}", name, fields[1]),
+            .repetitions = strtoull(fields[3].c_str(), nullptr, 10),
+            .min = strtod(fields[4].c_str(), nullptr) * instructions * 1e-9,
+            .mean = strtod(fields[5].c_str(), nullptr) * instructions * 1e-9,
+            .throughput = strtod(fields[6].c_str(), nullptr),
+            .unit = "instructions/s",
+        });
+        std::cerr << std::format("{}: min {:.6f} s", results.back().name, results.back().min) << std::endl;
+    }
+    return results;
+}
+
+
+std::string to_json(const Result &r) {
+    if (!r.error.empty())
+        return std::format("{{\"name\": \"{}\", \"error\": \"{}\"}}", r.name, r.error);
+    std::string json {std::format("{{\"name\": \"{}\", \"repetitions\": {}, \"min_s\": {:.9f}", r.name, r.repetitions, r.min)};
+    if (r.median)
+        json += std::format(", \"median_s\": {:.9f}", *r.median);
+    if (r.mean)
+        json += std::format(", \"mean_s\": {:.9f}", *r.mean);
+    json += std::format(", \"throughput\": {:.1f}, \"unit\": \"{}\"", r.throughput, r.unit);
+    if (!r.counters.empty()) {
+        json += ", \"counters\": {";
+        for (size_t c = 0; c < r.counters.size(); ++c)
+            json += std::format("{}\"{}\": {:.9g}", c == 0 ? "" : ", ", r.counters[c].first, r.counters[c].second);
+        json += "}";
+    }
+    return json + "}";
+}
+
+
+// min_s by name, from results this wrote: one workload per line
+std::map<std::string, f64> read_baseline(const std::string &path) {
+    std::map<std::string, f64> baseline;
+    std::ifstream file(path);
+    for (std::string line; std::getline(file, line);) {
+        const size_t name {line.find("\"name\": \"")}, min {line.find("\"min_s\": ")};
+        if (name == std::string::npos || min == std::string::npos)
+            continue;
+        const size_t begin {name + 9};
+        baseline[line.substr(begin, line.find('"', begin) - begin)] = strtod(line.c_str() + min + 9, nullptr);
+    }
+    return baseline;
+}
+
+
+std::string command_output(const std::string &command) {
+    std::string output;
+    if (FILE *pipe = popen(command.c_str(), "r")) {
+        char buffer[256];
+        while (fgets(buffer, sizeof(buffer), pipe) != nullptr)
+            output += buffer;
+        pclose(pipe);
+    }
+    while (!output.empty() && output.back() == '\n')
+        output.pop_back();
+    return output;
+}
+
+
+int main(int argc, char** argv) {
+    // benchmark [--sizes 1000000,10000000,100000000] [--repetitions 5] [--threshold 0.05]
+    //           [--baseline path] [--save-baseline] [--out benchmark.json] [--data dir]
+    //           [--resolution 0.005] [--timeout seconds] [--flags "the compiler and flags of the build"]
+    std::vector<u64> sizes {1000000, 10000000, 100000000};
+    u64 repetitions {5};
+    f64 threshold {0.05}, resolution {0.005};
+    std::string baseline_path, out_path {"benchmark.json"}, data_dir, flags;
+    bool save_baseline {false};
+    unsigned timeout {3600};
+    for (int i = 1; i < argc; ++i) {
+        const std::string arg {argv[i]};
+        if (arg == "--save-baseline") {
+            save_baseline = true;
+            continue;
+        }
+        if (i + 1 == argc)
+            throw std::runtime_error{std::format("Missing value for {}", arg)};
+        const std::string value {argv[++i]};
+        if (arg == "--sizes") {
+            sizes.clear();
+            std::stringstream stream(value);
+            for (std::string size; std::getline(stream, size, ',');)
+                sizes.push_back((u64)strtod(size.c_str(), nullptr));  // 1e6 as well as 1000000
+        } else if (arg == "--repetitions")
+            repetitions = std::max(1ull, strtoull(value.c_str(), nullptr, 10));
+        else if (arg == "--threshold")
+            threshold = strtod(value.c_str(), nullptr);
+        else if (arg == "--resolution")
+            resolution = strtod(value.c_str(), nullptr);
+        else if (arg == "--baseline")
+            baseline_path = value;
+        else if (arg == "--out")
+            out_path = value;
+        else if (arg == "--data")
+            data_dir = value;
+        else if (arg == "--timeout")
+            timeout = strtoul(value.c_str(), nullptr, 10);
+        else if (arg == "--flags")
+            flags = value;
+        else
+            throw std::runtime_error{"Invalid option"};
+    }
+    namespace fs = std::filesystem;
+    const std::string sim {fs::absolute("part1/sim8086")}, haversine {fs::absolute("part2/haversine")},
+        generator {fs::absolute("part2/haversine_generator")};
+    for (const std::string &program : {sim, haversine, generator})
+        if (access(program.c_str(), X_OK) != 0)
+            throw std::runtime_error{std::format("No {}, run make first", program)};
+    // the inputs go to disk, 1e8 pairs are about 10 GB
+    const bool own_data {data_dir.empty()};
+    if (own_data) {
+        char dir_template[] {"/var/tmp/benchmark.XXXXXX"};
+        const char *made {mkdtemp(dir_template)};
+        if (made == nullptr)
+            throw std::runtime_error{std::format("Cannot create {}", dir_template)};
+        data_dir = made;
+    }
+    std::vector<Result> results;
+
+    const struct {
+        const char *name;
+        std::vector<std::string> args;
+    } haversine_modes[] {
+        {"f64", {}}, {"deterministic", {"--deterministic"}}, {"f32", {"--f32"}},
+        {"fread", {"--input", "fread"}}, {"mmap", {"--input", "mmap"}}, {"pread", {"--input", "pread"}},
+    };
+    const std::string input {data_dir + "/haversine_input.json"};
+    for (const u64 &size : sizes)
+        for (const char *method : {"uniform", "clustered"}) {
+            // generated once, needed whole for the next ones
+            const Result generated {repeat(
+                std::format("generator/{}/{}", method, size), {generator, method, "1", std::to_string(size)},
+                data_dir, 1, timeout, size, "pairs/s"
+            )};
+            results.push_back(generated);
+            if (!generated.error.empty())
+                continue;
+            for (const auto &mode : haversine_modes) {
+                std::vector<std::string> args {haversine, input};
+                args.insert(args.end(), mode.args.begin(), mode.args.end());
+                results.push_back(repeat(
+                    std::format("haversine/{}/{}/{}", mode.name, method, size), args, data_dir, repetitions, timeout, size, "pairs/s"
+                ));
+            }
+            fs::remove(input);
+        }
+
+    // the listings are small, their times mostly starting the process
+    const struct {
+        const char *name;
+        std::vector<std::string> args;
+    } sim_modes[] {
+        {"disassemble", {}}, {"bulk", {"-b"}}, {"simulate", {"-s"}}, {"clocks", {"-c"}},
+        {"queue", {"-q"}}, {"queue8088", {"-q", "8088"}}, {"analysis", {"-a"}}, {"analysis-json", {"-a", "json"}},
+        {"parallel", {"-p", "4"}}, {"equivalence", {"-e"}},
+    };
+    std::vector<fs::path> listings;
+    for (const auto &entry : fs::directory_iterator("part1/tests"))
+        if (entry.path().filename().string().starts_with("listing_") && !entry.path().has_extension())
+            listings.push_back(entry.path());
+    std::sort(listings.begin(), listings.end());
+    for (const fs::path &listing : listings)
+        for (const auto &mode : sim_modes) {
+            std::vector<std::string> args {sim, listing.string()};
+            args.insert(args.end(), mode.args.begin(), mode.args.end());
+            results.push_back(repeat(
+                std::format("sim8086/{}/{}", mode.name, listing.filename().string()), args, ".", repetitions,
+                std::min(timeout, 10u), fs::file_size(listing), "bytes/s"
+            ));
+        }
+    results.push_back(repeat(
+        "sim8086/kernels", {sim, "part1/tests/listing_0037", "-k"}, ".", repetitions, timeout, 1, "runs/s"
+    ));
+    // assembled by the Makefile when nasm is there
+    for (const char *program : {"loop", "memory", "straight", "strings"}) {
+        const std::string path {std::format("part1/bench/{}", program)};
+        if (!fs::exists(path))
+            continue;
+        const std::vector<Result> modes {sim_benchmark(sim, path, std::format("sim8086/bench/{}", program), data_dir + "/bench.csv")};
+        results.insert(results.end(), modes.begin(), modes.end());
+        results.push_back(repeat(
+            std::format("sim8086/bench/{}/equivalence", program), {sim, path, "-e"}, ".", repetitions, timeout,
+            fs::file_size(path), "bytes/s"
+        ));
+    }
+    if (own_data)
+        fs::remove_all(data_dir);
+
+    std::ofstream out(out_path);
+    out << std::format(
+        "{{\"commit\": \"{}\", \"flags\": \"{}\", \"repetitions\": {},\n\"results\": [\n",
+        command_output("git rev-parse --short HEAD"), flags, repetitions
+    );
+    for (size_t r = 0; r < results.size(); ++r)
+        out << to_json(results[r]) << (r + 1 < results.size() ? ",\n" : "\n");
+    out << "]}" << std::endl;
+    out.close();
+    std::cout << "results in " << out_path << std::endl;
+
+    if (baseline_path.empty())
+        return 0;
+    if (save_baseline) {
+        fs::copy_file(out_path, baseline_path, fs::copy_options::overwrite_existing);
+        std::cout << "saved as the baseline in " << baseline_path << std::endl;
+        return 0;
+    }
+    if (!fs::exists(baseline_path)) {
+        std::cout << "no baseline in " << baseline_path << ", make bench-baseline saves one" << std::endl;
+        return 0;
+    }
+    const std::map<std::string, f64> baseline {read_baseline(baseline_path)};
+    size_t nb_regressions {0}, nb_compared {0};
+    for (const Result &r : results) {
+        const auto base = baseline.find(r.name);
+        if (base == baseline.end() || base->second <= 0)
+            continue;
+        ++nb_compared;
+        if (!r.error.empty()) {
+            ++nb_regressions;
+            std::cout << std::format("REGRESSION {}: {}, baseline {:.6f} s", r.name, r.error, base->second) << std::endl;
+            continue;
+        }
+        const f64 change {r.min / base->second - 1};
+        if (change > threshold && r.min - base->second > resolution) {
+            ++nb_regressions;
+            std::cout << std::format(
+                "REGRESSION {}: {:.6f} s, baseline {:.6f} s, {:+.1f}%", r.name, r.min, base->second, change * 100
+            ) << std::endl;
+        }
+    }
+    std::cout << std::format(
+        "{} workloads compared to {}, {} slower by more than {:.0f}%", nb_compared, baseline_path, nb_regressions, threshold * 100
+    ) << std::endl;
+    return nb_regressions > 0 ? 1 : 0;
+}
@@ -0,0 +1,163 @@
+#pragma once
+
+// Named scoped regions measured with perf_event_open counters: cycles,
+// instructions, branch misses, L1d and last level cache read misses and page
+// faults. The counters count the whole process, threads created after
+// start_profiling included, in user space only so that the default
+// perf_event_paranoid allows them. A counter the kernel refuses is reported
+// as n/a, and without any, regions still get their time. Regions are
+// inclusive, a nested one is also counted in the one around it.
+
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <iterator>
+#include <mutex>
+#include <string>
+#include <vector>
+
+
+static constexpr struct {
+    const char *name;
+    uint32_t type;
+    uint64_t config;
+} PROFILE_COUNTERS[] {
+    {"cycles",       PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+    {"instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+    {"branch misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+    {"l1d misses",   PERF_TYPE_HW_CACHE,
+     PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)},
+    {"llc misses",   PERF_TYPE_HW_CACHE,
+     PERF_COUNT_HW_CACHE_LL | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)},
+    {"page faults",  PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS},
+};
+static constexpr size_t NB_PROFILE_COUNTERS {std::size(PROFILE_COUNTERS)};
+enum ProfileCounters { ProfileCycles, ProfileInstructions, ProfileBranchMisses, ProfileL1dMisses, ProfileLlcMisses, ProfilePageFaults };
+
+
+struct ProfileSample {
+    double seconds {0};
+    std::array<double, NB_PROFILE_COUNTERS> counts {};
+};
+
+
+struct ProfileRegion {
+    const char *name;
+    uint64_t calls {0};
+    ProfileSample total;
+};
+
+
+struct Profiler {
+    bool enabled {false};
+    std::array<int, NB_PROFILE_COUNTERS> fds;
+    std::vector<ProfileRegion> regions;  // in order of first use
+    std::mutex mutex;
+};
+inline Profiler PROFILER;
+
+
+// Opens the counters, before the threads to count are created
+inline void start_profiling() {
+    PROFILER.enabled = true;
+    for (size_t c = 0; c < NB_PROFILE_COUNTERS; ++c) {
+        perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = PROFILE_COUNTERS[c].type;
+        attr.config = PROFILE_COUNTERS[c].config;
+        attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+        attr.inherit = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        PROFILER.fds[c] = (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+    }
+}
+
+
+// counts so far, scaled up when the kernel had to multiplex the counters
+inline ProfileSample profile_now() {
+    ProfileSample sample;
+    sample.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    for (size_t c = 0; c < NB_PROFILE_COUNTERS; ++c) {
+        uint64_t values[3];  // value, time enabled, time running
+        if (PROFILER.fds[c] < 0 || read(PROFILER.fds[c], values, sizeof(values)) != sizeof(values))
+            continue;
+        sample.counts[c] = values[2] == 0 ? 0 : (double)values[0] * values[1] / values[2];
+    }
+    return sample;
+}
+
+
+// Counts from its construction to its destruction under its name, nothing
+// unless profiling started
+struct ProfileScope {
+    const char *name;
+    ProfileSample start;
+
+    explicit ProfileScope(const char *region_name) : name {region_name} {
+        if (PROFILER.enabled)
+            start = profile_now();
+    }
+
+    ~ProfileScope() {
+        if (!PROFILER.enabled)
+            return;
+        const ProfileSample end {profile_now()};
+        std::lock_guard lock {PROFILER.mutex};
+        auto region = PROFILER.regions.begin();
+        while (region != PROFILER.regions.end() && strcmp(region->name, name) != 0)
+            ++region;
+        if (region == PROFILER.regions.end())
+            region = PROFILER.regions.insert(region, ProfileRegion{name});
+        ++region->calls;
+        region->total.seconds += end.seconds - start.seconds;
+        for (size_t c = 0; c < NB_PROFILE_COUNTERS; ++c)
+            region->total.counts[c] += end.counts[c] - start.counts[c];
+    }
+};
+
+
+// One line per region: time, cycles, instructions, instructions per cycle,
+// then misses per thousand instructions and page faults
+inline void print_profile(FILE *out) {
+    if (!PROFILER.enabled)
+        return;
+    auto available = [](const int &c) { return PROFILER.fds[c] >= 0; };
+    std::string missing;
+    for (size_t c = 0; c < NB_PROFILE_COUNTERS; ++c)
+        if (!available(c))
+            missing += std::string{missing.empty() ? "" : ", "} + PROFILE_COUNTERS[c].name;
+    if (!missing.empty())
+        fprintf(out, "counters not permitted or not supported: %s\n", missing.c_str());
+
+    fprintf(out, "%-24s %8s %12s %14s %14s %6s %14s %14s %14s %12s\n", "region", "calls", "ms",
+            "cycles", "instructions", "ipc", "br miss/kinst", "l1d miss/kinst", "llc miss/kinst", "page faults");
+    auto field = [&](const bool &ok, const char *format, const double &value) {
+        char text[32];
+        if (ok)
+            snprintf(text, sizeof(text), format, value);
+        else
+            snprintf(text, sizeof(text), "n/a");
+        return std::string{text};
+    };
+    for (const auto &region : PROFILER.regions) {
+        const auto &n = region.total.counts;
+        const bool has_inst = available(ProfileInstructions) && n[ProfileInstructions] > 0;
+        auto per_kinst = [&](const int &c) { return field(has_inst && available(c), "%.3f", n[c] * 1000 / n[ProfileInstructions]); };
+        fprintf(out, "%-24s %8llu %12.3f %14s %14s %6s %14s %14s %14s %12s\n",
+                region.name, (unsigned long long)region.calls, region.total.seconds * 1e3,
+                field(available(ProfileCycles), "%.0f", n[ProfileCycles]).c_str(),
+                field(available(ProfileInstructions), "%.0f", n[ProfileInstructions]).c_str(),
+                field(has_inst && available(ProfileCycles) && n[ProfileCycles] > 0, "%.2f", n[ProfileInstructions] / n[ProfileCycles]).c_str(),
+                per_kinst(ProfileBranchMisses).c_str(), per_kinst(ProfileL1dMisses).c_str(), per_kinst(ProfileLlcMisses).c_str(),
+                field(available(ProfilePageFaults), "%.0f", n[ProfilePageFaults]).c_str());
+    }
+}
@@ -0,0 +1,12 @@
+; tight add/cmp/jne loop, 100000 instructions
+
+bits 16
+
+mov si, 0
+mov bx, 3
+top:
+add ax, bx
+add dx, ax
+add si, 1
+cmp si, 20000
+jne top
@@ -0,0 +1,34 @@
+; mov through every addressing mode, with and without displacements,
+; 10000 iterations of 20 movs; data stays above the code
+
+bits 16
+
+mov bx, 0x4000
+mov bp, 0x5000
+mov si, 0x1000
+mov di, 0x2000
+mov cx, 0
+top:
+mov ax, [bx + si]
+mov [bx + di], ax
+mov dx, [bp + si]
+mov [bp + di], dx
+mov ax, [si]
+mov [di], ax
+mov dx, [bp]
+mov [bx], dx
+mov al, [bx + si + 4]
+mov [bx + di - 4], al
+mov ax, [bp + si + 300]
+mov [bp + di - 300], ax
+mov dx, [si + 1000]
+mov [di + 8], dx
+mov ax, [bp + 2]
+mov [bx + 6000], ax
+mov dx, [0x7000]
+mov [0x7002], dx
+mov word [bx + si + 12], 7
+mov byte [bp + di + 1000], 3
+add cx, 1
+cmp cx, 10000
+jne top
@@ -0,0 +1,19 @@
+; long straight-line code, 16000 instructions and no jumps; writes stay
+; above the code
+
+bits 16
+
+mov bx, 0xC000
+mov bp, 0xD000
+%rep 1600
+mov ax, 1234
+add ax, bx
+sub cx, ax
+mov dx, [bx + 8]
+add [bp + 4], dx
+cmp ax, cx
+mov si, ax
+sub si, 17
+add di, si
+cmp byte [bx + 3], 5
+%endrep
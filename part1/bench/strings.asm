@@ -0,0 +1,35 @@
+; rep string instructions over 8 KB buffers, 1000 iterations of 28
+; instructions; data stays above the code
+
+bits 16
+
+mov bp, 1000
+top:
+cld
+mov ax, 0x4142
+mov di, 0x2000
+mov cx, 4096
+rep stosw
+mov si, 0x2000
+mov di, 0x4000
+mov cx, 4096
+rep movsw
+mov si, 0x2000
+mov di, 0x4000
+mov cx, 8192
+repe cmpsb
+mov al, 0
+mov di, 0x4000
+mov cx, 8192
+repne scasb
+mov si, 0x2000      ; fill, every byte copies the one before
+mov di, 0x2001
+mov cx, 8191
+rep movsb
+std
+mov si, 0x5FFE
+mov di, 0x3FFE
+mov cx, 4096
+rep movsw
+dec bp
+jne top
@@ -0,0 +1,1122 @@
+#include "lib8086.h"
+
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <cassert>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <format>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <optional>
+#include <random>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <stdlib.h>
+
+
+// Differential fuzzing of sim8086 and the Cpu of lib8086.
+//
+// Round trips: random instruction streams are disassembled by sim8086, used
+// as a black box, assembled back with nasm, and disassembled and assembled
+// again. The first pass gives nasm's encoding of every instruction, the
+// second must give the very same bytes. The encodings come from an opcode
+// table of its own, not from the decoder's.
+//
+// Simulation: random streams of ALU, shift, multiply, divide, mov, string,
+// xlat, aam, aad and jcc instructions are encoded and executed by a reference
+// model at the same time, then run on a Cpu in process, and the final
+// registers, flags and memory must match. Flags the 8086 leaves undefined are
+// not compared, nor branched on. A second Cpu runs them with superinstructions
+// and must end the same as the first. A mismatch is shrunk to the shortest
+// failing prefix.
+//
+// Listings: larger random streams disassembled in bulk (-b) and in parallel
+// (-p) must give the plain listing, whichever instructions the ranges split.
+//
+// History: the same streams run under a History, which goes back and forth in
+// them and looks for the last writes and changes; where it lands must match a
+// run from the start.
+
+
+static std::string SIM8086;
+static bool HAS_SIM {false};
+static bool HAS_NASM {false};
+
+
+std::string read_file(const std::string &path) {
+    std::ifstream file(path, std::ios::binary);
+    std::stringstream content;
+    content << file.rdbuf();
+    return content.str();
+}
+
+
+void write_file(const std::string &path, const std::vector<u8> &bytes) {
+    std::ofstream file(path, std::ios::binary);
+    file.write(reinterpret_cast<const char*>(bytes.data()), bytes.size());
+}
+
+
+bool run(const std::string &dir, const std::string &command) {
+    return std::system(std::format("cd {} && {} 2>/dev/null", dir, command).c_str()) == 0;
+}
+
+
+std::vector<std::string> lines(const std::string &text) {
+    std::vector<std::string> ret;
+    std::stringstream stream(text);
+    for (std::string line; std::getline(stream, line);)
+        ret.push_back(line);
+    return ret;
+}
+
+
+// ---------------------------------------------------------------------------
+// round trips
+
+
+// what follows each opcode byte
+struct Layout {
+    bool valid;
+    bool modrm;
+    u8 exts;        // allowed values of the mod reg rm middle field
+    u8 imm;         // immediate bytes after the mod reg rm byte and displacement
+    bool mem_only;  // no register form in assembly (lea, les, lds, far indirect)
+};
+
+
+constexpr Layout layout(const u8 op) {
+    const u8 w = op & 1;
+    if (op < 0x40) {
+        switch (op & 0b111) {
+            case 0: case 1: case 2: case 3:
+                return {true, true, 0xFF, 0, false};
+            case 4: case 5:
+                return {true, false, 0, (u8)(w + 1), false};
+            default:
+                // push/pop sr and the decimal adjusts, but no pop cs nor prefixes
+                return {op != 0x0F && (op & 0xE7) != 0x26, false, 0, 0, false};
+        }
+    }
+    if (op < 0x60)
+        return {true, false, 0, 0, false};  // inc, dec, push, pop reg
+    if (op < 0x70)
+        return {false};
+    if (op < 0x80)
+        return {true, false, 0, 1, false};  // jcc
+    if (op >= 0x84 && op <= 0x8B)
+        return {true, true, 0xFF, 0, false};  // test, xchg, mov
+    if (op >= 0xB0 && op <= 0xBF)
+        return {true, false, 0, (u8)(op & 0b1000 ? 2 : 1), false};  // mov reg, imm
+    switch (op) {
+        case 0x80: case 0x82: case 0x83:
+            return {true, true, 0xFF, 1, false};
+        case 0x81:
+            return {true, true, 0xFF, 2, false};
+        case 0x8C:
+            return {true, true, 0x0F, 0, false};
+        case 0x8E:
+            return {true, true, 0x0D, 0, false};  // no mov cs
+        case 0x8D:
+            return {true, true, 0xFF, 0, true};
+        case 0x8F:
+            return {true, true, 0x01, 0, false};
+        case 0x9A:
+            return {true, false, 0, 4, false};
+        case 0xA0: case 0xA1: case 0xA2: case 0xA3:
+            return {true, false, 0, 2, false};
+        case 0xA8:
+            return {true, false, 0, 1, false};
+        case 0xA9:
+            return {true, false, 0, 2, false};
+        case 0xC2: case 0xCA:
+            return {true, false, 0, 2, false};
+        case 0xC4: case 0xC5:
+            return {true, true, 0xFF, 0, true};
+        case 0xC6:
+            return {true, true, 0x01, 1, false};
+        case 0xC7:
+            return {true, true, 0x01, 2, false};
+        case 0xCD:
+            return {true, false, 0, 1, false};
+        case 0xD0: case 0xD1: case 0xD2: case 0xD3:
+            return {true, true, 0xBF, 0, false};
+        case 0xD4: case 0xD5:
+            return {true, false, 0, 1, false};  // the base, 0x0A but for the generator's other ones
+        case 0xE0: case 0xE1: case 0xE2: case 0xE3:
+        case 0xE4: case 0xE5: case 0xE6: case 0xE7: case 0xEB:
+            return {true, false, 0, 1, false};
+        case 0xE8: case 0xE9:
+            return {true, false, 0, 2, false};
+        case 0xEA:
+            return {true, false, 0, 4, false};
+        case 0xF6:
+            return {true, true, 0xFD, 0, false};  // test /0 has an immediate, added by the generator
+        case 0xF7:
+            return {true, true, 0xFD, 0, false};
+        case 0xFE:
+            return {true, true, 0x03, 0, false};
+        case 0xFF:
+            return {true, true, 0x7F, 0, false};
+        case 0x60: case 0xC0: case 0xC1: case 0xC8: case 0xC9: case 0xD6: case 0xF0: case 0xF1: case 0xF2: case 0xF3:
+            return {false};
+    }
+    if (op >= 0xD8 && op <= 0xDF)
+        return {false};  // 8087 escapes
+    return {true, false, 0, 0, false};
+}
+
+
+bool is_string_op(const u8 op) {
+    return (op >= 0xA4 && op <= 0xA7) || (op >= 0xAA && op <= 0xAF);
+}
+
+
+template<typename G>
+void random_instruction(G &rng, std::vector<u8> &bytes) {
+    u8 op;
+    do {
+        op = rng() & 0xFF;
+    } while (!layout(op).valid);
+    const Layout l = layout(op);
+
+    if (is_string_op(op) && rng() % 2 == 0)
+        bytes.push_back(rng() % 2 == 0 ? 0xF3 : 0xF2);
+    if ((l.modrm || is_string_op(op) || op == 0xD7) && rng() % 4 == 0)
+        bytes.push_back(0x26 | ((rng() % 4) << 3));  // segment override, shown on xlat and string instructions
+    bytes.push_back(op);
+
+    u8 ext {0};
+    if (l.modrm) {
+        u8 mod = rng() % (l.mem_only ? 3 : 4);
+        do {
+            ext = rng() % 8;
+        } while (((l.exts >> ext) & 1) == 0);
+        if ((op == 0xFF && (ext == 3 || ext == 5)) && mod == 0b11)
+            mod = rng() % 3;  // far indirect needs memory
+        u8 rm = rng() % 8;
+        bytes.push_back((mod << 6) | (ext << 3) | rm);
+        u8 disp = mod == 0b01 ? 1 : mod == 0b10 || (mod == 0b00 && rm == 0b110) ? 2 : 0;
+        for (u8 i = 0; i < disp; ++i)
+            bytes.push_back(rng() & 0xFF);
+    }
+    u8 imm = l.imm;
+    if ((op == 0xF6 || op == 0xF7) && ext == 0)
+        imm = (op & 1) + 1;  // test rm, imm
+    if ((op == 0xD4 || op == 0xD5) && rng() % 2 == 0) {
+        bytes.push_back(0x0A);
+        return;
+    }
+    for (u8 i = 0; i < imm; ++i)
+        bytes.push_back(rng() & 0xFF);
+}
+
+
+struct Failure {
+    std::string kind;
+    u64 seed;
+    std::string detail;
+};
+
+
+// disassembles, assembles, and does it again, the two assemblies must match
+std::optional<Failure> round_trip(const std::string &dir, const u64 &seed, const size_t &nb_instrs) {
+    std::mt19937_64 rng(seed);
+    std::vector<u8> bytes;
+    for (size_t i = 0; i < nb_instrs; ++i)
+        random_instruction(rng, bytes);
+    write_file(dir + "/random.bin", bytes);
+
+    if (!run(dir, std::format("{} random.bin > pass0.asm", SIM8086)))
+        return Failure{"decode", seed, "random.bin does not disassemble, see pass0.asm"};
+    if (!run(dir, "nasm pass0.asm -o pass1.bin 2> nasm.txt"))
+        return Failure{"nasm", seed, read_file(dir + "/nasm.txt")};
+    if (!run(dir, std::format("{} pass1.bin > pass1.asm", SIM8086)))
+        return Failure{"decode", seed, "nasm output does not disassemble"};
+    if (!run(dir, "nasm pass1.asm -o pass2.bin 2> nasm.txt"))
+        return Failure{"nasm", seed, read_file(dir + "/nasm.txt")};
+
+    if (read_file(dir + "/pass1.bin") == read_file(dir + "/pass2.bin"))
+        return std::nullopt;
+    run(dir, std::format("{} pass2.bin > pass2.asm", SIM8086));
+    auto pass1 = lines(read_file(dir + "/pass1.asm"));
+    auto pass2 = lines(read_file(dir + "/pass2.asm"));
+    for (size_t l = 1; l < std::min(pass1.size(), pass2.size()); ++l)
+        if (pass1[l] != pass2[l])
+            return Failure{"round trip", seed, std::format("line {}: {} reassembles as {}", l, pass1[l], pass2[l])};
+    return Failure{"round trip", seed, "different lengths"};
+}
+
+
+// the bulk and parallel listings must be the plain one, on up to 8 ranges of -p
+std::optional<Failure> listings(const std::string &dir, const u64 &seed) {
+    std::mt19937_64 rng(seed);
+    std::vector<u8> bytes;
+    const size_t size {(1 + rng() % 8) << 16};
+    while (bytes.size() < size)
+        random_instruction(rng, bytes);
+    write_file(dir + "/listing.bin", bytes);
+
+    if (!run(dir, std::format("{} listing.bin > listing.asm", SIM8086)))
+        return Failure{"decode", seed, "listing.bin does not disassemble, see listing.asm"};
+    auto plain = lines(read_file(dir + "/listing.asm"));
+    for (const char *mode : {"-b", "-p 2", "-p 3", "-p 7"}) {
+        if (!run(dir, std::format("{} listing.bin {} > listing_mode.asm", SIM8086, mode)))
+            return Failure{"listing", seed, std::format("{} fails", mode)};
+        auto other = lines(read_file(dir + "/listing_mode.asm"));
+        for (size_t l = 0; l < std::min(plain.size(), other.size()); ++l)
+            if (plain[l] != other[l])
+                return Failure{"listing", seed, std::format("{} line {}: {} instead of {}", mode, l, other[l], plain[l])};
+        if (plain.size() != other.size())
+            return Failure{"listing", seed, std::format("{} gives {} lines instead of {}", mode, other.size(), plain.size())};
+    }
+    return std::nullopt;
+}
+
+
+// ---------------------------------------------------------------------------
+// simulation against a reference model
+
+
+enum RefFlags : u16 { CF = 1 << 0, PF = 1 << 2, AF = 1 << 4, ZF = 1 << 6, SF = 1 << 7, DF = 1 << 10, OF = 1 << 11 };
+static constexpr u16 MODEL_FLAGS {CF | PF | AF | ZF | SF | DF | OF};
+
+
+// the flags the model knows, by their printed letter
+static constexpr struct {char letter; u16 bit;} FLAG_LETTERS[] {
+    {'C', CF}, {'P', PF}, {'A', AF}, {'Z', ZF}, {'S', SF}, {'D', DF}, {'O', OF},
+};
+
+
+// Segment registers are 0 but for es, which string instructions set below
+// 0x1000, and which segment prefixes make them and xlat read through
+struct RefCpu {
+    u16 regs[8] {};
+    u16 sregs[4] {};  // es cs ss ds
+    u16 ip {0};
+    u16 flags {0};
+    u16 undefined {0};  // flags the last instruction writing them left undefined
+    std::vector<u8> mem = std::vector<u8>(1 << 17, 0);
+    std::vector<std::pair<u32, u8>> *journal {nullptr};  // old bytes of the stores, while set
+
+    u16 get(u8 reg, u8 w) const {
+        if (w == 1)
+            return regs[reg];
+        return (regs[reg & 3] >> (reg & 4 ? 8 : 0)) & 0xFF;
+    }
+    void set(u8 reg, u8 w, u16 val) {
+        if (w == 1)
+            regs[reg] = val;
+        else if (reg & 4)
+            regs[reg & 3] = (regs[reg & 3] & 0x00FF) | ((val & 0xFF) << 8);
+        else
+            regs[reg & 3] = (regs[reg & 3] & 0xFF00) | (val & 0xFF);
+    }
+    // words wrap in their segment
+    u16 load(u16 addr, u8 w, u16 seg = 0) const {
+        const u32 base = (u32)seg << 4;
+        return w == 1 ? mem[base + addr] | (mem[base + (u16)(addr + 1)] << 8) : mem[base + addr];
+    }
+    void store(u16 addr, u8 w, u16 val, u16 seg = 0) {
+        const u32 base = (u32)seg << 4;
+        if (journal != nullptr) {
+            journal->push_back({base + addr, mem[base + addr]});
+            if (w == 1)
+                journal->push_back({base + (u16)(addr + 1), mem[base + (u16)(addr + 1)]});
+        }
+        mem[base + addr] = val & 0xFF;
+        if (w == 1)
+            mem[base + (u16)(addr + 1)] = val >> 8;
+    }
+
+    void write_flags(u16 written, u16 values, u16 undefined_now = 0) {
+        flags = (flags & ~written) | (values & written);
+        undefined = (undefined & ~written) | undefined_now;
+    }
+    static u16 szp(u16 r, u8 w) {
+        u16 ret {0};
+        if (r == 0)
+            ret |= ZF;
+        if (r & (w == 1 ? 0x8000 : 0x80))
+            ret |= SF;
+        if ((std::popcount((unsigned)(r & 0xFF)) & 1) == 0)
+            ret |= PF;
+        return ret;
+    }
+    static int sext(u16 v, u8 w) {
+        return w == 1 ? (int)(s16)v : (int)(s8)v;
+    }
+
+    // the ALU group by its /ext: add or adc sbb and sub xor cmp, with every flag as on the 8086
+    u16 alu(u8 ext, u16 a, u16 b, u8 w) {
+        u32 mask = w == 1 ? 0xFFFF : 0xFF;
+        if (ext == 1 || ext == 4 || ext == 6) {
+            u16 r = (ext == 1 ? a | b : ext == 4 ? a & b : a ^ b) & mask;
+            write_flags(CF | PF | AF | ZF | SF | OF, szp(r, w), AF);
+            return r;
+        }
+        bool subtract = ext == 3 || ext == 5 || ext == 7;
+        u32 carry = (ext == 2 || ext == 3) && (flags & CF) ? 1 : 0;
+        u32 res = subtract ? (u32)a - b - carry : (u32)a + b + carry;
+        int sres = subtract ? sext(a, w) - sext(b, w) - (int)carry : sext(a, w) + sext(b, w) + (int)carry;
+        int lo = w == 1 ? -32768 : -128, hi = w == 1 ? 32767 : 127;
+        u16 r = res & mask;
+        u16 f = szp(r, w);
+        if (res > mask)
+            f |= CF;
+        if ((a ^ b ^ res) & 0x10)
+            f |= AF;
+        if (sres < lo || sres > hi)
+            f |= OF;
+        write_flags(CF | PF | AF | ZF | SF | OF, f);
+        return r;
+    }
+
+    // inc and dec, which leave the carry alone
+    u16 inc_dec(bool dec, u16 a, u8 w) {
+        u16 carry = flags & CF, carry_undefined = undefined & CF;
+        u16 r = alu(dec ? 5 : 0, a, 1, w);
+        flags = (flags & ~CF) | carry;
+        undefined = (undefined & ~CF) | carry_undefined;
+        return r;
+    }
+
+    // the shift group by its /ext: rol ror rcl rcr shl shr - sar, one bit at a time
+    u16 shift(u8 ext, u16 a, u8 count, u8 w) {
+        if (count == 0)
+            return a;
+        u16 top = w == 1 ? 0x8000 : 0x80;
+        u16 mask = w == 1 ? 0xFFFF : 0xFF;
+        bool cf = flags & CF;
+        u16 r = a;
+        for (u8 i = 0; i < count; ++i) {
+            bool msb = r & top, lsb = r & 1;
+            switch (ext) {
+                case 0: r = (r << 1) | msb; cf = msb; break;
+                case 1: r = (r >> 1) | (lsb ? top : 0); cf = lsb; break;
+                case 2: r = (r << 1) | cf; cf = msb; break;
+                case 3: r = (r >> 1) | (cf ? top : 0); cf = lsb; break;
+                case 4: r = r << 1; cf = msb; break;
+                case 5: r = r >> 1; cf = lsb; break;
+                case 7: r = (r >> 1) | (msb ? top : 0); cf = lsb; break;
+            }
+            r &= mask;
+        }
+        bool r_msb = r & top, r_next = r & (top >> 1);
+        bool of = ext == 1 || ext == 3 ? r_msb != r_next
+                : ext == 5 ? (a & top) != 0
+                : ext == 7 ? false
+                : r_msb != cf;
+        u16 f = (cf ? CF : 0) | (of ? OF : 0);
+        u16 undefined_now = count == 1 ? 0 : OF;
+        if (ext < 4)
+            write_flags(CF | OF, f, undefined_now);
+        else
+            write_flags(CF | PF | AF | ZF | SF | OF, f | szp(r, w), undefined_now | AF);
+        return r;
+    }
+
+    // mul imul div idiv by their /ext, on ax and dx
+    void multiply_divide(u8 ext, u16 src, u8 w) {
+        if (ext == 4 || ext == 5) {
+            long long a = ext == 4 ? get(0, w) : sext(get(0, w), w);
+            long long b = ext == 4 ? src : sext(src, w);
+            long long product = a * b;
+            bool fits = ext == 4 ? product <= (w == 1 ? 0xFFFF : 0xFF)
+                                 : product == sext(product & (w == 1 ? 0xFFFF : 0xFF), w);
+            if (w == 1) {
+                regs[0] = product & 0xFFFF;
+                regs[2] = (product >> 16) & 0xFFFF;
+            } else {
+                regs[0] = product & 0xFFFF;
+            }
+            write_flags(CF | PF | AF | ZF | SF | OF, fits ? 0 : CF | OF, PF | AF | ZF | SF);
+            return;
+        }
+        long long dividend = w == 1 ? ((u32)regs[2] << 16) | regs[0] : regs[0];
+        long long divisor = src;
+        if (ext == 7) {
+            dividend = w == 1 ? (long long)(int32_t)dividend : (long long)(s16)dividend;
+            divisor = sext(src, w);
+        }
+        long long q = dividend / divisor, r = dividend % divisor;
+        if (w == 1) {
+            regs[0] = q & 0xFFFF;
+            regs[2] = r & 0xFFFF;
+        } else {
+            set(0, 0, q & 0xFF);
+            set(4, 0, r & 0xFF);
+        }
+        write_flags(CF | PF | AF | ZF | SF | OF, 0, CF | PF | AF | ZF | SF | OF);
+    }
+    bool divide_error(u8 ext, u16 src, u8 w) const {
+        if ((src & (w == 1 ? 0xFFFF : 0xFF)) == 0)
+            return true;
+        long long dividend = w == 1 ? ((u32)regs[2] << 16) | regs[0] : regs[0];
+        if (ext == 6)
+            return dividend / src > (w == 1 ? 0xFFFF : 0xFF);
+        dividend = w == 1 ? (long long)(int32_t)dividend : (long long)(s16)dividend;
+        long long q = dividend / sext(src, w);
+        long long limit = w == 1 ? 0x7FFF : 0x7F;  // the 8086 also faults on the most negative quotient
+        return q > limit || q < -limit;
+    }
+
+    // movs cmps scas lods stos by their opcode, element by element, from seg:si
+    // (ds or the segment prefix's) to es:di
+    void string_op(u8 op, u8 prefix, u8 seg) {
+        const u16 src_seg = sregs[seg], es = sregs[0];
+        const u8 w = op & 1;
+        const u16 delta = flags & DF ? -(w + 1) : w + 1;
+        u16 &si = regs[6], &di = regs[7];
+        const bool compares = (op & 0xFE) == 0xA6 || (op & 0xFE) == 0xAE;
+        do {
+            if (prefix != 0 && regs[1] == 0)
+                return;
+            switch (op & 0xFE) {
+                case 0xA4: store(di, w, load(si, w, src_seg), es); si += delta; di += delta; break;
+                case 0xA6: alu(7, load(si, w, src_seg), load(di, w, es), w); si += delta; di += delta; break;
+                case 0xAE: alu(7, get(0, w), load(di, w, es), w); di += delta; break;
+                case 0xAC: set(0, w, load(si, w, src_seg)); si += delta; break;
+                case 0xAA: store(di, w, get(0, w), es); di += delta; break;
+            }
+            if (prefix != 0)
+                --regs[1];
+            // repe goes on while equal, repne while not
+        } while (prefix != 0 && !(compares && ((flags & ZF) != 0) != (prefix == 0xF3)));
+    }
+
+    // the jcc pairs by the low bits of their opcode, without the negation bit
+    bool condition(u8 j) const {
+        bool cf = flags & CF, zf = flags & ZF, sf = flags & SF, of = flags & OF, pf = flags & PF;
+        switch (j) {
+            case 0: return of;
+            case 1: return cf;
+            case 2: return zf;
+            case 3: return cf || zf;
+            case 4: return sf;
+            case 5: return pf;
+            case 6: return sf != of;
+            default: return zf || sf != of;
+        }
+    }
+};
+
+
+std::string flag_letters(const u16 &flags) {
+    std::string ret;
+    for (const auto &f : FLAG_LETTERS)
+        if (flags & f.bit)
+            ret += f.letter;
+    return ret;
+}
+
+
+u16 flag_bits(const std::string &letters) {
+    u16 ret {0};
+    for (const auto &f : FLAG_LETTERS)
+        if (letters.find(f.letter) != std::string::npos)
+            ret |= f.bit;
+    return ret;
+}
+
+
+static constexpr u16 DATA_BEGIN {0x8000};  // code stays below, memory accesses above
+
+
+// Generates an instruction for the current state of the model, and executes it.
+// Returns the encoded bytes.
+template<typename G>
+std::vector<u8> sim_instruction(G &rng, RefCpu &cpu) {
+    std::vector<u8> bytes;
+    u8 w = rng() % 2;
+
+    // memory operand landing in the data area, as any mod/rm
+    u16 addr {0};
+    auto modrm_mem = [&](u8 mid, bool writes) {
+        u8 rm = rng() % 8;
+        static constexpr s8 bases[8][2] {{3, 6}, {3, 7}, {5, 6}, {5, 7}, {6, -1}, {7, -1}, {5, -1}, {3, -1}};
+        addr = DATA_BEGIN + rng() % (0xFFFF - DATA_BEGIN);  // never write a word wrapping into the code
+        if (!writes && cpu.ip != 0 && rng() % 16 == 0)
+            addr = 0xFFFF;  // but read some, the code is in the model memory
+        u16 base = cpu.regs[bases[rm][0]] + (bases[rm][1] >= 0 ? cpu.regs[bases[rm][1]] : 0);
+        u16 disp = addr - base;
+        if (rng() % 8 == 0) {  // direct address
+            bytes.push_back((mid << 3) | 0b110);
+            bytes.push_back(addr & 0xFF);
+            bytes.push_back(addr >> 8);
+        } else if (disp == 0 && rm != 0b110) {
+            bytes.push_back((mid << 3) | rm);
+        } else if ((s16)disp >= -128 && (s16)disp <= 127) {
+            bytes.push_back(0b01000000 | (mid << 3) | rm);
+            bytes.push_back(disp & 0xFF);
+        } else {
+            bytes.push_back(0b10000000 | (mid << 3) | rm);
+            bytes.push_back(disp & 0xFF);
+            bytes.push_back(disp >> 8);
+        }
+    };
+    // register or memory operand
+    bool is_mem {false};
+    u8 rm_reg {0};
+    auto modrm_any = [&](u8 mid, bool writes) {
+        is_mem = rng() % 2 == 0;
+        if (is_mem) {
+            modrm_mem(mid, writes);
+        } else {
+            rm_reg = rng() % 8;
+            bytes.push_back(0b11000000 | (mid << 3) | rm_reg);
+        }
+    };
+    auto rm_get = [&]() { return is_mem ? cpu.load(addr, w) : cpu.get(rm_reg, w); };
+    auto rm_set = [&](u16 val) {
+        if (is_mem)
+            cpu.store(addr, w, val);
+        else
+            cpu.set(rm_reg, w, val);
+    };
+    auto push_imm = [&](u16 imm, u8 size) {
+        bytes.push_back(imm & 0xFF);
+        if (size == 2)
+            bytes.push_back(imm >> 8);
+    };
+
+    // none or one of es cs ss ds, the segment implicit operands use after it
+    // when they used seg before: the last prefix counts
+    auto segment_prefix = [&](const u8 seg) -> u8 {
+        if (rng() % 2 == 0)
+            return seg;
+        const u8 sr = rng() % 4;
+        bytes.push_back(0x26 | (sr << 3));
+        return sr;
+    };
+
+    u16 mask = w == 1 ? 0xFFFF : 0xFF;
+    switch (rng() % 11) {
+        case 0: case 1: case 2: case 3: {
+            // the ALU group by its /ext, and 8 for mov
+            u8 op = rng() % 9;
+            if ((op == 2 || op == 3) && (cpu.undefined & CF))
+                op += 3;  // add and sub rather than adc and sbb on an undefined carry
+            auto apply = [&](u16 dest, u16 src) -> std::pair<bool, u16> {
+                if (op == 8)
+                    return {true, src};
+                u16 r = cpu.alu(op, dest, src, w);
+                return {op != 7, r};
+            };
+            switch (rng() % 4) {
+                case 0: {  // reg, reg
+                    u8 d = rng() % 2, reg = rng() % 8, rm = rng() % 8;
+                    u8 opcode = (op == 8 ? 0x88 : op << 3) | (d << 1) | w;
+                    bytes = {opcode, (u8)(0b11000000 | (reg << 3) | rm)};
+                    u8 dst = d ? reg : rm, src = d ? rm : reg;
+                    auto [write, r] = apply(cpu.get(dst, w), cpu.get(src, w));
+                    if (write)
+                        cpu.set(dst, w, r);
+                    break;
+                }
+                case 1: {  // reg, mem or mem, reg
+                    u8 d = rng() % 2, reg = rng() % 8;
+                    bytes = {(u8)((op == 8 ? 0x88 : op << 3) | (d << 1) | w)};
+                    modrm_mem(reg, d == 0 && op != 7);
+                    u16 m = cpu.load(addr, w), rv = cpu.get(reg, w);
+                    auto [write, r] = d ? apply(rv, m) : apply(m, rv);
+                    if (write) {
+                        if (d)
+                            cpu.set(reg, w, r);
+                        else
+                            cpu.store(addr, w, r);
+                    }
+                    break;
+                }
+                case 2: {  // reg, imm
+                    u8 reg = rng() % 8;
+                    u16 imm = rng() & mask;
+                    if (op == 8)
+                        bytes = {(u8)(0xB0 | (w << 3) | reg)};
+                    else
+                        bytes = {(u8)(0x80 | w), (u8)(0b11000000 | (op << 3) | reg)};
+                    push_imm(imm, w + 1);
+                    auto [write, r] = apply(cpu.get(reg, w), imm);
+                    if (write)
+                        cpu.set(reg, w, r);
+                    break;
+                }
+                case 3: {  // mem, imm
+                    bool sign_extended = op != 8 && w == 1 && rng() % 2 == 0;
+                    u16 imm = sign_extended ? (u16)(s16)(s8)(rng() & 0xFF) : rng() & mask;
+                    bytes = {(u8)(op == 8 ? 0xC6 | w : (sign_extended ? 0x83 : 0x80 | w))};
+                    modrm_mem(op == 8 ? 0 : op, op != 7);
+                    push_imm(imm, sign_extended ? 1 : w + 1);
+                    auto [write, r] = apply(cpu.load(addr, w), imm);
+                    if (write)
+                        cpu.store(addr, w, r);
+                    break;
+                }
+            }
+            break;
+        }
+        case 4: case 5: {  // test not neg mul imul div idiv, no /1
+            static constexpr u8 exts[] {0, 2, 3, 4, 5, 6, 7};
+            u8 ext = exts[rng() % 7];
+            bytes = {(u8)(0xF6 | w)};
+            modrm_any(ext, ext == 2 || ext == 3);
+            u16 val = rm_get();
+            if ((ext == 6 || ext == 7) && cpu.divide_error(ext, val, w)) {
+                ext = 4;  // mul on the same operand instead
+                bytes[1] = (bytes[1] & 0b11000111) | (ext << 3);
+            }
+            if (ext == 0) {
+                u16 imm = rng() & mask;
+                push_imm(imm, w + 1);
+                cpu.alu(4, val, imm, w);
+            } else if (ext == 2) {
+                rm_set(~val & mask);
+            } else if (ext == 3) {
+                rm_set(cpu.alu(5, 0, val, w));
+            } else {
+                cpu.multiply_divide(ext, val, w);
+            }
+            break;
+        }
+        case 6: {  // inc and dec
+            bool dec = rng() % 2;
+            if (w == 1 && rng() % 2 == 0) {
+                u8 reg = rng() % 8;
+                bytes = {(u8)(0x40 | (dec << 3) | reg)};
+                cpu.set(reg, 1, cpu.inc_dec(dec, cpu.get(reg, 1), 1));
+            } else {
+                bytes = {(u8)(0xFE | w)};
+                modrm_any(dec, true);
+                rm_set(cpu.inc_dec(dec, rm_get(), w));
+            }
+            break;
+        }
+        case 7: {  // shifts and rotates, by 1 or cl
+            static constexpr u8 exts[] {0, 1, 2, 3, 4, 5, 7};
+            u8 ext = exts[rng() % 7];
+            if ((ext == 2 || ext == 3) && (cpu.undefined & CF))
+                ext -= 2;  // rol and ror rather than rcl and rcr on an undefined carry
+            bool by_cl = rng() % 2;
+            bytes = {(u8)(0xD0 | (by_cl << 1) | w)};
+            modrm_any(ext, true);
+            rm_set(cpu.shift(ext, rm_get(), by_cl ? cpu.get(1, 0) : 1, w));
+            break;
+        }
+        case 8: {  // a string instruction with its cx, si, di and direction, every element in the data area
+            static constexpr u8 ops[] {0xA4, 0xA6, 0xAE, 0xAC, 0xAA};
+            static constexpr u8 prefixes[] {0, 0xF3, 0xF2};
+            const u8 op = ops[rng() % 5] | w, prefix = prefixes[rng() % 3];
+            const u16 count = rng() % 4 == 0 ? rng() % 2048 : rng() % 40;
+            const bool down = rng() % 2;
+            const u32 size = w + 1, span = (count + 1) * size;
+            auto inside = [&](u32 first) {
+                u32 low = down ? first - (span - size) : first;
+                return first <= 0xFFFF && low >= DATA_BEGIN && low <= first && low + span <= 0x10000;
+            };
+            auto start = [&]() -> u16 {
+                u32 low = DATA_BEGIN + rng() % (0x10000 - DATA_BEGIN - span);
+                return down ? low + span - size : low;
+            };
+            const u16 si = start();
+            u16 di = rng() % 2 ? si + rng() % 9 - 4 : start();  // often overlapping
+            if (!inside(di))
+                di = start();
+            if (rng() % 2 == 0) {
+                // mov cx, es; mov es, cx
+                const u16 es = rng() % 0x1000;
+                bytes.push_back(0xB9);
+                push_imm(es, 2);
+                bytes.insert(bytes.end(), {0x8E, 0xC1});
+                cpu.sregs[0] = es;
+            }
+            for (auto [reg, val] : {std::pair<u8, u16>{1, count}, {6, si}, {7, di}}) {
+                bytes.push_back(0xB8 | reg);
+                push_imm(val, 2);
+                cpu.set(reg, 1, val);
+            }
+            bytes.push_back(down ? 0xFD : 0xFC);
+            cpu.flags = down ? cpu.flags | DF : cpu.flags & ~DF;
+            u8 seg {segment_prefix(3)};
+            if (prefix != 0)
+                bytes.push_back(prefix);
+            seg = segment_prefix(seg);
+            bytes.push_back(op);
+            cpu.string_op(op, prefix, seg);
+            break;
+        }
+        case 9: {  // xlat of a byte in the data area, through a segment prefix or ds
+            const u16 table = DATA_BEGIN + rng() % (0x10000 - DATA_BEGIN) - cpu.get(0, 0);
+            bytes.push_back(0xBB);
+            push_imm(table, 2);
+            cpu.set(3, 1, table);
+            const u8 seg = segment_prefix(3);
+            bytes.push_back(0xD7);
+            cpu.set(0, 0, cpu.load(table + cpu.get(0, 0), 0, cpu.sregs[seg]));
+            break;
+        }
+        case 10: {  // aam and aad in base 10 or any other, but aam by 0
+            const bool aad = rng() % 2;
+            u8 base = rng() % 2 ? 10 : rng() & 0xFF;
+            if (!aad && base == 0)
+                base = 10;
+            bytes = {(u8)(aad ? 0xD5 : 0xD4), base};
+            const u8 al = cpu.get(0, 0), ah = cpu.get(4, 0);
+            cpu.set(4, 0, aad ? 0 : al / base);
+            cpu.set(0, 0, aad ? ah * base + al : al % base);
+            cpu.write_flags(CF | PF | AF | ZF | SF | OF, RefCpu::szp(cpu.get(0, 0), 0), CF | AF | OF);
+            break;
+        }
+    }
+    return bytes;
+}
+
+
+struct SimCase {
+    std::vector<u8> bytes;
+    RefCpu cpu;
+    size_t nb_instrs {0};
+};
+
+
+// the first nb_instrs instructions (a jump and what it skips count as one) for the seed
+SimCase sim_case(const u64 &seed, const size_t &nb_instrs) {
+    std::mt19937_64 rng(seed);
+    SimCase c;
+    // flags each jcc pair reads
+    static constexpr u16 reads[8] {OF, CF, ZF, CF | ZF, SF, PF, SF | OF, ZF | SF | OF};
+    for (; c.nb_instrs < nb_instrs && c.bytes.size() < DATA_BEGIN - 16; ++c.nb_instrs) {
+        u8 j = rng() % 8;
+        if (rng() % 6 == 0 && (reads[j] & c.cpu.undefined) == 0) {
+            // conditional jump over the next instruction, on the flags of the previous ones
+            u8 negate = rng() % 2;
+            bool taken = c.cpu.condition(j) != (negate == 1);
+            // generated on the model all the same, then taken back when skipped
+            u16 regs[8], sregs[4];
+            memcpy(regs, c.cpu.regs, sizeof(regs));
+            memcpy(sregs, c.cpu.sregs, sizeof(sregs));
+            const u16 flags {c.cpu.flags}, undefined {c.cpu.undefined};
+            std::vector<std::pair<u32, u8>> journal;
+            c.cpu.journal = &journal;
+            auto skipped = sim_instruction(rng, c.cpu);
+            c.cpu.journal = nullptr;
+            if (taken) {
+                memcpy(c.cpu.regs, regs, sizeof(regs));
+                memcpy(c.cpu.sregs, sregs, sizeof(sregs));
+                c.cpu.flags = flags, c.cpu.undefined = undefined;
+                for (auto old = journal.rbegin(); old != journal.rend(); ++old)
+                    c.cpu.mem[old->first] = old->second;
+            }
+            c.bytes.push_back(0x70 | (j << 1) | negate);
+            c.bytes.push_back(skipped.size());
+            c.bytes.insert(c.bytes.end(), skipped.begin(), skipped.end());
+        } else {
+            auto bytes = sim_instruction(rng, c.cpu);
+            c.bytes.insert(c.bytes.end(), bytes.begin(), bytes.end());
+        }
+        std::copy(c.bytes.begin() + c.cpu.ip, c.bytes.end(), c.cpu.mem.begin() + c.cpu.ip);
+        c.cpu.ip = c.bytes.size();
+    }
+    return c;
+}
+
+
+// back to the zeroed memory of a new Cpu, loaded with the program, without
+// allocating one: only the pages the last case wrote and its program
+void reload(Cpu &cpu, const std::vector<u8> &bytes) {
+    for (u32 page = 0; page < NB_PAGES; ++page)
+        if (cpu.dirty[page] != 0 || (page << PAGE_BITS) < cpu.program_size) {
+            memset(&cpu.memory[page << PAGE_BITS], 0, PAGE_SIZE);
+            cpu.dirty[page] = 0;
+        }
+    cpu.load_program(bytes.data(), bytes.size());
+}
+
+
+static constexpr const char *REG_NAMES[] {"ax", "cx", "dx", "bx", "sp", "bp", "si", "di", "es", "cs", "ss", "ds"};
+
+
+// differences between a Cpu's final state and the model, empty if none, then
+// between it and one running with superinstructions
+std::string compare_sim(const SimCase &c) {
+    constexpr u64 max_executed {1 << 24};
+    thread_local Cpu stepped, fused;
+    reload(stepped, c.bytes);
+    reload(fused, c.bytes);
+    stepped.run(max_executed);
+    fused.run_decoded(max_executed, true);
+
+    std::string diff;
+    const u16 defined = ~c.cpu.undefined & MODEL_FLAGS;
+    if ((stepped.flags & defined) != (c.cpu.flags & defined))
+        diff += std::format(" flags {} != {}", flag_letters(stepped.flags & defined), flag_letters(c.cpu.flags & defined));
+    if (stepped.ip != c.cpu.ip)
+        diff += std::format(" ip {:#06x} != {:#06x}", stepped.ip, c.cpu.ip);
+    for (u8 r = 0; r < 12; ++r) {
+        const u16 expected {r < 8 ? c.cpu.regs[r] : c.cpu.sregs[r - 8]};
+        if (stepped.regs[r] != expected)
+            diff += std::format(" {} {:#06x} != {:#06x}", REG_NAMES[r], stepped.regs[r], expected);
+    }
+    const size_t data_size {c.cpu.mem.size() - DATA_BEGIN};
+    if (memcmp(&stepped.memory[DATA_BEGIN], &c.cpu.mem[DATA_BEGIN], data_size) != 0) {
+        auto [at, _] = std::mismatch(&stepped.memory[DATA_BEGIN], &stepped.memory[DATA_BEGIN] + data_size, &c.cpu.mem[DATA_BEGIN]);
+        const size_t a = at - stepped.memory.data();
+        diff += std::format(" [{:#x}] {:#04x} != {:#04x}", a, stepped.memory[a], c.cpu.mem[a]);
+    }
+
+    std::string fused_diff;
+    for (u8 r = 0; r < 12; ++r)
+        if (stepped.regs[r] != fused.regs[r])
+            fused_diff += std::format(" {} {:#06x} != {:#06x}", REG_NAMES[r], fused.regs[r], stepped.regs[r]);
+    if (fused.flags != stepped.flags || fused.ip != stepped.ip || fused.executed != stepped.executed)
+        fused_diff += std::format(" flags {:#06x} ip {:#06x} executed {}", fused.flags, fused.ip, fused.executed);
+    if (memcmp(fused.memory.data(), stepped.memory.data(), MEMORY_SIZE) != 0)
+        fused_diff += " memory";
+    if (!fused_diff.empty())
+        diff += " fused:" + fused_diff;
+    return diff;
+}
+
+
+// the files of a failure go to dir
+std::optional<Failure> simulation(const std::string &dir, const u64 &seed, const size_t &nb_instrs) {
+    SimCase c = sim_case(seed, nb_instrs);
+    if (compare_sim(c).empty())
+        return std::nullopt;
+
+    // shortest failing prefix
+    size_t good {0}, bad {c.nb_instrs};
+    while (bad - good > 1) {
+        size_t mid = (good + bad) / 2;
+        if (compare_sim(sim_case(seed, mid)).empty())
+            good = mid;
+        else
+            bad = mid;
+    }
+    SimCase failing = sim_case(seed, bad);
+    std::string diff = compare_sim(failing);
+    write_file(dir + "/sim.bin", failing.bytes);
+    std::string last;
+    for (const u8 *b = failing.bytes.data(); b < failing.bytes.data() + failing.bytes.size();) {
+        Instr instr;
+        decode(b, instr);
+        last = to_string(instr);
+    }
+    return Failure{"simulation", seed, std::format("after {} instructions, last is `{}`:{}", bad, last, diff)};
+}
+
+
+// ---------------------------------------------------------------------------
+// history against runs from the start
+
+
+// what differs between a Cpu and another one that ran as many instructions,
+// empty when nothing does
+std::string state_difference(const Cpu &a, const Cpu &b) {
+    std::string diff;
+    if (a.executed != b.executed || a.ip != b.ip || a.flags != b.flags || a.halted != b.halted)
+        diff += std::format(
+            " executed {} ip {:#06x} flags {:#06x} halted {} != {} {:#06x} {:#06x} {}",
+            a.executed, a.ip, a.flags, a.halted, b.executed, b.ip, b.flags, b.halted
+        );
+    for (u8 r = 0; r < 12; ++r)
+        if (a.regs[r] != b.regs[r])
+            diff += std::format(" {} {:#06x} != {:#06x}", REG_NAMES[r], a.regs[r], b.regs[r]);
+    if (memcmp(a.memory.data(), b.memory.data(), MEMORY_SIZE) != 0) {
+        auto [at, _] = std::mismatch(a.memory.data(), a.memory.data() + MEMORY_SIZE, b.memory.data());
+        const size_t m = at - a.memory.data();
+        diff += std::format(" [{:#x}] {:#04x} != {:#04x}", m, a.memory[m], b.memory[m]);
+    }
+    return diff;
+}
+
+
+// Runs a simulation case under a History with checkpoints close together and
+// few kept, so that the oldest are dropped, then goes back and forth to random
+// counts and asks again and again for the last write of a byte and the last
+// change of a register. Every count it lands on must be the state a run from
+// the start to it gives, and the answers those of a History that kept every
+// step since the start.
+std::optional<Failure> history(const u64 &seed, const size_t &nb_instrs) {
+    const SimCase c = sim_case(seed, nb_instrs);
+    std::mt19937_64 rng(~seed);
+    thread_local Cpu cpu, all, fresh;
+    reload(cpu, c.bytes);
+    reload(all, c.bytes);
+    History h {cpu, 1 + rng() % 64, 2 + rng() % 6};
+    History every_step {all, (u64)1 << 62, 2};
+    const u64 end {h.run(1 << 24)};
+    every_step.run(end);
+
+    auto check = [&](const u64 &target, const std::string &what) -> std::optional<Failure> {
+        reload(fresh, c.bytes);
+        fresh.run(target);
+        const std::string diff {state_difference(cpu, fresh)};
+        if (diff.empty())
+            return std::nullopt;
+        return Failure{"history", seed, std::format("{} at {}:{}", what, target, diff)};
+    };
+    auto random_count = [&]() { return h.oldest() + rng() % (end - h.oldest() + 1); };
+
+    for (u8 i = 0; i < 8; ++i) {
+        const u64 target {i == 0 ? end : random_count()};
+        if (!h.go_to(target))
+            return Failure{"history", seed, std::format("cannot go to {}, oldest {}", target, h.oldest())};
+        if (auto failure = check(target, "go_to"))
+            return failure;
+    }
+    if (h.oldest() > 0 && h.go_to(h.oldest() - 1))
+        return Failure{"history", seed, std::format("went to {}, before the oldest checkpoint", h.oldest() - 1)};
+
+    // the steps that wrote phys or changed reg, from the one before count back to the oldest checkpoint
+    const auto &steps {every_step.steps};
+    auto expected = [&](auto &&matches, const u64 &count) {
+        std::vector<u64> ret;
+        for (u64 i = count; i-- > h.oldest();)
+            if (matches(i))
+                ret.push_back(i);
+        return ret;
+    };
+    auto wrote = [&](const u32 &phys) {
+        return [&, phys](const u64 &i) {
+            const size_t last {i + 1 < steps.size() ? steps[i + 1].writes : every_step.writes.size()};
+            for (size_t w = steps[i].writes; w < last; ++w)
+                if (every_step.writes[w].phys == phys)
+                    return true;
+            return false;
+        };
+    };
+    auto changed = [&](const u8 &reg) {
+        return [&, reg](const u64 &i) {
+            auto value = [&](const u64 &j) -> u16 {
+                if (j == steps.size())
+                    return reg == 12 ? all.flags : all.regs[reg];
+                return reg == 12 ? steps[j].flags : steps[j].regs[reg];
+            };
+            return value(i) != value(i + 1);
+        };
+    };
+    // asked until there are no more, or a few times
+    auto ask = [&](auto &&query, auto &&matches, const std::string &what) -> std::optional<Failure> {
+        const u64 from {random_count()};
+        h.go_to(from);
+        const std::vector<u64> answers {expected(matches, from)};
+        for (size_t a = 0; a <= std::min<size_t>(answers.size(), 4); ++a) {
+            const u64 at {cpu.executed};  // where it stays without an answer
+            const std::optional<u64> found {query()};
+            const std::optional<u64> want {a < answers.size() ? std::optional<u64>{answers[a]} : std::nullopt};
+            if (found != want)
+                return Failure{"history", seed, std::format(
+                    "{} from {}, answer {}: {} instead of {}", what, from, a,
+                    found ? std::to_string(*found) : "none", want ? std::to_string(*want) : "none"
+                )};
+            if (auto failure = check(found.value_or(at), what))
+                return failure;
+            if (!found)
+                break;
+        }
+        return std::nullopt;
+    };
+    for (u8 i = 0; i < 4; ++i) {
+        const u8 reg = rng() % 13;
+        if (auto failure = ask([&]() { return h.last_change(reg); }, changed(reg), std::format("last_change({})", reg)))
+            return failure;
+        // a byte some step wrote, or one of the code none did
+        const bool any = every_step.writes.empty() || rng() % 4 == 0;
+        const u32 phys = any ? rng() % c.bytes.size() : every_step.writes[rng() % every_step.writes.size()].phys;
+        if (auto failure = ask([&]() { return h.last_write(phys); }, wrote(phys), std::format("last_write({:#x})", phys)))
+            return failure;
+    }
+    return std::nullopt;
+}
+
+
+// ---------------------------------------------------------------------------
+
+
+int main(int argc, char** argv) {
+    // fuzz8086 [seconds] [seed] [sim8086 path, for the listings and round trips]
+    int seconds = argc > 1 ? atoi(argv[1]) : 60;
+    u64 base_seed = argc > 2 ? strtoull(argv[2], nullptr, 10) : std::random_device{}();
+    std::string sim_path = argc > 3 ? argv[3] : "./sim8086";
+    if (char *resolved = realpath(sim_path.c_str(), nullptr)) {
+        SIM8086 = resolved;
+        HAS_SIM = true;
+        free(resolved);
+    } else if (argc > 3) {
+        throw std::runtime_error{std::format("No simulator at {}", sim_path)};
+    }
+    HAS_NASM = HAS_SIM && std::system("nasm -v > /dev/null 2>&1") == 0;
+    if (!HAS_SIM)
+        std::cout << "no simulator at " << sim_path << ", skipping listings and round trips" << std::endl;
+    else if (!HAS_NASM)
+        std::cout << "nasm not found, skipping round trips" << std::endl;
+
+    constexpr size_t round_trip_instrs {12000};
+    constexpr size_t sim_instrs {4000};
+    unsigned nb_threads = std::max(1u, std::thread::hardware_concurrency());
+    std::atomic<u64> next_seed {base_seed};
+    std::atomic<u64> nb_round_trips {0};
+    std::atomic<u64> nb_listings {0};
+    std::atomic<u64> nb_simulated {0};
+    std::atomic<u64> nb_histories {0};
+    std::vector<Failure> failures;
+    std::mutex failures_mutex;
+    auto start = std::chrono::steady_clock::now();
+    auto deadline = start + std::chrono::seconds(seconds);
+
+    auto worker = [&]() {
+        char dir_template[] {"/tmp/fuzz8086.XXXXXX"};
+        std::string dir = mkdtemp(dir_template);
+        while (std::chrono::steady_clock::now() < deadline) {
+            u64 seed = next_seed++;
+            std::optional<Failure> failure;
+            if (HAS_NASM && seed % 4 == 0) {
+                failure = round_trip(dir, seed, round_trip_instrs);
+                ++nb_round_trips;
+            } else if (HAS_SIM && seed % 64 == 2) {  // tens of simulation cases each
+                failure = listings(dir, seed);
+                ++nb_listings;
+            } else if (seed % 4 == 1) {
+                failure = history(seed, sim_instrs);
+                ++nb_histories;
+            } else {
+                failure = simulation(dir, seed, sim_instrs);
+                ++nb_simulated;
+            }
+            if (failure) {
+                std::lock_guard lock(failures_mutex);
+                std::cout << std::format("FAILED {} (seed {}, files in {}): {}", failure->kind, failure->seed, dir, failure->detail) << std::endl;
+                failures.push_back(*failure);
+                return;  // keep the files of the failure
+            }
+        }
+        std::system(std::format("rm -rf {}", dir).c_str());
+    };
+    std::vector<std::thread> threads;
+    for (unsigned t = 0; t < nb_threads; ++t)
+        threads.emplace_back(worker);
+    for (auto &thread : threads)
+        thread.join();
+
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    double per_minute = (nb_round_trips + nb_listings + nb_simulated + nb_histories) / elapsed.count() * 60;
+    std::cout << std::format(
+        "{} threads, {:.1f} s, seeds {} to {}: {} round trips of {} instructions, {} listings, {} simulation and {} history cases of {} instructions, {:.0f} cases/minute",
+        nb_threads, elapsed.count(), base_seed, next_seed.load() - 1, nb_round_trips.load(), round_trip_instrs, nb_listings.load(),
+        nb_simulated.load(), nb_histories.load(), sim_instrs, per_minute
+    ) << std::endl;
+    if (!failures.empty()) {
+        std::cout << failures.size() << " failures" << std::endl;
+        return 1;
+    }
+    std::cout << "no failures" << std::endl;
+}
@@ -0,0 +1,2313 @@
+#include "lib8086.h"
+
+#include <algorithm>
+#include <bit>
+#include <cassert>
+#include <cstring>
+#include <format>
+#include <stdexcept>
+#include <string_view>
+#include <utility>
+
+static constexpr struct {
+    char value[8];
+} MEM_ENCODING[8] = {
+    {"bx + si"},
+    {"bx + di"},
+    {"bp + si"},
+    {"bp + di"},
+    {"si"},
+    {"di"},
+    {"bp"},
+    {"bx"},
+};
+
+// registers added for each MEM_ENCODING, then for a direct address
+static constexpr u8 MEM_REGS[9][2] = {
+    {3, 6},
+    {3, 7},
+    {5, 6},
+    {5, 7},
+    {6, NO_REG},
+    {7, NO_REG},
+    {5, NO_REG},
+    {3, NO_REG},
+    {NO_REG, NO_REG},
+};
+
+
+static constexpr struct {
+    char value[9];
+} MNEMONIC_ENCODING[] {
+    {"mov"}, {"push"}, {"pop"}, {"xchg"}, {"in"}, {"out"}, {"xlatb"}, {"lea"}, {"lds"}, {"les"},
+    {"lahf"}, {"sahf"}, {"pushf"}, {"popf"},
+    {"add"}, {"adc"}, {"inc"}, {"aaa"}, {"daa"}, {"sub"}, {"sbb"}, {"dec"}, {"neg"}, {"cmp"}, {"aas"}, {"das"},
+    {"mul"}, {"imul"}, {"aam"}, {"div"}, {"idiv"}, {"aad"}, {"cbw"}, {"cwd"},
+    {"not"}, {"rol"}, {"ror"}, {"rcl"}, {"rcr"}, {"shl"}, {"shr"}, {"sar"}, {"and"}, {"test"}, {"or"}, {"xor"},
+    {"movs"}, {"cmps"}, {"scas"}, {"lods"}, {"stos"},
+    {"call"}, {"call far"}, {"jmp"}, {"jmp far"}, {"ret"}, {"retf"},
+    {"jo"}, {"jno"}, {"jb"}, {"jnb"}, {"je"}, {"jne"}, {"jbe"}, {"jnbe"},
+    {"js"}, {"jns"}, {"jp"}, {"jnp"}, {"jl"}, {"jnl"}, {"jle"}, {"jnle"},
+    {"loopnz"}, {"loopz"}, {"loop"}, {"jcxz"},
+    {"int"}, {"int3"}, {"into"}, {"iret"},
+    {"clc"}, {"cmc"}, {"stc"}, {"cld"}, {"std"}, {"cli"}, {"sti"}, {"hlt"}, {"wait"}, {"nop"},
+    {"lock"}, {"rep"}, {"segment"},
+};
+
+
+bool is_shift(const Mnemonic &m) { return m >= Rol && m <= Sar; }
+bool is_string(const Mnemonic &m) { return m >= Movs && m <= Stos; }
+
+
+// byte view of the wide registers, al..bh are at these offsets in encoding order
+static_assert(std::endian::native == std::endian::little);
+static constexpr u8 BYTE_REG_OFFSETS[8] {0, 2, 4, 6, 1, 3, 5, 7};
+
+
+static constexpr u16 FLAGS_MASK {0x0FD5};
+static constexpr u16 ARITH_FLAGS {(1 << Carry) | (1 << Parity) | (1 << AuxCarry) | (1 << Zero) | (1 << Sign) | (1 << Overflow)};
+
+
+template<typename T, size_t N>
+constexpr std::array<u8, N> text_lengths(const T (&table)[N]) {
+    std::array<u8, N> lengths;
+    for (size_t i = 0; i < N; ++i)
+        lengths[i] = std::char_traits<char>::length(table[i].value);
+    return lengths;
+}
+static constexpr auto MEM_LENGTHS {text_lengths(MEM_ENCODING)};
+static constexpr auto MNEMONIC_LENGTHS {text_lengths(MNEMONIC_ENCODING)};
+static constexpr size_t REG_LENGTH {2};
+
+
+char *emit(char *out, const char *text, const size_t &length) {
+    memcpy(out, text, length);
+    return out + length;
+}
+template<size_t N>
+char *emit(char *out, const char (&text)[N]) {
+    return emit(out, text, N - 1);
+}
+// a whole entry of a text table, of constant size, then out only past its text
+template<size_t N>
+char *emit_entry(char *out, const char (&entry)[N], const size_t &length) {
+    memcpy(out, entry, N);
+    return out + length;
+}
+static constexpr auto DIGIT_PAIRS {[]() {
+    std::array<char, 200> pairs;
+    for (size_t n = 0; n < 100; ++n)
+        pairs[2 * n] = '0' + n / 10, pairs[2 * n + 1] = '0' + n % 10;
+    return pairs;
+}()};
+// operands are at most 16 bits, 5 digits and a sign
+char *emit_int(char *out, const int &val) {
+    if (val < 0)
+        *out++ = '-';
+    u32 v = std::abs(val);
+    const u32 digits = 1 + (v >= 10) + (v >= 100) + (v >= 1000) + (v >= 10000);
+    char *end = out + digits;
+    for (char *p = end; v >= 10; v /= 100) {
+        p -= 2;
+        memcpy(p, &DIGIT_PAIRS[2 * (v % 100)], 2);
+        if (v < 100)
+            return end;
+    }
+    *out = '0' + v;
+    return end;
+}
+
+
+
+char *emit(char *out, const struct Reg &reg) {
+    return emit(out, REG_ENCODING[reg.w][reg.val].value, REG_LENGTH);
+}
+
+
+char *emit(char *out, const struct Mem &mem) {
+    if (mem.base == NO_REG && !mem.has_disp)
+        throw std::runtime_error("Neither reg nor mem");
+    *out++ = '[';
+    if (mem.seg_override) {
+        out = emit(out, REG_ENCODING[1][8 + mem.seg].value, REG_LENGTH);
+        *out++ = ':';
+    }
+    if (mem.base != NO_REG) {
+        out = emit_entry(out, MEM_ENCODING[mem.reg].value, MEM_LENGTHS[mem.reg]);
+        if (mem.has_disp) {
+            s16 disp = (s16)mem.disp;
+            out = disp >= 0 ? emit(out, " + ") : emit(out, " - ");
+            out = emit_int(out, std::abs(disp));
+        }
+    } else {
+        out = emit_int(out, mem.disp);
+    }
+    *out++ = ']';
+    return out;
+}
+
+
+char *emit(char *out, const struct Imm &imm) {
+    return emit_int(out, (s16)imm.val);
+}
+
+
+char *emit(char *out, const struct Ptr &ptr) {
+    out = emit_int(out, ptr.seg);
+    *out++ = ':';
+    return emit_int(out, ptr.off);
+}
+
+
+char *emit(char *out, const OpType &op_t, const Op &op, const u8 &size) {
+    switch (op_t) {
+        case Reg:
+            return emit(out, op.reg);
+        case Mem:
+            return emit(out, op.mem);
+        case Imm:
+            return emit(out, op.imm);
+        case Rel: {
+            // $ is the start of the instruction, the jump is from its end
+            s16 reljump = ((s16)op.imm.val) + size;
+            out = reljump >= 0 ? emit(out, "$+") : emit(out, "$-");
+            return emit_int(out, std::abs(reljump));
+        }
+        case Ptr:
+            return emit(out, op.ptr);
+        case None:
+            break;
+    }
+    return out;
+}
+// nasm syntax of the instruction, out needs MAX_INSTR_TEXT of room
+char *emit(char *out, const Instr &instr) {
+    if (instr.prefix & LockPrefix)
+        out = emit(out, "lock ");
+    if ((instr.prefix & SegPrefix) && (is_string(instr.instr) || instr.instr == Xlat)) {
+        // memory operands show it in their brackets, these have none
+        out = emit(out, REG_ENCODING[1][8 + instr.seg].value, 2);
+        *out++ = ' ';
+    }
+    if (instr.prefix & RepPrefix)
+        out = emit(out, "rep ");
+    else if (instr.prefix & RepnePrefix)
+        out = emit(out, "repne ");
+    out = emit_entry(out, MNEMONIC_ENCODING[instr.instr].value, MNEMONIC_LENGTHS[instr.instr]);
+    if (is_string(instr.instr))
+        *out++ = instr.w == 1 ? 'w' : 'b';
+    if (instr.op0_t == None || ((instr.instr == Aam || instr.instr == Aad) && instr.op0.imm.val == 10))
+        return out;  // base 10 goes without saying
+
+    if (instr.op1_t == None) {
+        bool sized = instr.op0_t == Mem && instr.instr != Call && instr.instr != Jmp
+                     && instr.instr != CallFar && instr.instr != JmpFar;
+        if (instr.op0_t == Rel && instr.instr == Jmp && instr.op0.imm.w == 1)
+            out = emit(out, " near");  // keep the long encoding
+        else if (sized)
+            out = instr.w == 1 ? emit(out, " word") : emit(out, " byte");
+        *out++ = ' ';
+        return emit(out, instr.op0_t, instr.op0, instr.size);
+    }
+
+    bool prefix_imm {false};
+    if (instr.op0_t == Mem && (instr.op1_t == Imm || is_shift(instr.instr))) {
+        // size is ambiguous, need to specify
+        assert(!instr.reversed);
+        if (instr.instr == Mov)
+            prefix_imm = true;
+        else
+            out = instr.w == 1 ? emit(out, " word") : emit(out, " byte");
+    }
+    *out++ = ' ';
+    if (instr.reversed) {
+        out = emit(out, instr.op1_t, instr.op1, instr.size);
+        out = emit(out, ", ");
+        return emit(out, instr.op0_t, instr.op0, instr.size);
+    }
+    out = emit(out, instr.op0_t, instr.op0, instr.size);
+    out = emit(out, ", ");
+    if (prefix_imm)
+        out = instr.w == 1 ? emit(out, "word ") : emit(out, " byte ");
+    return emit(out, instr.op1_t, instr.op1, instr.size);
+}
+std::string to_string(const Instr &instr) {
+    char text[MAX_INSTR_TEXT];
+    return std::string(text, emit(text, instr));
+}
+
+
+// zero, sign and parity of a result already cut to its width
+u16 result_flags(const u16 &val, const u8 &w) {
+    return ((u16)(val == 0) << Flags::Zero)
+         | ((u16)((val >> (w == 1 ? 15 : 7)) & 1) << Flags::Sign)
+         | ((u16)(1 ^ __builtin_parity(val & 0xFF)) << Flags::Parity);
+}
+
+
+u16 Cpu::get_addr(const struct Mem &mem) {
+    return regs[mem.base] + regs[mem.index] + mem.disp;
+}
+
+
+void Cpu::mark_dirty(const u32 &begin, const u32 &len) {
+    const u32 first {begin >> PAGE_BITS}, last {(begin + len - 1) >> PAGE_BITS};
+    memset(&dirty[first], 1, last - first + 1);
+    if (begin < decoded_end) [[unlikely]]
+        forget_decoded(begin, len);
+}
+
+
+// Words are read and written in one go, unless they straddle the end of their
+// segment (the high byte of a word at offset 0xFFFF is at offset 0) or of the memory.
+u16 Cpu::read_mem(const u16 &seg, const u16 &addr, const u8 &w) {
+    u32 phys {phys_addr(seg, addr)};
+    if (w == 0)
+        return memory[phys];
+    if (addr == 0xFFFF || phys == MEMORY_MASK) [[unlikely]]
+        return ((u16)memory[phys]) + (((u16)memory[phys_addr(seg, addr + 1)]) << 8);
+    u16 val;
+    memcpy(&val, &memory[phys], 2);
+    return val;
+}
+
+
+void Cpu::write_mem(const u16 &seg, const u16 &addr, const u16 &val, const u8 &w) {
+    u32 phys {phys_addr(seg, addr)};
+    dirty[phys >> PAGE_BITS] = 1;
+    if (phys < decoded_end) [[unlikely]]
+        forget_decoded(phys, w + 1);
+    const bool wraps {w == 1 && (addr == 0xFFFF || phys == MEMORY_MASK)};
+    if (history != nullptr) [[unlikely]]
+        history->writing(phys, wraps ? 1 : w + 1);
+    if (w == 0) {
+        memory[phys] = (u8)val;
+    } else if (wraps) [[unlikely]] {
+        const u32 high {phys_addr(seg, addr + 1)};
+        dirty[high >> PAGE_BITS] = 1;
+        if (high < decoded_end)
+            forget_decoded(high, 1);
+        if (history != nullptr)
+            history->writing(high, 1);
+        memory[phys] = (u8)(val & 0xFF);
+        memory[high] = (u8)((val >> 8) & 0xFF);
+    } else {
+        dirty[(phys + 1) >> PAGE_BITS] = 1;
+        memcpy(&memory[phys], &val, 2);
+    }
+}
+
+
+u16 Cpu::load(const struct Mem &mem, const u8 &w) {
+    return read_mem(regs[8 + mem.seg], get_addr(mem), w);
+}
+
+
+void Cpu::store(const struct Mem &mem, const u16 &val, const u8 &w) {
+    write_mem(regs[8 + mem.seg], get_addr(mem), val, w);
+}
+
+
+u16 Cpu::reg_val(const struct Reg &reg) {
+    return reg.w == 1 ? regs[reg.val] : byte_regs()[BYTE_REG_OFFSETS[reg.val]];
+}
+
+
+void Cpu::set_reg(const struct Reg &reg, const u16 &val) {
+    if (reg.w == 1)
+        regs[reg.val] = val;
+    else
+        byte_regs()[BYTE_REG_OFFSETS[reg.val]] = (u8)val;
+}
+
+
+u16 Cpu::read_op(const OpType &op_t, const Op &op, const u8 &w) {
+    switch (op_t) {
+        case Reg:   return reg_val(op.reg);
+        case Mem:   return load(op.mem, w);
+        case Imm:
+        case Rel:   return op.imm.val;
+        default:    return 0;
+    }
+}
+
+
+void Cpu::write_op(const OpType &op_t, const Op &op, const u8 &w, const u16 &val) {
+    if (op_t == Mem)
+        store(op.mem, val, w);
+    else
+        set_reg(op.reg, val);
+}
+
+
+void Cpu::push(const u16 &val) {
+    regs[4] -= 2;
+    write_mem(regs[8 + Ss], regs[4], val, 1);
+}
+
+
+u16 Cpu::pop() {
+    u16 val {read_mem(regs[8 + Ss], regs[4], 1)};
+    regs[4] += 2;
+    return val;
+}
+
+
+// add, adc, sub, sbb, cmp, and, or, xor and test; carry, auxiliary carry and
+// overflow come from the bits of the full width result, without branching
+u16 Cpu::arith(const Mnemonic &instr, const u16 &x, const u16 &y, const u8 &w) {
+    const u32 carry_in {(u32)(flags >> Flags::Carry) & 1};
+    const u8 sign_bit = w == 1 ? 15 : 7;
+    const u16 mask = w == 1 ? 0xFFFF : 0xFF;
+    const u32 a = x & mask, b = y & mask;  // byte immediates come sign extended
+    u32 res;
+    bool sub {false}, logic {false};
+    switch (instr) {
+        case Add:   res = a + b;                                break;
+        case Adc:   res = a + b + carry_in;                     break;
+        case Sub:
+        case Cmp:   res = a - b;                sub = true;     break;
+        case Sbb:   res = a - b - carry_in;     sub = true;     break;
+        case And:
+        case Test:  res = a & b;                logic = true;   break;
+        case Or:    res = a | b;                logic = true;   break;
+        case Xor:   res = a ^ b;                logic = true;   break;
+        default:
+            throw std::runtime_error(std::format("Not an arithmetic instruction: {}", MNEMONIC_ENCODING[instr].value));
+    }
+    const u16 val = res & mask;
+    const u32 overflow = sub ? (a ^ b) & (a ^ res) : (a ^ res) & (b ^ res);
+    const u16 arith_mask = logic ? 0 : 0xFFFF;
+    flags = (flags & ~ARITH_FLAGS) | result_flags(val, w) | (arith_mask & (
+          ((u16)((res >> (sign_bit + 1)) & 1) << Flags::Carry)
+        | ((u16)((a ^ b ^ res) & 0x10))  // bit 4, as AuxCarry
+        | ((u16)((overflow >> sign_bit) & 1) << Flags::Overflow)
+    ));
+    return val;
+}
+
+
+// inc and dec, as add and sub by 1 keeping the carry
+u16 Cpu::inc_dec(const Mnemonic &instr, const u16 &a, const u8 &w) {
+    u16 carry = flags & (1 << Flags::Carry);
+    u16 val = arith(instr == Inc ? Add : Sub, a, 1, w);
+    flags = (flags & ~(1 << Flags::Carry)) | carry;
+    return val;
+}
+
+
+// Shifts and rotates by count, as many single bit steps would: counts are not
+// masked, past the width shl/shr give 0 and sar the sign. Rotates only touch
+// carry and overflow, shifts clear the auxiliary carry. Overflow is only
+// defined for a count of 1, and computed the same way for the others.
+u16 Cpu::shift(const Mnemonic &instr, const u16 &a, const u8 &count, const u8 &w) {
+    if (count == 0)
+        return a;
+    const u32 bits = w == 1 ? 16 : 8;
+    const u32 mask = w == 1 ? 0xFFFF : 0xFF;
+    const u32 carry_in {(u32)(flags >> Flags::Carry) & 1};
+    u32 val, carry, overflow;
+    switch (instr) {
+        case Rol: {
+            u32 c = count % bits;
+            val = ((a << c) | (a >> (bits - c))) & mask;
+            carry = val & 1;
+            overflow = (val >> (bits - 1)) ^ carry;
+            break;
+        }
+        case Ror: {
+            u32 c = count % bits;
+            val = ((a >> c) | (a << (bits - c))) & mask;
+            carry = val >> (bits - 1);
+            overflow = carry ^ ((val >> (bits - 2)) & 1);
+            break;
+        }
+        case Rcl:
+        case Rcr: {
+            // rotation of the bits + 1 wide carry:value
+            u32 c = count % (bits + 1);
+            u32 wide = a | (carry_in << bits);
+            if (instr == Rcr)
+                c = (bits + 1 - c) % (bits + 1);
+            wide = ((wide << c) | (wide >> (bits + 1 - c))) & ((mask << 1) | 1);
+            val = wide & mask;
+            carry = wide >> bits;
+            overflow = instr == Rcl ? (val >> (bits - 1)) ^ carry : (val >> (bits - 1)) ^ ((val >> (bits - 2)) & 1);
+            break;
+        }
+        case Shl: {
+            u32 c = std::min<u32>(count, bits + 1);
+            u32 wide = (u32)a << c;
+            val = wide & mask;
+            carry = (wide >> bits) & 1;
+            overflow = (val >> (bits - 1)) ^ carry;
+            break;
+        }
+        case Shr: {
+            u32 c = std::min<u32>(count, bits + 1);
+            val = a >> c;
+            carry = (a >> (c - 1)) & 1;
+            overflow = a >> (bits - 1);
+            break;
+        }
+        case Sar: {
+            u32 c = std::min<u32>(count, bits);
+            s32 wide = w == 1 ? (s32)(s16)a : (s32)(s8)a;
+            val = (u32)(wide >> c) & mask;
+            carry = (wide >> (c - 1)) & 1;
+            overflow = 0;
+            break;
+        }
+        default:
+            throw std::runtime_error(std::format("Not a shift: {}", MNEMONIC_ENCODING[instr].value));
+    }
+    const u16 changed = instr <= Rcr
+        ? (1 << Flags::Carry) | (1 << Flags::Overflow)
+        : ARITH_FLAGS;
+    const u16 result = (carry << Flags::Carry) | (overflow << Flags::Overflow) | (instr <= Rcr ? 0 : result_flags(val, w));
+    flags = (flags & ~changed) | result;
+    return val;
+}
+
+
+// mul, imul, div and idiv of the accumulator, carry and overflow tell if the
+// product needs the high half; the other flags are left as they are. False on
+// a divide error, nothing changed.
+bool Cpu::multiply_divide(const Mnemonic &instr, const u16 &src, const u8 &w) {
+    const u32 dividend = w == 1 ? ((u32)regs[2] << 16) | regs[0] : regs[0];
+    const u16 acc = w == 1 ? regs[0] : regs[0] & 0xFF;
+    u32 low, high;
+    bool extends;
+    switch (instr) {
+        case Mul: {
+            u32 product = acc * (u32)src;
+            low = w == 1 ? product & 0xFFFF : product & 0xFF;
+            high = w == 1 ? product >> 16 : product >> 8;
+            extends = high != 0;
+            break;
+        }
+        case Imul: {
+            s32 product = w == 1 ? (s32)(s16)acc * (s16)src : (s32)(s8)acc * (s8)src;
+            low = w == 1 ? (u32)product & 0xFFFF : (u32)product & 0xFF;
+            high = w == 1 ? ((u32)product >> 16) & 0xFFFF : ((u32)product >> 8) & 0xFF;
+            extends = w == 1 ? product != (s16)product : product != (s8)product;
+            break;
+        }
+        case Div: {
+            u32 max = w == 1 ? 0xFFFF : 0xFF;
+            if (src == 0 || dividend / src > max)
+                return false;
+            low = dividend / src;
+            high = dividend % src;
+            extends = false;
+            break;
+        }
+        case Idiv: {
+            s64 num = w == 1 ? (s32)dividend : (s16)dividend;
+            s64 den = w == 1 ? (s16)src : (s8)src;
+            s64 max = w == 1 ? 0x7FFF : 0x7F;
+            if (den == 0 || num / den > max || num / den < -max)
+                return false;
+            low = (u32)(num / den);
+            high = (u32)(num % den);
+            extends = false;
+            break;
+        }
+        default:
+            throw std::runtime_error(std::format("Not a multiplication or a division: {}", MNEMONIC_ENCODING[instr].value));
+    }
+    if (w == 1) {
+        regs[0] = low;
+        regs[2] = high;
+    } else {
+        regs[0] = (u16)((high & 0xFF) << 8) | (low & 0xFF);
+    }
+    if (instr == Mul || instr == Imul) {
+        const u16 carry_overflow = (1 << Flags::Carry) | (1 << Flags::Overflow);
+        flags = (flags & ~carry_overflow) | (extends ? carry_overflow : 0);
+    }
+    return true;
+}
+
+
+// daa, das, aaa, aas, aam and aad on al (and ah), the last two in base; false
+// for aam by 0, a divide error
+bool Cpu::decimal_adjust(const Mnemonic &instr, const u8 &base) {
+    u8 al = regs[0] & 0xFF, ah = regs[0] >> 8;
+    const bool aux = (flags >> Flags::AuxCarry) & 1, carry = (flags >> Flags::Carry) & 1;
+    const bool low_adjust = (al & 0xF) > 9 || aux;
+    bool new_aux = low_adjust, new_carry = false;
+    switch (instr) {
+        case Daa:
+        case Das: {
+            const bool high_adjust = al > 0x99 || carry;
+            const s8 dir = instr == Daa ? 1 : -1;
+            al += dir * (low_adjust ? 6 : 0) + dir * (high_adjust ? 0x60 : 0);
+            new_carry = high_adjust;
+            break;
+        }
+        case Aaa:
+        case Aas: {
+            const s8 dir = instr == Aaa ? 1 : -1;
+            al = (al + dir * (low_adjust ? 6 : 0)) & 0x0F;
+            ah += dir * (low_adjust ? 1 : 0);
+            new_carry = low_adjust;
+            break;
+        }
+        case Aam:
+            if (base == 0)
+                return false;
+            ah = al / base;
+            al = al % base;
+            new_aux = aux;
+            new_carry = carry;
+            break;
+        case Aad:
+            al = ah * base + al;
+            ah = 0;
+            new_aux = aux;
+            new_carry = carry;
+            break;
+        default:
+            throw std::runtime_error(std::format("Not a decimal adjust: {}", MNEMONIC_ENCODING[instr].value));
+    }
+    regs[0] = (u16)(ah << 8) | al;
+    const u16 changed = (1 << Flags::Carry) | (1 << Flags::AuxCarry) | (1 << Flags::Zero) | (1 << Flags::Sign) | (1 << Flags::Parity);
+    flags = (flags & ~changed) | result_flags(al, 0) | (new_carry << Flags::Carry) | (new_aux << Flags::AuxCarry);
+    return true;
+}
+
+
+// jo..jnle come in pairs, the odd one negates the even one
+bool Cpu::condition(const Mnemonic &instr) {
+    const u16 f = flags;
+    const bool carry = (f >> Flags::Carry) & 1, zero = (f >> Flags::Zero) & 1, sign = (f >> Flags::Sign) & 1;
+    const bool overflow = (f >> Flags::Overflow) & 1, parity = (f >> Flags::Parity) & 1;
+    const bool conditions[8] {overflow, carry, zero, carry || zero, sign, parity, sign != overflow, zero || (sign != overflow)};
+    const u8 n = instr - Jo;
+    return conditions[n / 2] != (n % 2 == 1);
+}
+
+
+// one iteration of a string instruction, seg:si (ds unless overridden) to es:di
+void Cpu::string_step(const Mnemonic &instr, const u8 &w, const u8 &seg) {
+    const u16 delta = (flags >> Flags::Direction) & 1 ? -(w + 1) : w + 1;
+    u16 &si = regs[6], &di = regs[7];
+    switch (instr) {
+        case Movs:
+            write_mem(regs[8 + Es], di, read_mem(regs[8 + seg], si, w), w);
+            si += delta, di += delta;
+            break;
+        case Cmps:
+            arith(Cmp, read_mem(regs[8 + seg], si, w), read_mem(regs[8 + Es], di, w), w);
+            si += delta, di += delta;
+            break;
+        case Scas:
+            arith(Cmp, w == 1 ? regs[0] : regs[0] & 0xFF, read_mem(regs[8 + Es], di, w), w);
+            di += delta;
+            break;
+        case Lods:
+            set_reg({0, w}, read_mem(regs[8 + seg], si, w));
+            si += delta;
+            break;
+        case Stos:
+            write_mem(regs[8 + Es], di, w == 1 ? regs[0] : regs[0] & 0xFF, w);
+            di += delta;
+            break;
+        default:
+            throw std::runtime_error(std::format("Not a string instruction: {}", MNEMONIC_ENCODING[instr].value));
+    }
+}
+
+
+// Elements of size bytes a string instruction can go through from offset
+// before it wraps in its segment or past the end of the memory, 0 when the
+// very first one straddles.
+u32 string_room(const u16 &seg, const u16 &offset, const u8 &size, const bool &down) {
+    const u32 phys {phys_addr(seg, offset)};
+    if (!down)
+        return std::min<u32>(0x10000 - offset, MEMORY_SIZE - phys) / size;
+    if (offset > 0x10000 - size || phys > MEMORY_SIZE - size)
+        return 0;
+    return std::min<u32>(offset, phys) / size + 1;
+}
+
+
+// Fills buf from period to len with its first period bytes over and over,
+// and end - len to end - period with its last period bytes going down.
+void repeat_up(u8 *buf, const u32 &period, const u32 &len) {
+    for (u32 done = period; done < len; done *= 2)
+        memcpy(buf + done, buf, std::min(done, len - done));
+}
+void repeat_down(u8 *end, const u32 &period, const u32 &len) {
+    for (u32 done = period; done < len; done *= 2) {
+        const u32 chunk {std::min(done, len - done)};
+        memcpy(end - done - chunk, end - chunk, chunk);
+    }
+}
+
+
+// Repeated string instructions, run by run with memmove, memset and memchr
+// rather than element by element, for the very same result. A run stops
+// before si or di wraps. A movs whose di is just ahead of si in its direction
+// reads what it wrote, its source repeats with the distance as period.
+void Cpu::string_repeat(const Mnemonic &instr, const u8 &w, const bool &until_zero, const u8 &seg) {
+    u16 &cx = regs[1], &si = regs[6], &di = regs[7];
+    const u8 size = w + 1;
+    const bool down = (flags >> Flags::Direction) & 1;
+    const bool compares = instr == Cmps || instr == Scas;
+    const bool uses_si = instr != Stos && instr != Scas, uses_di = instr != Lods;
+    while (cx != 0) {
+        u32 n {cx};
+        if (uses_si)
+            n = std::min(n, string_room(regs[8 + seg], si, size, down));
+        if (uses_di)
+            n = std::min(n, string_room(regs[8 + Es], di, size, down));
+        const u32 len {n * size};
+        const u32 src {phys_addr(regs[8 + seg], si)}, dst {phys_addr(regs[8 + Es], di)};
+        u8 *s = &memory[down ? src + size - len : src], *d = &memory[down ? dst + size - len : dst];
+        const bool repeats = instr == Movs && (down ? d < s && s < d + len : s < d && d < s + len);
+        if (n < 2 || (repeats && (d > s ? d - s : s - d) % size != 0)) {
+            string_step(instr, w, seg);
+            --cx;
+            if (compares && (((flags >> Flags::Zero) & 1) == until_zero))
+                return;
+            continue;
+        }
+
+        bool stopped {false};
+        if (history != nullptr && (instr == Movs || instr == Stos)) [[unlikely]]
+            history->writing(d - memory.data(), len);
+        switch (instr) {
+            case Movs: {
+                if (!repeats) {
+                    memmove(d, s, len);
+                } else if (down) {
+                    const u32 period = s - d;
+                    memcpy(d + len - period, d + len, period);
+                    repeat_down(d + len, period, len);
+                } else {
+                    const u32 period = d - s;
+                    memcpy(d, s, period);
+                    repeat_up(d, period, len);
+                }
+                break;
+            }
+            case Stos:
+                if (w == 0) {
+                    memset(d, regs[0] & 0xFF, len);
+                } else {
+                    memcpy(d, &regs[0], 2);
+                    repeat_up(d, 2, len);
+                }
+                break;
+            case Lods:
+                set_reg({0, w}, read_mem(regs[8 + seg], down ? si - len + size : si + len - size, w));
+                break;
+            case Cmps: case Scas: {
+                // elements in execution order, up to the one the repetition stops on
+                auto element = [&](const u8 *first, const u32 &i) { return first + (down ? -(s64)(i * size) : (s64)(i * size)); };
+                auto equal = [&](const u32 &i) {
+                    const u8 *e = element(&memory[dst], i);
+                    if (instr == Cmps)
+                        return memcmp(element(&memory[src], i), e, size) == 0;
+                    return memcmp(&regs[0], e, size) == 0;
+                };
+                u32 i {0};
+                if (instr == Scas && w == 0 && until_zero) {
+                    const void *found = down ? memrchr(d, regs[0] & 0xFF, len) : memchr(d, regs[0] & 0xFF, len);
+                    i = found == nullptr ? n : down ? dst - ((const u8*)found - memory.data()) : ((const u8*)found - memory.data()) - dst;
+                } else {
+                    if (instr == Cmps && !until_zero) {
+                        constexpr u32 block {64};  // equal blocks are skipped with memcmp
+                        for (; i + block / size <= n; i += block / size) {
+                            const u32 low = down ? block - size : 0;
+                            if (memcmp(element(&memory[src], i) - low, element(&memory[dst], i) - low, block) != 0)
+                                break;
+                        }
+                    }
+                    while (i < n && equal(i) != until_zero)
+                        ++i;
+                }
+                stopped = i < n;
+                n = stopped ? i + 1 : n;
+                const u32 last {n - 1};
+                const u8 *e = element(&memory[dst], last);
+                u16 a {0}, b {0};
+                memcpy(&a, instr == Cmps ? element(&memory[src], last) : (const u8*)&regs[0], size);
+                memcpy(&b, e, size);
+                arith(Cmp, a, b, w);
+                break;
+            }
+            default:
+                throw std::runtime_error(std::format("Not a string instruction: {}", MNEMONIC_ENCODING[instr].value));
+        }
+        if (instr == Movs || instr == Stos)
+            mark_dirty(d - memory.data(), len);
+        const u16 delta = down ? -(n * size) : n * size;
+        if (uses_si)
+            si += delta;
+        if (uses_di)
+            di += delta;
+        cx -= n;
+        if (stopped)
+            return;
+    }
+}
+
+
+// Device bus: port devices and interrupt stand-ins are plain functions in
+// tables. in/out with an immediate port and int get their table index at
+// decode time, only ports in dx are looked up when executed. The framebuffer
+// is memory mapped, a plain part of the memory read back at the end.
+
+enum Devices : u8 { OpenBus, Console, Timer, Dac };
+
+constexpr u8 port_device(const u16 &port) {
+    switch (port) {
+        case 0xE9:              return Console;  // the debug console port of bochs and qemu
+        case 0x40:              return Timer;
+        case 0x3C8: case 0x3C9: return Dac;      // vga palette, index then r, g, b
+        default:                return OpenBus;
+    }
+}
+
+
+void console_write(Cpu &cpu, const u8 &c) {
+    cpu.console += (char)c;
+}
+
+
+u16 open_bus_in(Cpu &, const u16 &, const u8 &) { return 0xFFFF; }
+void open_bus_out(Cpu &, const u16 &, const u16 &, const u8 &) {}
+
+u16 console_in(Cpu &, const u16 &, const u8 &) { return 0xE9; }  // tells the console is there
+void console_out(Cpu &cpu, const u16 &, const u16 &val, const u8 &w) {
+    console_write(cpu, val & 0xFF);
+    if (w == 1)
+        console_write(cpu, val >> 8);
+}
+
+u16 timer_in(Cpu &cpu, const u16 &, const u8 &) { return (u16)cpu.executed; }
+
+u16 dac_in(Cpu &cpu, const u16 &port, const u8 &) {
+    if (port == 0x3C8)
+        return cpu.dac_index;
+    u8 val {cpu.palette[cpu.dac_index][cpu.dac_component]};
+    if (++cpu.dac_component == 3)
+        cpu.dac_component = 0, ++cpu.dac_index;
+    return val;
+}
+void dac_out(Cpu &cpu, const u16 &port, const u16 &val, const u8 &) {
+    if (port == 0x3C8) {
+        cpu.dac_index = val & 0xFF, cpu.dac_component = 0;
+        return;
+    }
+    cpu.palette[cpu.dac_index][cpu.dac_component] = val & 0x3F;
+    if (++cpu.dac_component == 3)
+        cpu.dac_component = 0, ++cpu.dac_index;
+}
+
+
+static constexpr struct {
+    u16 (*in)(Cpu &cpu, const u16 &port, const u8 &w);
+    void (*out)(Cpu &cpu, const u16 &port, const u16 &val, const u8 &w);
+} DEVICES[] {
+    {open_bus_in, open_bus_out}, {console_in, console_out}, {timer_in, open_bus_out}, {dac_in, dac_out},
+};
+
+
+// Interrupts without a handler go to a stand-in for the dos or bios service
+enum Services : u8 { NoService, Dos, Video, Time, Exit };
+
+constexpr u8 int_service(const u8 &n) {
+    switch (n) {
+        case 0x10: return Video;
+        case 0x1A: return Time;
+        case 0x20: return Exit;
+        case 0x21: return Dos;
+        default:   return NoService;
+    }
+}
+
+
+void no_service(Cpu &, const u8 &n) {
+    if (n == 0)
+        throw std::runtime_error{"Divide error, without a handler for interrupt 0"};
+    throw std::runtime_error{std::format("Interrupt {:#04x} has no handler", n)};
+}
+
+void dos_service(Cpu &cpu, const u8 &) {
+    u16 *regs {cpu.regs};
+    switch (regs[0] >> 8) {
+        case 0x02:  // write dl
+            console_write(cpu, regs[2] & 0xFF);
+            cpu.set_reg({0, 0}, regs[2] & 0xFF);
+            break;
+        case 0x09:  // write ds:dx up to a $
+            for (u16 addr = regs[2]; cpu.read_mem(regs[8 + Ds], addr, 0) != '$'; ++addr)
+                console_write(cpu, cpu.read_mem(regs[8 + Ds], addr, 0));
+            cpu.set_reg({0, 0}, '$');
+            break;
+        case 0x4C:  // exit
+            cpu.halted = true;
+            break;
+        default:
+            throw std::runtime_error{std::format("Dos function {:#04x} is not simulated", regs[0] >> 8)};
+    }
+}
+
+void video_service(Cpu &cpu, const u8 &) {
+    switch (cpu.regs[0] >> 8) {
+        case 0x00:  // set mode, the framebuffer is always there
+            break;
+        case 0x0E:  // teletype al
+            console_write(cpu, cpu.regs[0] & 0xFF);
+            break;
+        default:
+            throw std::runtime_error{std::format("Video function {:#04x} is not simulated", cpu.regs[0] >> 8)};
+    }
+}
+
+void time_service(Cpu &cpu, const u8 &) {
+    if (cpu.regs[0] >> 8 != 0x00)
+        throw std::runtime_error{std::format("Time function {:#04x} is not simulated", cpu.regs[0] >> 8)};
+    cpu.regs[1] = (u16)(cpu.executed >> 16), cpu.regs[2] = (u16)cpu.executed;  // ticks in cx:dx, one per instruction
+    cpu.set_reg({0, 0}, 0);
+}
+
+void exit_service(Cpu &cpu, const u8 &) {
+    cpu.halted = true;
+}
+
+
+static constexpr void (*SERVICES[])(Cpu &cpu, const u8 &n) {no_service, dos_service, video_service, time_service, exit_service};
+
+
+// Interrupt n through the vector table if the program installed a handler,
+// ip already points past the instruction
+void Cpu::interrupt(const u8 &n, const u8 &service) {
+    const u16 off {read_mem(0, n * 4, 1)}, seg {read_mem(0, n * 4 + 2, 1)};
+    if ((off == 0 && seg == 0) || memcmp(&memory[n * 4], &loaded_vectors[n * 4], 4) == 0) {
+        SERVICES[service](*this, n);
+        return;
+    }
+    push(flags | 0xF000);
+    flags &= ~((1 << Flags::Trap) | (1 << Flags::Interrupt));
+    push(regs[8 + Cs]);
+    push(ip);
+    regs[8 + Cs] = seg, ip = off;
+}
+
+// Executes a decoded instruction, ip already points past it
+void Cpu::execute(const Instr &instr) {
+    const OpType& dest_t = instr.reversed ? instr.op1_t : instr.op0_t;
+    const OpType& src_t  = instr.reversed ? instr.op0_t : instr.op1_t;
+    const Op& dest = instr.reversed ? instr.op1 : instr.op0;
+    const Op& src  = instr.reversed ? instr.op0 : instr.op1;
+    const u8 &w = instr.w;
+    const Mnemonic &m = instr.instr;
+
+    if (m >= Jo && m <= Jnle) {
+        if (condition(m))
+            ip += dest.imm.val;
+        return;
+    }
+    switch (m) {
+        case Mov:
+            write_op(dest_t, dest, w, read_op(src_t, src, w));
+            break;
+        case Add: case Adc: case Sub: case Sbb: case And: case Or: case Xor:
+            write_op(dest_t, dest, w, arith(m, read_op(dest_t, dest, w), read_op(src_t, src, w), w));
+            break;
+        case Cmp: case Test:
+            arith(m, read_op(dest_t, dest, w), read_op(src_t, src, w), w);
+            break;
+        case Inc: case Dec:
+            write_op(dest_t, dest, w, inc_dec(m, read_op(dest_t, dest, w), w));
+            break;
+        case Neg:
+            write_op(dest_t, dest, w, arith(Sub, 0, read_op(dest_t, dest, w), w));
+            break;
+        case Not:
+            write_op(dest_t, dest, w, ~read_op(dest_t, dest, w));
+            break;
+        case Rol: case Ror: case Rcl: case Rcr: case Shl: case Shr: case Sar:
+            write_op(dest_t, dest, w, shift(m, read_op(dest_t, dest, w), read_op(src_t, src, 0) & 0xFF, w));
+            break;
+        case Mul: case Imul: case Div: case Idiv:
+            if (!multiply_divide(m, read_op(dest_t, dest, w), w))
+                interrupt(0, int_service(0));
+            break;
+        case Daa: case Das: case Aaa: case Aas: case Aam: case Aad:
+            if (!decimal_adjust(m, m == Aam || m == Aad ? dest.imm.val : 10))
+                interrupt(0, int_service(0));
+            break;
+        case Cbw:
+            regs[0] = (u16)(s16)(s8)(regs[0] & 0xFF);
+            break;
+        case Cwd:
+            regs[2] = regs[0] & 0x8000 ? 0xFFFF : 0;
+            break;
+        case Xchg: {
+            u16 d = read_op(dest_t, dest, w), s = read_op(src_t, src, w);
+            write_op(dest_t, dest, w, s);
+            write_op(src_t, src, w, d);
+            break;
+        }
+        case Lea:
+            write_op(dest_t, dest, 1, get_addr(src.mem));
+            break;
+        case Lds: case Les: {
+            const u16 seg {regs[8 + src.mem.seg]}, addr {get_addr(src.mem)};
+            write_op(dest_t, dest, 1, read_mem(seg, addr, 1));
+            regs[8 + (m == Lds ? Ds : Es)] = read_mem(seg, addr + 2, 1);
+            break;
+        }
+        case Xlat:
+            set_reg({0, 0}, read_mem(regs[8 + instr.seg], regs[3] + (regs[0] & 0xFF), 0));
+            break;
+        case Push:
+            regs[4] -= 2;  // push sp pushes the decremented value
+            write_mem(regs[8 + Ss], regs[4], read_op(dest_t, dest, 1), 1);
+            break;
+        case Pop:
+            write_op(dest_t, dest, 1, pop());
+            break;
+        case Pushf:
+            push(flags | 0xF000);
+            break;
+        case Popf:
+            flags = pop() & FLAGS_MASK;
+            break;
+        case Lahf:
+            set_reg({4, 0}, (flags & 0xD5) | 0x02);
+            break;
+        case Sahf:
+            flags = (flags & 0xFF00) | (regs[0] >> 8 & 0xD5);
+            break;
+        case Movs: case Cmps: case Scas: case Lods: case Stos: {
+            if ((instr.prefix & (RepPrefix | RepnePrefix)) == 0) {
+                string_step(m, w, instr.seg);
+                break;
+            }
+            string_repeat(m, w, instr.prefix & RepnePrefix, instr.seg);
+            break;
+        }
+        case Jmp:
+            if (dest_t == Rel)
+                ip += dest.imm.val;
+            else if (dest_t == Ptr)
+                regs[8 + Cs] = dest.ptr.seg, ip = dest.ptr.off;
+            else
+                ip = read_op(dest_t, dest, 1);
+            break;
+        case JmpFar: {
+            const u16 seg {regs[8 + dest.mem.seg]}, addr {get_addr(dest.mem)};
+            ip = read_mem(seg, addr, 1);
+            regs[8 + Cs] = read_mem(seg, addr + 2, 1);
+            break;
+        }
+        case Call:
+            if (dest_t == Ptr) {
+                push(regs[8 + Cs]);
+                push(ip);
+                regs[8 + Cs] = dest.ptr.seg, ip = dest.ptr.off;
+            } else {
+                u16 target = dest_t == Rel ? ip + dest.imm.val : read_op(dest_t, dest, 1);
+                push(ip);
+                ip = target;
+            }
+            break;
+        case CallFar: {
+            const u16 seg {regs[8 + dest.mem.seg]}, addr {get_addr(dest.mem)};
+            const u16 off = read_mem(seg, addr, 1), cs = read_mem(seg, addr + 2, 1);
+            push(regs[8 + Cs]);
+            push(ip);
+            regs[8 + Cs] = cs, ip = off;
+            break;
+        }
+        case Ret:
+            ip = pop();
+            regs[4] += dest_t == Imm ? dest.imm.val : 0;
+            break;
+        case Retf:
+            ip = pop();
+            regs[8 + Cs] = pop();
+            regs[4] += dest_t == Imm ? dest.imm.val : 0;
+            break;
+        case Loop: case Loopz: case Loopnz: {
+            const bool zero = (flags >> Flags::Zero) & 1;
+            if (--regs[1] != 0 && (m == Loop || (m == Loopz) == zero))
+                ip += dest.imm.val;
+            break;
+        }
+        case Jcxz:
+            if (regs[1] == 0)
+                ip += dest.imm.val;
+            break;
+        case In: case Out: {
+            // the accumulator is op0 and the port op1 for both
+            const bool in_dx = instr.op1_t == Reg;
+            const u16 port = in_dx ? regs[2] : instr.op1.imm.val;
+            const auto &device = DEVICES[in_dx ? port_device(port) : instr.device];
+            if (m == In)
+                set_reg(instr.op0.reg, device.in(*this, port, w));
+            else
+                device.out(*this, port, reg_val(instr.op0.reg), w);
+            break;
+        }
+        case Int:
+            interrupt(dest.imm.val, instr.device);
+            break;
+        case Int3:
+            interrupt(3, instr.device);
+            break;
+        case Into:
+            if ((flags >> Flags::Overflow) & 1)
+                interrupt(4, instr.device);
+            break;
+        case Iret:
+            ip = pop();
+            regs[8 + Cs] = pop();
+            flags = pop() & FLAGS_MASK;
+            break;
+        case Clc: flags &= ~(1 << Flags::Carry);            break;
+        case Stc: flags |= 1 << Flags::Carry;               break;
+        case Cmc: flags ^= 1 << Flags::Carry;               break;
+        case Cld: flags &= ~(1 << Flags::Direction);        break;
+        case Std: flags |= 1 << Flags::Direction;           break;
+        case Cli: flags &= ~(1 << Flags::Interrupt);        break;
+        case Sti: flags |= 1 << Flags::Interrupt;           break;
+        case Hlt:
+            halted = true;
+            break;
+        case Nop: case Wait:
+            break;
+        default:
+            throw std::runtime_error(std::format("Instruction application not implemented: {}", MNEMONIC_ENCODING[m].value));
+    }
+}
+
+
+u16 ea_base(const struct Mem &mem) {
+    u8 nb_regs = (mem.base != NO_REG) + (mem.index != NO_REG);
+    if (nb_regs == 0)
+        return 6;                                                       // direct address
+    u16 regs = nb_regs == 1 ? 5 : (mem.base == 5) == (mem.index == 7) ? 7 : 8;  // bp + di and bx + si are faster
+    return regs + (mem.disp != 0 ? 4 : 0);
+}
+
+
+u16 ea(const struct Mem &mem) {
+    return ea_base(mem) + (mem.seg_override ? 2 : 0);  // segment override costs 2 more clocks
+}
+
+
+// al or ax to or from a direct address, which has an encoding of its own
+static bool acc_direct(const struct Reg &reg, const struct Mem &mem) {
+    return reg.val == 0 && mem.base == NO_REG && mem.index == NO_REG;
+}
+
+
+u16 estimate_clocks_mov(const OpType &dest_t, const OpType &src_t, const Op &dest, const Op &src) {
+    // ignoring segment registers here
+    if (dest_t == Mem) {
+        if (src_t == Reg) {
+            if (acc_direct(src.reg, dest.mem))
+                return 10;                  // mem <- acc
+            return 9 + ea(dest.mem);        // mem <- reg
+        }
+        return 10 + ea(dest.mem);           // mem <- imm
+    }
+    if (src_t == Mem && acc_direct(dest.reg, src.mem))
+        return 10;                          // acc <- mem
+    if (src_t == Reg)
+        return 2;                           // reg <- reg
+    if (src_t == Imm)
+        return 4;                           // reg <- imm
+    return 8 + ea(src.mem);                 // reg <- mem
+}
+
+
+// add, adc, sub, sbb, and, or, xor and cmp, cmp does not write its memory destination back
+u16 estimate_clocks_arith(const Mnemonic &instr, const OpType &dest_t, const OpType &src_t, const Op &dest, const Op &src) {
+    if (dest_t == Mem) {
+        if (instr == Cmp)
+            return (src_t == Imm ? 10 : 9) + ea(dest.mem);
+        if (src_t == Imm)
+            return 17 + ea(dest.mem);       // mem += imm
+        return 16 + ea(dest.mem);           // mem += reg
+    }
+    if (src_t == Mem)
+        return 9 + ea(src.mem);             // reg += mem
+    if (src_t == Reg)
+        return 3;                           // reg += reg
+    return 4;                               // reg += imm
+}
+
+
+// 8086 clocks of movs cmps scas lods stos, alone and per repetition after the 9 of a rep prefix
+static constexpr struct {u8 single; u8 repeated;} STRING_CLOCKS[] {{18, 17}, {22, 22}, {15, 15}, {12, 13}, {11, 10}};
+
+
+// 8086 clocks of mul imul (aam) div idiv on a byte and on a word register, the fewest
+// of their ranges since they depend on the operands, 6 more from memory
+static constexpr u8 MUL_DIV_CLOCKS[][2] {{70, 118}, {80, 128}, {0, 0}, {80, 144}, {101, 165}};
+
+
+// reps is how many times a repeated string instruction went, or the count of a shift by cl
+u32 instr_clocks(const Instr &instr, const bool &taken, const u16 &reps) {
+    const OpType& dest_t = instr.reversed ? instr.op1_t : instr.op0_t;
+    const OpType& src_t  = instr.reversed ? instr.op0_t : instr.op1_t;
+    const Op& dest = instr.reversed ? instr.op1 : instr.op0;
+    const Op& src  = instr.reversed ? instr.op0 : instr.op1;
+    if (instr.instr == Mov)
+        return estimate_clocks_mov(dest_t, src_t, dest, src);
+    switch (instr.instr) {
+        case Add: case Adc: case Sub: case Sbb: case And: case Or: case Xor: case Cmp:
+            return estimate_clocks_arith(instr.instr, dest_t, src_t, dest, src);
+        default:
+            break;
+    }
+    if (instr.instr >= Jo && instr.instr <= Jnle)
+        return taken ? 16 : 4;
+    if (is_string(instr.instr)) {
+        const auto &c = STRING_CLOCKS[instr.instr - Movs];
+        const u32 prefix {instr.prefix & SegPrefix ? 2u : 0u};  // as for memory operands
+        return prefix + (instr.prefix & (RepPrefix | RepnePrefix) ? 9 + (u32)c.repeated * reps : c.single);
+    }
+    switch (instr.instr) {
+        case Loop:   return taken ? 17 : 5;
+        case Loopz:  return taken ? 18 : 6;
+        case Loopnz: return taken ? 19 : 5;
+        case Jcxz:   return taken ? 18 : 6;
+        case Inc: case Dec:
+            if (dest_t == Mem)
+                return 15 + ea(dest.mem);
+            return instr.w == 1 ? 2 : 3;
+        case Neg: case Not:
+            return dest_t == Mem ? 16 + ea(dest.mem) : 3;
+        case Test:
+            if (dest_t == Mem || src_t == Mem)
+                return (src_t == Imm ? 11 : 9) + ea(dest_t == Mem ? dest.mem : src.mem);
+            if (src_t == Imm)
+                return instr.size == 2 + instr.w ? 4 : 5;  // acc, imm has its own shorter encoding
+            return 3;
+        case Rol: case Ror: case Rcl: case Rcr: case Shl: case Shr: case Sar: {
+            const u32 by_cl {src_t == Reg ? 4u * reps : 0u};
+            if (dest_t == Mem)
+                return (src_t == Reg ? 20 : 15) + ea(dest.mem) + by_cl;
+            return (src_t == Reg ? 8 : 2) + by_cl;
+        }
+        case Mul: case Imul: case Div: case Idiv:
+            return MUL_DIV_CLOCKS[instr.instr - Mul][instr.w] + (dest_t == Mem ? 6 + ea(dest.mem) : 0);
+        case Aaa: case Aas: case Daa: case Das:
+            return 4;
+        case Aam:    return 83;
+        case Aad:    return 60;
+        case Cbw:    return 2;
+        case Cwd:    return 5;
+        case Xchg:
+            if (dest_t == Mem || src_t == Mem)
+                return 17 + ea(dest_t == Mem ? dest.mem : src.mem);
+            return instr.size == 1 ? 3 : 4;  // with the accumulator, or two registers
+        case Xlat:   return 11;
+        case Lea:    return 2 + ea(src.mem);
+        case Lds: case Les:
+            return 16 + ea(src.mem);
+        case Lahf: case Sahf:
+            return 4;
+        case Pushf:  return 10;
+        case Popf:   return 8;
+        case Push:
+            if (dest_t == Mem)
+                return 16 + ea(dest.mem);
+            return dest.reg.val >= 8 ? 10 : 11;  // segment registers after the 8 wide ones
+        case Pop:
+            return dest_t == Mem ? 17 + ea(dest.mem) : 8;
+        case Jmp:
+            if (dest_t == Mem)
+                return 18 + ea(dest.mem);
+            return dest_t == Reg ? 11 : 15;
+        case JmpFar: return 24 + ea(dest.mem);
+        case Call:
+            if (dest_t == Mem)
+                return 21 + ea(dest.mem);
+            return dest_t == Reg ? 16 : dest_t == Ptr ? 28 : 19;
+        case CallFar: return 37 + ea(dest.mem);
+        case Ret:    return dest_t == Imm ? 12 : 8;
+        case Retf:   return dest_t == Imm ? 17 : 18;
+        case Clc: case Stc: case Cmc: case Cld: case Std: case Cli: case Sti: case Hlt:
+            return 2;
+        case Wait: case Nop:
+            return 3;
+        case In: case Out:
+            return instr.op1_t == Reg ? 8 : 10;  // port in dx or immediate
+        case Int:    return 51;
+        case Int3:   return 52;
+        case Into:   return taken ? 53 : 4;
+        case Iret:   return 24;
+        default:
+            throw std::runtime_error{"Clocks not implemented for this instruction"};
+    }
+}
+
+
+u16 clock_reps(const Instr &instr, const u16 &cx_before, const u16 &cx_after) {
+    if (is_shift(instr.instr))
+        return cx_before & 0xFF;  // cl, also for a shift of cl itself
+    return cx_before - cx_after;
+}
+
+
+u32 bus_cycles(const Instr &instr, const u16 &reps, const u8 &bus_bytes) {
+    const bool mem = instr.op0_t == Mem || instr.op1_t == Mem;
+    const u32 word = bus_bytes == 2 ? 1 : 2, data = instr.w == 1 ? word : 1;
+    const u32 times = instr.prefix & (RepPrefix | RepnePrefix) ? reps : 1;
+    switch (instr.instr) {
+        case Mov: case Cmp: case Test: case Mul: case Imul: case Div: case Idiv:
+            return mem ? data : 0;
+        case Xchg: case Add: case Adc: case Sub: case Sbb: case And: case Or: case Xor:
+        case Inc: case Dec: case Neg: case Not:
+        case Rol: case Ror: case Rcl: case Rcr: case Shl: case Shr: case Sar:
+            return mem ? 2 * data : 0;  // read, then written back
+        case Lds: case Les:         return 2 * word;
+        case Push: case Pop:        return (mem ? 2 : 1) * word;
+        case Pushf: case Popf:      return word;
+        case Xlat:                  return 1;
+        case In: case Out:          return data;
+        case Call:                  return (instr.op0_t == Ptr || mem ? 2 : 1) * word;
+        case CallFar:               return 4 * word;
+        case Jmp:                   return mem ? word : 0;
+        case JmpFar:                return 2 * word;
+        case Ret:                   return word;
+        case Retf:                  return 2 * word;
+        case Iret:                  return 3 * word;
+        case Int: case Int3: case Into:
+            return 5 * word;        // flags, cs and ip pushed, the vector read
+        case Movs: case Cmps:       return times * 2 * data;
+        case Scas: case Lods: case Stos:
+            return times * data;
+        default:
+            return 0;
+    }
+}
+
+
+Prefetch::Prefetch(const bool &i8088)
+    : queue_size {(u8)(i8088 ? 4 : 6)}, bus_bytes {(u8)(i8088 ? 1 : 2)} {}
+
+
+void Prefetch::restart(const u16 &ip) {
+    queued = 0;
+    fetch_ip = ip;
+    if (fetching)
+        bus_free = std::max(bus_free, fetch_end);  // a bus cycle is not cut short, its bytes are dropped
+    fetching = false;
+    bus_free = std::max(bus_free, now);
+}
+
+
+void Prefetch::jumped(const u16 &ip) {
+    restart(ip);
+    queued = bus_bytes == 2 && (ip & 1) == 0 ? 2 : 1;
+    fetch_ip += queued;
+}
+
+
+void Prefetch::fill(const u64 &t) {
+    for (;;) {
+        if (fetching) {
+            if (fetch_end > t)
+                return;
+            queued += fetch_bytes;
+            fetch_ip += fetch_bytes;
+            fetching = false;
+            bus_free = fetch_end;
+        }
+        const u8 bytes = bus_bytes == 2 && (fetch_ip & 1) == 0 ? 2 : 1;
+        if (queue_size - queued < bytes || bus_free >= t)
+            return;  // full until the execution unit takes bytes, or not yet
+        fetching = true;
+        fetch_bytes = bytes;
+        fetch_end = bus_free + 4;
+    }
+}
+
+
+BusTiming Prefetch::step(const Instr &instr, const bool &taken, const u16 &reps, const u16 &next_ip) {
+    BusTiming t;
+    const u64 start {now};
+    // its bytes, taken from the queue as they come: the 8088 queue is shorter than some instructions
+    for (u8 needed = instr.size;;) {
+        fill(now);
+        const u8 taken_bytes = std::min(queued, needed);
+        if (taken_bytes > 0 && !fetching)
+            bus_free = std::max(bus_free, now);  // room again, prefetching resumes from now
+        queued -= taken_bytes;
+        needed -= taken_bytes;
+        if (needed == 0)
+            break;
+        if (!fetching)
+            fill(std::max(now, bus_free) + 1);
+        t.queue_stall += fetch_end - now;
+        now = fetch_end;
+    }
+
+    const u32 cycles = bus_cycles(instr, reps, bus_bytes);
+    u32 eu = instr_clocks(instr, taken, reps);
+    if (bus_bytes == 1)
+        eu += 4 * (cycles - bus_cycles(instr, reps, 2));  // the clocks are the 8086's, with a word a bus cycle
+    if (cycles > 0) {
+        const u64 operands {now + eu - std::min<u64>(eu, 4 * cycles)};
+        fill(operands);
+        if (fetching) {
+            t.bus_stall = fetch_end - operands;
+            fill(fetch_end);
+        }
+        now += eu + t.bus_stall;
+        bus_free = std::max(bus_free, now);
+    } else {
+        now += eu;
+    }
+    if (taken || next_ip != (u16)(fetch_ip - queued))
+        jumped(next_ip);
+    t.clocks = now - start;
+    return t;
+}
+
+
+void unimplemented(const u8 *&b, Instr & /* unused */) {
+    throw std::runtime_error(std::format("unimplemented opcode 0x{:02x}", *b));
+}
+
+
+void instr_rm_op(OpType &op_t, Op &op, const u8 &w, const u8 &mod, const u8 &rm) {
+    op_t = mod == 0b11 ? Reg : Mem;
+    if (mod == 0b11) {
+        op.reg = {rm, w};
+    } else {
+        bool has_reg = (mod != 0b00 || rm != 0b110);
+        op.mem.reg = rm;
+        memcpy(&op.mem.base, MEM_REGS[has_reg ? rm : 8], 2);  // base and index
+        // bp based addressing defaults to the stack segment
+        bool bp_based = has_reg && (rm == 0b010 || rm == 0b011 || rm == 0b110);
+        op.mem.seg = bp_based ? Ss : Ds;
+        op.mem.seg_override = false;
+    }
+}
+
+
+void instr_reg_op(OpType &op_t, Op &op, const u8 &w, const u8 &reg) {
+    op_t = Reg;
+    op.reg = {reg, w};
+}
+
+
+u16 read_data(const u8 *&b, const u8 size, const bool sign_extend = true) {
+    assert(size > 0);
+
+    if (size == 1)
+        return sign_extend ? (u16)(s16)*(s8*)b++ : (u16)*b++;
+
+    u16 ret = (u16)*b++;
+    if (size == 2)
+        ret |= ((u16)*b++) << 8;
+    return ret;
+}
+
+
+void disp_op(const u8 *&b, Op &op, const u8 &mod, const u8 &rm) {
+    u8 size = mod == 0 && rm == 0b110 ? 2 : mod % 0b11;
+    op.mem.has_disp = (size > 0);
+    op.mem.disp = size > 0 ? read_data(b, size) : 0;
+}
+
+
+void instr_imm_op(const u8 *&b, OpType &op_t, Op &op, const u8 &w, const u8 s = 0) {
+    op_t = Imm;
+    op.imm = {read_data(b, s == 1 ? 1 : w + 1), w};
+}
+
+
+// Instruction encodings, as in the 8086 manual. The first field is the opcode
+// byte: 0 and 1 are fixed bits, d w s v z are one bit flags, reg and sr are
+// register fields. The following fields describe the rest of the instruction:
+//   mod reg rm   mod reg r/m byte, with a register (reg), a segment register
+//                (sr) or an opcode extension (3 fixed bits) in the middle
+//   data         immediate, 1 or 2 bytes depending on w and s
+//   data8        unsigned byte immediate
+//   data16       word immediate
+//   addr         direct memory address
+//   disp8        ip relative jump, also disp16
+//   ptr          direct intersegment address, offset then segment
+// What cannot be read from the bits is given by the flags.
+enum EncodingFlags : u8 {
+    ImplicitD = 1 << 0,  // d is always set
+    ImplicitW = 1 << 1,  // w is always set
+    AccOp     = 1 << 2,  // the accumulator is the first operand
+    DxOp      = 1 << 3,  // the port is in dx
+    MemOnly   = 1 << 4,  // mod 11 is not an instruction, there is no address to take
+};
+
+
+struct Encoding {
+    Mnemonic instr;
+    char spec[32];
+    u8 flags;
+};
+
+
+static constexpr Encoding ENCODINGS[] {
+    {Mov,     "100010dw mod reg rm"},
+    {Mov,     "1100011w mod 000 rm data"},
+    {Mov,     "1011wreg data"},
+    {Mov,     "101000dw addr", AccOp},
+    {Mov,     "100011d0 mod sr rm", ImplicitW},
+
+    {Push,    "11111111 mod 110 rm", ImplicitW},
+    {Push,    "01010reg", ImplicitW},
+    {Push,    "000sr110"},
+    {Pop,     "10001111 mod 000 rm", ImplicitW},
+    {Pop,     "01011reg", ImplicitW},
+    {Pop,     "000sr111"},
+
+    {Nop,     "10010000"},  // xchg ax, ax
+    {Xchg,    "1000011w mod reg rm", ImplicitD},
+    {Xchg,    "10010reg", AccOp | ImplicitW},
+
+    {In,      "1110010w data8", AccOp},
+    {In,      "1110110w", AccOp | DxOp},
+    {Out,     "1110011w data8", AccOp | ImplicitD},
+    {Out,     "1110111w", AccOp | DxOp | ImplicitD},
+
+    {Xlat,    "11010111"},
+    {Lea,     "10001101 mod reg rm", ImplicitD | ImplicitW | MemOnly},
+    {Lds,     "11000101 mod reg rm", ImplicitD | ImplicitW | MemOnly},
+    {Les,     "11000100 mod reg rm", ImplicitD | ImplicitW | MemOnly},
+    {Lahf,    "10011111"},
+    {Sahf,    "10011110"},
+    {Pushf,   "10011100"},
+    {Popf,    "10011101"},
+
+    {Add,     "000000dw mod reg rm"},
+    {Add,     "100000sw mod 000 rm data"},
+    {Add,     "0000010w data", AccOp},
+    {Adc,     "000100dw mod reg rm"},
+    {Adc,     "100000sw mod 010 rm data"},
+    {Adc,     "0001010w data", AccOp},
+    {Inc,     "1111111w mod 000 rm"},
+    {Inc,     "01000reg", ImplicitW},
+    {Aaa,     "00110111"},
+    {Daa,     "00100111"},
+    {Sub,     "001010dw mod reg rm"},
+    {Sub,     "100000sw mod 101 rm data"},
+    {Sub,     "0010110w data", AccOp},
+    {Sbb,     "000110dw mod reg rm"},
+    {Sbb,     "100000sw mod 011 rm data"},
+    {Sbb,     "0001110w data", AccOp},
+    {Dec,     "1111111w mod 001 rm"},
+    {Dec,     "01001reg", ImplicitW},
+    {Neg,     "1111011w mod 011 rm"},
+    {Cmp,     "001110dw mod reg rm"},
+    {Cmp,     "100000sw mod 111 rm data"},
+    {Cmp,     "0011110w data", AccOp},
+    {Aas,     "00111111"},
+    {Das,     "00101111"},
+    {Mul,     "1111011w mod 100 rm"},
+    {Imul,    "1111011w mod 101 rm"},
+    {Aam,     "11010100 data8"},
+    {Div,     "1111011w mod 110 rm"},
+    {Idiv,    "1111011w mod 111 rm"},
+    {Aad,     "11010101 data8"},
+    {Cbw,     "10011000"},
+    {Cwd,     "10011001"},
+
+    {Not,     "1111011w mod 010 rm"},
+    {Rol,     "110100vw mod 000 rm"},
+    {Ror,     "110100vw mod 001 rm"},
+    {Rcl,     "110100vw mod 010 rm"},
+    {Rcr,     "110100vw mod 011 rm"},
+    {Shl,     "110100vw mod 100 rm"},
+    {Shr,     "110100vw mod 101 rm"},
+    {Sar,     "110100vw mod 111 rm"},
+    {And,     "001000dw mod reg rm"},
+    {And,     "100000sw mod 100 rm data"},
+    {And,     "0010010w data", AccOp},
+    {Test,    "1000010w mod reg rm"},
+    {Test,    "1111011w mod 000 rm data"},
+    {Test,    "1010100w data", AccOp},
+    {Or,      "000010dw mod reg rm"},
+    {Or,      "100000sw mod 001 rm data"},
+    {Or,      "0000110w data", AccOp},
+    {Xor,     "001100dw mod reg rm"},
+    {Xor,     "100000sw mod 110 rm data"},
+    {Xor,     "0011010w data", AccOp},
+
+    {Movs,    "1010010w"},
+    {Cmps,    "1010011w"},
+    {Scas,    "1010111w"},
+    {Lods,    "1010110w"},
+    {Stos,    "1010101w"},
+
+    {Call,    "11101000 disp16"},
+    {Call,    "11111111 mod 010 rm", ImplicitW},
+    {Call,    "10011010 ptr"},
+    {CallFar, "11111111 mod 011 rm", ImplicitW | MemOnly},
+    {Jmp,     "11101001 disp16"},
+    {Jmp,     "11101011 disp8"},
+    {Jmp,     "11111111 mod 100 rm", ImplicitW},
+    {Jmp,     "11101010 ptr"},
+    {JmpFar,  "11111111 mod 101 rm", ImplicitW | MemOnly},
+    {Ret,     "11000011"},
+    {Ret,     "11000010 data16"},
+    {Retf,    "11001011"},
+    {Retf,    "11001010 data16"},
+
+    {Jo,      "01110000 disp8"},
+    {Jno,     "01110001 disp8"},
+    {Jb,      "01110010 disp8"},
+    {Jnb,     "01110011 disp8"},
+    {Je,      "01110100 disp8"},
+    {Jne,     "01110101 disp8"},
+    {Jbe,     "01110110 disp8"},
+    {Jnbe,    "01110111 disp8"},
+    {Js,      "01111000 disp8"},
+    {Jns,     "01111001 disp8"},
+    {Jp,      "01111010 disp8"},
+    {Jnp,     "01111011 disp8"},
+    {Jl,      "01111100 disp8"},
+    {Jnl,     "01111101 disp8"},
+    {Jle,     "01111110 disp8"},
+    {Jnle,    "01111111 disp8"},
+    {Loopnz,  "11100000 disp8"},
+    {Loopz,   "11100001 disp8"},
+    {Loop,    "11100010 disp8"},
+    {Jcxz,    "11100011 disp8"},
+
+    {Int,     "11001101 data8"},
+    {Int3,    "11001100"},
+    {Into,    "11001110"},
+    {Iret,    "11001111"},
+
+    {Clc,     "11111000"},
+    {Cmc,     "11110101"},
+    {Stc,     "11111001"},
+    {Cld,     "11111100"},
+    {Std,     "11111101"},
+    {Cli,     "11111010"},
+    {Sti,     "11111011"},
+    {Hlt,     "11110100"},
+    {Wait,    "10011011"},
+
+    {Lock,    "11110000"},
+    {Rep,     "1111001z"},
+    {Segment, "001sr110"},
+};
+static constexpr size_t NB_ENCODINGS {sizeof(ENCODINGS) / sizeof(ENCODINGS[0])};
+
+
+enum DataField : u8 { NoData, DataW, Data8, Data16, DataAddr, Disp8, Disp16, DataPtr };
+
+
+// an encoding spec, parsed
+struct Format {
+    u8 mask {0};       // fixed bits of the opcode byte
+    u8 bits {0};       // and their values
+    s8 d {-1};         // offsets of the flags and register fields in the opcode byte, -1 if absent
+    s8 w {-1};
+    s8 s {-1};
+    s8 v {-1};
+    s8 z {-1};
+    s8 reg {-1};
+    s8 sr {-1};
+    bool modrm {false};
+    bool mid_reg {false};  // middle field of the mod reg rm byte
+    bool mid_sr {false};
+    s8 ext {-1};           // opcode extension in the middle field
+    DataField data {NoData};
+};
+
+
+constexpr Format parse_format(const std::string_view spec) {
+    Format f;
+    size_t i {0};
+    for (s8 bit = 7; bit >= 0; --bit, ++i) {
+        if (spec[i] == '0' || spec[i] == '1') {
+            f.mask |= 1 << bit;
+            f.bits |= (spec[i] - '0') << bit;
+        } else if (spec.substr(i, 3) == "reg") {
+            f.reg = bit - 2; bit -= 2; i += 2;
+        } else if (spec.substr(i, 2) == "sr") {
+            f.sr = bit - 1; bit -= 1; i += 1;
+        } else if (spec[i] == 'd') {
+            f.d = bit;
+        } else if (spec[i] == 'w') {
+            f.w = bit;
+        } else if (spec[i] == 's') {
+            f.s = bit;
+        } else if (spec[i] == 'v') {
+            f.v = bit;
+        } else if (spec[i] == 'z') {
+            f.z = bit;
+        } else {
+            throw std::logic_error("Invalid opcode byte in encoding");
+        }
+    }
+
+    auto next_field = [&]() {
+        while (i < spec.size() && spec[i] == ' ')
+            ++i;
+        size_t start = i;
+        while (i < spec.size() && spec[i] != ' ')
+            ++i;
+        return spec.substr(start, i - start);
+    };
+    for (auto field = next_field(); !field.empty(); field = next_field()) {
+        if (field == "mod") {
+            f.modrm = true;
+            auto mid = next_field();
+            if (mid == "reg")
+                f.mid_reg = true;
+            else if (mid == "sr")
+                f.mid_sr = true;
+            else if (mid.size() == 3)
+                f.ext = ((mid[0] - '0') << 2) | ((mid[1] - '0') << 1) | (mid[2] - '0');
+            else
+                throw std::logic_error("Invalid mod reg rm field in encoding");
+            if (next_field() != "rm")
+                throw std::logic_error("Missing rm field in encoding");
+        } else if (field == "data") {
+            f.data = DataW;
+        } else if (field == "data8") {
+            f.data = Data8;
+        } else if (field == "data16") {
+            f.data = Data16;
+        } else if (field == "addr") {
+            f.data = DataAddr;
+        } else if (field == "disp8") {
+            f.data = Disp8;
+        } else if (field == "disp16") {
+            f.data = Disp16;
+        } else if (field == "ptr") {
+            f.data = DataPtr;
+        } else {
+            throw std::logic_error("Invalid field in encoding");
+        }
+    }
+    return f;
+}
+
+
+static constexpr auto FORMATS {[]() {
+    std::array<Format, NB_ENCODINGS> formats;
+    for (size_t e = 0; e < NB_ENCODINGS; ++e)
+        formats[e] = parse_format(ENCODINGS[e].spec);
+    return formats;
+}()};
+
+
+static constexpr size_t NO_ENCODING {NB_ENCODINGS};
+
+
+// first encoding matching the opcode byte, and the opcode extension if any
+constexpr size_t find_encoding(const u8 opcode, const s8 ext = -1) {
+    for (size_t e = 0; e < NB_ENCODINGS; ++e)
+        if ((opcode & FORMATS[e].mask) == FORMATS[e].bits && FORMATS[e].ext == ext)
+            return e;
+    return NO_ENCODING;
+}
+
+
+constexpr bool has_extensions(const u8 opcode) {
+    for (s8 ext = 0; ext < 8; ++ext)
+        if (find_encoding(opcode, ext) != NO_ENCODING)
+            return true;
+    return false;
+}
+
+
+void decode(const u8 *&b, Instr &i);
+
+
+// decoder specialized for one opcode byte and one of its encodings,
+// every field of the opcode byte is known at compile time
+template<u8 OPCODE, size_t E>
+void decode_encoding(const u8 *&b, Instr &i) {
+    static constexpr Encoding enc {ENCODINGS[E]};
+    static constexpr Format f {FORMATS[E]};
+    static constexpr u8 d = f.d >= 0 ? (OPCODE >> f.d) & 1 : (enc.flags & ImplicitD) != 0;
+    static constexpr u8 w = f.w >= 0 ? (OPCODE >> f.w) & 1 : (enc.flags & ImplicitW) != 0;
+    static constexpr u8 s = f.s >= 0 ? (OPCODE >> f.s) & 1 : 0;
+    static constexpr u8 v = f.v >= 0 ? (OPCODE >> f.v) & 1 : 0;
+    static constexpr u8 z = f.z >= 0 ? (OPCODE >> f.z) & 1 : 0;
+    static constexpr u8 reg = f.reg >= 0 ? (OPCODE >> f.reg) & 0b111 : 0;
+    static constexpr u8 sr = f.sr >= 0 ? (OPCODE >> f.sr) & 0b11 : 0;
+    static constexpr bool acc = enc.flags & AccOp;
+
+    ++b;
+    i.instr = enc.instr;
+    if constexpr (enc.instr == Lock || enc.instr == Rep) {
+        i.prefix |= enc.instr == Lock ? LockPrefix : (z == 1 ? RepPrefix : RepnePrefix);
+        return;
+    } else if constexpr (enc.instr == Segment) {
+        i.seg = sr;  // the one closest to the opcode counts
+        i.prefix |= SegPrefix;
+        return;
+    }
+
+    i.op0_t = None;
+    i.op1_t = None;
+    i.reversed = d == 1;
+    i.w = w;
+
+    if constexpr (f.modrm) {
+        u8 mod {(u8)(*b >> 6)}, mid {(u8)((*b >> 3) & 0b111)}, rm {(u8)(*b & 0b111)}; ++b;
+        if constexpr ((enc.flags & MemOnly) != 0)
+            if (mod == 0b11)
+                throw std::runtime_error(std::format("unimplemented opcode 0x{:02x} with a register operand", OPCODE));
+        instr_rm_op(i.op0_t, i.op0, w, mod, rm);
+        if (mod != 0b11)
+            disp_op(b, i.op0, mod, rm);
+        if constexpr (f.mid_reg)
+            instr_reg_op(i.op1_t, i.op1, w, mid);
+        else if constexpr (f.mid_sr)
+            instr_reg_op(i.op1_t, i.op1, 1, 8 + (mid & 0b11));  // SR is wide, and kept here after other wide regs
+        else if constexpr (f.v >= 0 && v == 1)
+            instr_reg_op(i.op1_t, i.op1, 0, 1);  // shift by cl
+        else if constexpr (f.v >= 0)
+            i.op1_t = Imm, i.op1.imm = {1, 0};
+    } else if constexpr (f.reg >= 0 && acc) {
+        instr_reg_op(i.op0_t, i.op0, w, 0);
+        instr_reg_op(i.op1_t, i.op1, w, reg);
+    } else if constexpr (f.reg >= 0) {
+        instr_reg_op(i.op0_t, i.op0, w, reg);
+    } else if constexpr (f.sr >= 0) {
+        instr_reg_op(i.op0_t, i.op0, 1, 8 + sr);
+    } else if constexpr (acc) {
+        instr_reg_op(i.op0_t, i.op0, w, 0);
+        if constexpr ((enc.flags & DxOp) != 0)
+            instr_reg_op(i.op1_t, i.op1, 1, 2);
+    }
+
+    // the data goes in the first free operand
+    static constexpr bool first = !f.modrm && f.reg < 0 && f.sr < 0 && !acc;
+    OpType &op_t = first ? i.op0_t : i.op1_t;
+    Op &op = first ? i.op0 : i.op1;
+    if constexpr (f.data == DataW) {
+        instr_imm_op(b, op_t, op, w, s);
+    } else if constexpr (f.data == Data8) {
+        op_t = Imm;
+        op.imm = {read_data(b, 1, false), 0};
+    } else if constexpr (f.data == Data16) {
+        op_t = Imm;
+        op.imm = {read_data(b, 2), 1};
+    } else if constexpr (f.data == DataAddr) {
+        instr_rm_op(op_t, op, w, 0b00, 0b110);  // disp only
+        disp_op(b, op, 0b00, 0b110);
+    } else if constexpr (f.data == Disp8 || f.data == Disp16) {
+        static constexpr u8 wide = f.data == Disp16;
+        op_t = Rel;
+        op.imm = {read_data(b, wide + 1), wide};  // 8 bit is signed
+    } else if constexpr (f.data == DataPtr) {
+        op_t = Ptr;
+        op.ptr.off = read_data(b, 2);
+        op.ptr.seg = read_data(b, 2);
+    }
+
+    if constexpr ((enc.instr == In || enc.instr == Out) && (enc.flags & DxOp) == 0)
+        i.device = port_device(i.op1.imm.val);
+    else if constexpr (enc.instr == Int)
+        i.device = int_service(i.op0.imm.val);
+    else if constexpr (enc.instr == Int3 || enc.instr == Into)
+        i.device = int_service(enc.instr == Int3 ? 3 : 4);
+}
+
+
+using Decoder = void(*)(const u8 *&, Instr &);
+
+
+template<u8 OPCODE, s8 EXT = -1>
+constexpr Decoder encoding_decoder() {
+    if constexpr (find_encoding(OPCODE, EXT) == NO_ENCODING)
+        return unimplemented;
+    else
+        return decode_encoding<OPCODE, find_encoding(OPCODE, EXT)>;
+}
+
+
+// opcodes shared by several instructions, told apart by the mod reg rm byte
+template<u8 OPCODE, s8... EXTS>
+void decode_extension(const u8 *&b, Instr &i) {
+    static constexpr Decoder table[] {encoding_decoder<OPCODE, EXTS>()...};
+    table[(b[1] >> 3) & 0b111](b, i);
+}
+
+
+template<u8 OPCODE>
+constexpr Decoder decoder() {
+    if constexpr (has_extensions(OPCODE))
+        return decode_extension<OPCODE, 0, 1, 2, 3, 4, 5, 6, 7>;
+    else
+        return encoding_decoder<OPCODE>();
+}
+
+
+template<size_t... OPCODES>
+constexpr auto make_disassembly_table(std::index_sequence<OPCODES...>) {
+    return std::array<Decoder, 256> {decoder<OPCODES>()...};
+}
+
+
+// generated from ENCODINGS, one specialized decoder per opcode byte
+static constexpr auto disassembly_table {make_disassembly_table(std::make_index_sequence<256>{})};
+
+
+// the rest of MAX_INSTR_SIZE after the longest instruction without them
+static constexpr size_t MAX_PREFIXES {MAX_INSTR_SIZE - 6};
+
+
+// Prefixes are decoded one at a time into i until the instruction they go
+// with, then its memory operands take the segment override
+void decode(const u8 *&b, Instr &i) {
+    const u8 *start = b;
+    i.prefix = 0;
+    i.seg = Ds;
+    disassembly_table[*b](b, i);
+    while (i.instr >= Lock) {
+        if ((size_t)(b - start) == MAX_PREFIXES)
+            throw std::runtime_error(std::format("more than {} prefixes", MAX_PREFIXES));
+        disassembly_table[*b](b, i);
+    }
+    if (i.prefix & SegPrefix) {
+        if (i.op0_t == Mem)
+            i.op0.mem.seg = i.seg, i.op0.mem.seg_override = true;
+        if (i.op1_t == Mem)
+            i.op1.mem.seg = i.seg, i.op1.mem.seg_override = true;
+    }
+    i.size = b - start;
+}
+
+
+
+Instr decode(const u8 *bytes, const size_t &size) {
+    // decoded from a copy, past a truncated instruction the decoder reads
+    // zeros rather than what follows the bytes
+    u8 padded[MAX_INSTR_SIZE] {};
+    memcpy(padded, bytes, std::min(size, MAX_INSTR_SIZE));
+    const u8 *b {padded};
+    Instr instr;
+    decode(b, instr);
+    if (instr.size > size)
+        throw std::runtime_error{std::format("Truncated instruction, {} bytes of {}", size, instr.size)};
+    return instr;
+}
+
+
+Cpu::Cpu() : memory(MEMORY_SIZE + 16) {
+    for (u16 i = 0; i < 256; ++i)
+        palette[i] = {(u8)(i >> 2), (u8)(i >> 2), (u8)(i >> 2)};
+}
+
+
+void Cpu::load_program(const u8 *program, const size_t &size) {
+    if (size > MEMORY_SIZE)
+        throw std::runtime_error{std::format("Program does not fit in memory ({} bytes)", size)};
+    memcpy(memory.data(), program, size);
+    memcpy(loaded_vectors, memory.data(), sizeof(loaded_vectors));
+    if (size > 0)
+        mark_dirty(0, size);
+    memset(regs, 0, sizeof(regs));
+    flags = 0, ip = 0;
+    halted = false;
+    executed = 0;
+    program_size = size;
+    if (++decoded_generation == 0)
+        decoded.clear(), decoded_generation = 1;
+    decoded_end = 0;
+    pending = {};
+}
+
+
+bool Cpu::running() const {
+    return !halted && phys_addr(regs[8 + Cs], ip) < program_size;
+}
+
+
+Instr Cpu::step() {
+    const u8 *b {&memory[phys_addr(regs[8 + Cs], ip)]};
+    Instr instr;
+    decode(b, instr);
+    ip += instr.size;
+    ++executed;
+    execute(instr);
+    return instr;
+}
+
+
+u64 Cpu::run(const u64 &n) {
+    u64 done {0};
+    for (; done < n && running(); ++done)
+        step();
+    return done;
+}
+
+
+// ---------------------------------------------------------------------------
+// decoded instructions and superinstructions
+
+
+// sets every arithmetic flag from its operands, without reading any
+static bool sets_flags(const Mnemonic &m) {
+    switch (m) {
+        case Add: case Sub: case Cmp: case And: case Or: case Xor: case Test: case Neg: case Popf:
+            return true;
+        default:
+            return false;
+    }
+}
+
+
+static bool fusable_first(const Instr &instr) {
+    switch (instr.instr) {
+        case Add: case Sub: case Cmp: case And: case Or: case Xor: case Test: case Inc: case Dec:
+            return true;
+        default:
+            return false;
+    }
+}
+
+
+static bool fusable_second(const Instr &instr) {
+    return (instr.instr >= Jo && instr.instr <= Jnle) || (instr.instr >= Loopnz && instr.instr <= Jcxz);
+}
+
+
+void Cpu::forget_decoded(const u32 &begin, const u32 &len) {
+    const u32 end {std::min<u32>(begin + len, decoded.size())};
+    for (u32 a = begin >= DECODED_SPAN - 1 ? begin - (DECODED_SPAN - 1) : 0; a < end; ++a)
+        decoded[a].generation = 0;
+}
+
+
+// Decodes the instruction at phys, which is cs:ip, and the one after it when
+// they fuse. The second one is where step would find it only if ip does not
+// wrap in between, and it runs only if it is still in the program.
+Decoded &Cpu::decode_at(const u32 &phys) {
+    Decoded &d {decoded[phys]};
+    const u8 *b {&memory[phys]};
+    decode(b, d.first);
+    d.span = d.first.size;
+    d.fused = false;
+    d.sets_flags = sets_flags(d.first.instr);
+    if (fusable_first(d.first) && phys + d.first.size < program_size && (u32)ip + d.first.size <= 0xFFFF) {
+        try {
+            decode(b, d.second);
+            if (fusable_second(d.second) && d.first.size + d.second.size <= DECODED_SPAN) {
+                d.fused = true;
+                d.span += d.second.size;
+            }
+        } catch (const std::runtime_error&) {
+            // not an instruction, step would throw once there
+        }
+    }
+    d.cs = regs[8 + Cs];
+    d.ip = ip;
+    d.generation = d.span <= DECODED_SPAN ? decoded_generation : 0;
+    return d;
+}
+
+
+// The first instruction of a superinstruction: its result, its flags pending
+void Cpu::execute_first(const Instr &instr) {
+    const OpType& dest_t = instr.reversed ? instr.op1_t : instr.op0_t;
+    const OpType& src_t  = instr.reversed ? instr.op0_t : instr.op1_t;
+    const Op& dest = instr.reversed ? instr.op1 : instr.op0;
+    const Op& src  = instr.reversed ? instr.op0 : instr.op1;
+    const Mnemonic &m = instr.instr;
+    const u8 &w = instr.w;
+    const u16 mask = w == 1 ? 0xFFFF : 0xFF;
+    const u16 a = read_op(dest_t, dest, w) & mask;
+    const u16 b = m == Inc || m == Dec ? 1 : read_op(src_t, src, w) & mask;
+    u16 val;
+    switch (m) {
+        case Add: case Inc:     val = a + b; break;
+        case Sub: case Cmp:
+        case Dec:               val = a - b; break;
+        case And: case Test:    val = a & b; break;
+        case Or:                val = a | b; break;
+        default:                val = a ^ b; break;  // Xor
+    }
+    val &= mask;
+    if (m != Cmp && m != Test)
+        write_op(dest_t, dest, w, val);
+    pending = {m, a, b, val, w, true};
+}
+
+
+// A condition of jo..jnle on the pending flags, only working out the ones it needs
+bool Cpu::pending_condition(const Mnemonic &jump) {
+    const PendingFlags &p {pending};
+    const u16 sign = p.w == 1 ? 0x8000 : 0x80;
+    const bool zero {p.val == 0}, negative {(p.val & sign) != 0};
+    const bool add {p.instr == Add || p.instr == Inc}, sub {p.instr == Sub || p.instr == Cmp || p.instr == Dec};
+    auto carry = [&]() {
+        if (p.instr == Inc || p.instr == Dec)
+            return ((flags >> Flags::Carry) & 1) == 1;  // kept
+        return add ? (u32)p.a + p.b > (p.w == 1 ? 0xFFFFu : 0xFFu) : sub && p.a < p.b;
+    };
+    auto overflow = [&]() {
+        return add ? ((p.a ^ p.val) & (p.b ^ p.val) & sign) != 0 : sub && ((p.a ^ p.b) & (p.a ^ p.val) & sign) != 0;
+    };
+    const u8 n = jump - Jo;
+    bool c;
+    switch (n / 2) {
+        case 0: c = overflow();                         break;
+        case 1: c = carry();                            break;
+        case 2: c = zero;                               break;
+        case 3: c = carry() || zero;                    break;
+        case 4: c = negative;                           break;
+        case 5: c = !__builtin_parity(p.val & 0xFF);    break;
+        case 6: c = negative != overflow();             break;
+        default: c = zero || negative != overflow();    break;
+    }
+    return c != (n % 2 == 1);
+}
+
+
+// The jump of a superinstruction, ip already past it
+void Cpu::execute_second(const Instr &instr) {
+    const Mnemonic &m = instr.instr;
+    const u16 &rel = instr.op0.imm.val;
+    bool taken;
+    if (m >= Jo && m <= Jnle)
+        taken = pending_condition(m);
+    else if (m == Jcxz)
+        taken = regs[1] == 0;
+    else
+        taken = --regs[1] != 0 && (m == Loop || (m == Loopz) == (pending.val == 0));
+    if (taken)
+        ip += rel;
+}
+
+
+void Cpu::materialize_flags() {
+    if (pending.instr == Inc || pending.instr == Dec)
+        inc_dec(pending.instr, pending.a, pending.w);
+    else
+        arith(pending.instr, pending.a, pending.b, pending.w);
+    pending.pending = false;
+}
+
+
+u64 Cpu::run_decoded(const u64 &n, const bool &fuse) {
+    if (decoded.size() < program_size)
+        decoded.resize(program_size);
+    decoded_end = program_size + DECODED_SPAN;
+    u64 done {0};
+    while (done < n && running()) {
+        const u32 phys {phys_addr(regs[8 + Cs], ip)};
+        Decoded *d {&decoded[phys]};
+        if (d->generation != decoded_generation || d->ip != ip || d->cs != regs[8 + Cs]) [[unlikely]]
+            d = &decode_at(phys);
+        if (pending.pending && !d->sets_flags)
+            materialize_flags();
+        pending.pending = false;
+
+        ip += d->first.size;
+        ++executed;
+        ++done;
+        if (!(fuse && d->fused && done < n)) {
+            execute(d->first);
+            continue;
+        }
+        execute_first(d->first);
+        if (d->generation != decoded_generation)
+            continue;  // it wrote over the jump, decoded again as the next instruction
+        ip += d->second.size;
+        ++executed;
+        ++done;
+        execute_second(d->second);
+    }
+    if (pending.pending)
+        materialize_flags();
+    return done;
+}
+
+
+// ---------------------------------------------------------------------------
+// history
+
+
+History::History(Cpu &cpu, const u64 &every, const size_t &capacity)
+    : cpu {cpu}, every {std::max<u64>(every, 1)}, capacity {std::max<size_t>(capacity, 2)}, saved(NB_PAGES, 0) {
+    cpu.history = this;
+    checkpoint();
+}
+
+
+History::~History() {
+    cpu.history = nullptr;
+}
+
+
+void History::checkpoint() {
+    if (checkpoints.size() == capacity)
+        checkpoints.erase(checkpoints.begin());  // its pages only restore it
+    Checkpoint &c {checkpoints.emplace_back()};
+    c.executed = cpu.executed;
+    memcpy(c.regs, cpu.regs, sizeof(c.regs));
+    c.flags = cpu.flags, c.ip = cpu.ip, c.halted = cpu.halted;
+    c.dac_index = cpu.dac_index, c.dac_component = cpu.dac_component;
+    c.palette = cpu.palette;
+    c.console = cpu.console.size();
+    ++interval;
+    steps.clear();
+    writes.clear();
+}
+
+
+void History::writing(const u32 &phys, const u32 &len) {
+    Checkpoint &c {checkpoints.back()};
+    for (u32 page = phys >> PAGE_BITS; page <= (phys + len - 1) >> PAGE_BITS; ++page)
+        if (saved[page] != interval) {
+            saved[page] = interval;
+            c.pages.push_back(page);
+            c.contents.insert(c.contents.end(), &cpu.memory[page << PAGE_BITS], &cpu.memory[(page + 1) << PAGE_BITS]);
+        }
+    for (u32 a = phys; a < phys + len; ++a)
+        writes.push_back({a, cpu.memory[a]});
+}
+
+
+u64 History::run(const u64 &n) {
+    u64 done {0};
+    for (; done < n && cpu.running(); ++done) {
+        // taken when the next step starts, so the steps of the interval stay until then
+        if (cpu.executed % every == 0 && cpu.executed != checkpoints.back().executed)
+            checkpoint();
+        UndoStep &s {steps.emplace_back()};
+        memcpy(s.regs, cpu.regs, sizeof(s.regs));
+        s.flags = cpu.flags, s.ip = cpu.ip, s.halted = cpu.halted;
+        s.dac_index = cpu.dac_index, s.dac_component = cpu.dac_component;
+        s.dac_value = cpu.palette[cpu.dac_index][cpu.dac_component];
+        s.console = cpu.console.size();
+        s.writes = writes.size();
+        cpu.step();
+    }
+    return done;
+}
+
+
+void History::undo_step() {
+    const UndoStep &s {steps.back()};
+    for (size_t w = writes.size(); w-- > s.writes;) {
+        cpu.memory[writes[w].phys] = writes[w].old;
+        cpu.mark_dirty(writes[w].phys, 1);
+    }
+    writes.resize(s.writes);
+    memcpy(cpu.regs, s.regs, sizeof(s.regs));
+    cpu.flags = s.flags, cpu.ip = s.ip, cpu.halted = s.halted;
+    cpu.dac_index = s.dac_index, cpu.dac_component = s.dac_component;
+    cpu.palette[s.dac_index][s.dac_component] = s.dac_value;
+    cpu.console.resize(std::min<size_t>(cpu.console.size(), s.console));
+    --cpu.executed;
+    steps.pop_back();
+}
+
+
+// back to checkpoint k, the later ones dropped: running again takes them again
+void History::restore(const size_t &k) {
+    for (size_t j = checkpoints.size(); j-- > k;) {
+        const Checkpoint &c {checkpoints[j]};
+        for (size_t p = 0; p < c.pages.size(); ++p) {
+            memcpy(&cpu.memory[c.pages[p] << PAGE_BITS], &c.contents[p * PAGE_SIZE], PAGE_SIZE);
+            cpu.mark_dirty(c.pages[p] << PAGE_BITS, PAGE_SIZE);
+        }
+    }
+    checkpoints.erase(checkpoints.begin() + k + 1, checkpoints.end());
+    Checkpoint &c {checkpoints.back()};
+    memcpy(cpu.regs, c.regs, sizeof(c.regs));
+    cpu.flags = c.flags, cpu.ip = c.ip, cpu.halted = c.halted;
+    cpu.dac_index = c.dac_index, cpu.dac_component = c.dac_component;
+    cpu.palette = c.palette;
+    cpu.console.resize(std::min<size_t>(cpu.console.size(), c.console));
+    cpu.executed = c.executed;
+    c.pages.clear();
+    c.contents.clear();
+    ++interval;
+    steps.clear();
+    writes.clear();
+}
+
+
+bool History::go_to(const u64 &target) {
+    if (target < oldest())
+        return false;
+    if (target >= cpu.executed) {
+        run(target - cpu.executed);
+        return cpu.executed == target;
+    }
+    if (target < checkpoints.back().executed) {
+        size_t k {checkpoints.size() - 1};
+        while (checkpoints[k].executed > target)
+            --k;
+        restore(k);
+        run(target - cpu.executed);
+        return cpu.executed == target;
+    }
+    while (cpu.executed > target)
+        undo_step();
+    return true;
+}
+
+
+template<typename Match, typename Interval>
+std::optional<u64> History::find(Match &&match, Interval &&may_have) {
+    const u64 now {cpu.executed};
+    for (size_t k = checkpoints.size(); k-- > 0;) {
+        if (k + 1 < checkpoints.size()) {
+            if (!may_have(checkpoints[k]))
+                continue;
+            const u64 end {checkpoints[k + 1].executed};
+            restore(k);
+            run(end - cpu.executed);
+        }
+        for (size_t i = steps.size(); i-- > 0;)
+            if (match(i)) {
+                const u64 found {checkpoints.back().executed + i};
+                go_to(found);
+                return found;
+            }
+    }
+    go_to(now);
+    return std::nullopt;
+}
+
+
+std::optional<u64> History::last_write(const u32 &phys) {
+    auto wrote = [&](const size_t &i) {
+        const size_t end {i + 1 < steps.size() ? steps[i + 1].writes : writes.size()};
+        for (size_t w = steps[i].writes; w < end; ++w)
+            if (writes[w].phys == phys)
+                return true;
+        return false;
+    };
+    auto wrote_page = [&](const Checkpoint &c) {
+        return std::find(c.pages.begin(), c.pages.end(), phys >> PAGE_BITS) != c.pages.end();
+    };
+    return find(wrote, wrote_page);
+}
+
+
+std::optional<u64> History::last_change(const u8 &reg) {
+    // before step i, and after the last one
+    auto value = [&](const size_t &i) -> u16 {
+        if (i == steps.size())
+            return reg == 12 ? cpu.flags : cpu.regs[reg];
+        return reg == 12 ? steps[i].flags : steps[i].regs[reg];
+    };
+    return find([&](const size_t &i) { return value(i) != value(i + 1); }, [](const Checkpoint &) { return true; });
+}
+
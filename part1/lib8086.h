@@ -0,0 +1,406 @@
+#pragma once
+
+// 8086 decoding, simulation and clock estimation, without any global state:
+// the tables are constant and everything a running program changes is in its
+// Cpu, so that any number of them can run on their own threads.
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <vector>
+
+
+using u8  = uint8_t;
+using u16 = uint16_t;
+using s8  = int8_t;
+using s16 = int16_t;
+using u32 = uint32_t;
+using s32 = int32_t;
+using u64 = uint64_t;
+using s64 = int64_t;
+using f64 = double;
+
+
+// 20 bits of physical address space, addresses wrap around at 1 MB like on the 8086
+static constexpr u32 MEMORY_SIZE {1 << 20};
+static constexpr u32 MEMORY_MASK {MEMORY_SIZE - 1};
+
+// Memory is tracked in pages of 256 bytes, every write marks its page dirty.
+// A byte per page rather than a bit, so that marking is a single store.
+static constexpr u32 PAGE_BITS {8};
+static constexpr u32 PAGE_SIZE {1 << PAGE_BITS};
+static constexpr u32 NB_PAGES {MEMORY_SIZE >> PAGE_BITS};
+
+static constexpr u32 FRAMEBUFFER {0xA0000};  // 320x200, a palette index per pixel, as vga mode 13h
+static constexpr u16 FRAMEBUFFER_WIDTH {320}, FRAMEBUFFER_HEIGHT {200};
+
+
+inline u32 phys_addr(const u16 &seg, const u16 &offset) {
+    return ((((u32)seg) << 4) + offset) & MEMORY_MASK;
+}
+
+
+static constexpr struct {
+    char value[3];
+} REG_ENCODING[2][12] = {
+    {{"al"}, {"cl"}, {"dl"}, {"bl"}, {"ah"}, {"ch"}, {"dh"}, {"bh"}},  // w = 0
+    {{"ax"}, {"cx"}, {"dx"}, {"bx"}, {"sp"}, {"bp"}, {"si"}, {"di"},   // w = 1
+     {"es"}, {"cs"}, {"ss"}, {"ds"}}  // reg mem, also wide
+};
+
+// register index that reads as 0, for memory operands without a base or an index
+static constexpr u8 NO_REG {12};
+
+
+enum Mnemonic : u8 {
+    Mov, Push, Pop, Xchg, In, Out, Xlat, Lea, Lds, Les, Lahf, Sahf, Pushf, Popf,
+    Add, Adc, Inc, Aaa, Daa, Sub, Sbb, Dec, Neg, Cmp, Aas, Das,
+    Mul, Imul, Aam, Div, Idiv, Aad, Cbw, Cwd,
+    Not, Rol, Ror, Rcl, Rcr, Shl, Shr, Sar, And, Test, Or, Xor,
+    Movs, Cmps, Scas, Lods, Stos,
+    Call, CallFar, Jmp, JmpFar, Ret, Retf,
+    Jo, Jno, Jb, Jnb, Je, Jne, Jbe, Jnbe, Js, Jns, Jp, Jnp, Jl, Jnl, Jle, Jnle,
+    Loopnz, Loopz, Loop, Jcxz,
+    Int, Int3, Into, Iret,
+    Clc, Cmc, Stc, Cld, Std, Cli, Sti, Hlt, Wait, Nop,
+    Lock, Rep, Segment,  // prefixes, never end up in a decoded Instr
+};
+
+
+// segment registers, in the registers after the 8 wide ones, same order as the sr encoding
+enum Segs { Es, Cs, Ss, Ds };
+
+// bit positions in the flags
+enum Flags { Carry = 0, Parity = 2, AuxCarry = 4, Zero = 6, Sign = 7, Trap = 8, Interrupt = 9, Direction = 10, Overflow = 11 };
+
+
+struct Reg {
+    u8 val;
+    u8 w;
+};
+
+
+struct Mem {
+    u8 reg;             // MEM_ENCODING, when base is not NO_REG
+    bool has_disp;
+    u16 disp;           // 0 without displacement
+    u8 base, index;     // registers added to disp, resolved at decode time
+    u8 seg;             // segment used for the access, resolved at decode time (Segs)
+    bool seg_override;  // seg comes from a prefix, printed
+};
+
+
+struct Imm {
+    u16 val;
+    u8 w;
+};
+
+
+// direct intersegment address, seg:off
+struct Ptr {
+    u16 seg;
+    u16 off;
+};
+
+
+union Op {
+    Reg reg;
+    Mem mem;
+    Imm imm;  // also relative jumps, from the next instruction
+    Ptr ptr;
+};
+
+
+enum OpType {
+    Reg,
+    Mem,
+    Imm,
+    Rel,
+    Ptr,
+    None
+};
+
+
+enum Prefixes { LockPrefix = 1, RepPrefix = 2, RepnePrefix = 4, SegPrefix = 8 };
+
+
+struct Instr {
+    Mnemonic instr;
+    OpType op0_t;
+    OpType op1_t;
+    Op op0;
+    Op op1;
+    bool reversed;  // if true, INSTR op1, op0
+    u8 w;           // operand size, when not given by a register
+    u8 prefix;      // Prefixes
+    u8 seg;         // Segs of the implicit ds:si of string instructions and ds:bx of xlat, Ds unless overridden
+    u8 size;        // encoded length in bytes, prefixes included
+    u8 device;      // in/out with an immediate port: Devices, int: Services
+};
+
+
+// Instructions are formatted through a cursor into a buffer with room for the
+// longest one, so that bulk disassembly does not allocate per instruction.
+static constexpr size_t MAX_INSTR_TEXT {64};
+
+// nasm syntax of the instruction, out needs MAX_INSTR_TEXT of room
+char *emit(char *out, const Instr &instr);
+std::string to_string(const Instr &instr);
+
+
+// The most bytes decode reads for an instruction, prefixes included: buffers
+// decoded in place need that many readable from the start of their last one
+static constexpr size_t MAX_INSTR_SIZE {15};
+
+// Decodes the instruction at b and moves b past it. Throws on an opcode the
+// 8086 does not have, and past 9 prefixes. Reads up to MAX_INSTR_SIZE bytes
+// from b, a few past the end of what is decoded for a truncated instruction.
+void decode(const u8 *&b, Instr &i);
+// Decodes the instruction at the start of the size bytes, throws if they
+// end before it does
+Instr decode(const u8 *bytes, const size_t &size);
+
+
+// 8086 clocks of the effective address calculation
+u16 ea(const struct Mem &mem);
+// 8086 clocks of an instruction, taken for jumps that went and reps for how
+// many times a repeated string instruction went, or the count of a shift by cl
+u32 instr_clocks(const Instr &instr, const bool &taken, const u16 &reps);
+// reps for instr_clocks of an instruction that ran with cx before and after it
+u16 clock_reps(const Instr &instr, const u16 &cx_before, const u16 &cx_after);
+// Bus cycles an instruction takes for its operands, the stack and interrupt
+// vectors, on a bus of bus_bytes (1 on the 8088, where a word takes two).
+// Words at odd addresses are counted as one.
+u32 bus_cycles(const Instr &instr, const u16 &reps, const u8 &bus_bytes);
+
+
+// The clocks of one instruction in the Prefetch model, from the end of the
+// one before: its own, then what it waited for
+struct BusTiming {
+    u32 clocks {0};
+    u32 queue_stall {0};  // its bytes not in the queue yet
+    u32 bus_stall {0};    // its operands waiting for a prefetch to end
+};
+
+// The bus interface unit prefetching instruction bytes into its queue while
+// the execution unit runs, the two sharing the bus. A bus cycle is 4 clocks
+// and fetches a word, a byte at an odd address or on the 8088. instr_clocks
+// are for an instruction already in the queue, which the queue adds to:
+// - an instruction starts once its bytes are all in the queue
+// - its operand bus cycles are the last of its clocks, after a prefetch in
+//   flight ends, and no prefetch happens during them
+// - a transfer of control empties the queue, its clocks include the first
+//   fetch at the target
+struct Prefetch {
+    u8 queue_size {6};   // 4 on the 8088
+    u8 bus_bytes {2};    // 1 on the 8088
+    u64 now {0};         // clocks, at the end of the last instruction
+    u8 queued {0};
+    u16 fetch_ip {0};    // of the next byte to fetch
+    bool fetching {false};
+    u8 fetch_bytes {0};
+    u64 fetch_end {0};
+    u64 bus_free {0};    // since when the bus is free to prefetch
+
+    explicit Prefetch(const bool &i8088 = false);
+    // Empties the queue and prefetches from ip, as after a reset
+    void restart(const u16 &ip);
+    // Empties the queue for a transfer of control to ip, its first bus cycle
+    // there done, as counted in the clocks of transfers
+    void jumped(const u16 &ip);
+    // Times the instruction that was at ip - size, next_ip after it; taken
+    // and reps as for instr_clocks
+    BusTiming step(const Instr &instr, const bool &taken, const u16 &reps, const u16 &next_ip);
+
+private:
+    // runs the prefetches that end by t, and starts the ones that can before t
+    void fill(const u64 &t);
+};
+
+
+// An instruction as Cpu::run_decoded keeps it, by the physical address it was
+// decoded from. An instruction setting the flags is fused with a conditional
+// jump, loop or jcxz right after it into one superinstruction, which leaves
+// the flags it sets pending (see PendingFlags).
+struct Decoded {
+    Instr first;
+    Instr second;             // the jump, when fused
+    u16 cs {0}, ip {0};       // what it was decoded for: where the second one is depends on them
+    u8 span {0};              // bytes of both
+    u32 generation {0};       // valid while the Cpu's decoded_generation
+    bool fused {false};
+    bool sets_flags {false};  // first sets every arithmetic flag and reads none
+};
+
+// Writes invalidate the instructions that may cover them this far back, and
+// the ones spanning more bytes are decoded each time
+static constexpr u8 DECODED_SPAN {16};
+
+// The arithmetic flags of the first instruction of a superinstruction, not
+// computed unless the instruction after it reads them or does not overwrite
+// them all. Its jump is taken on what they would be, from the operands.
+struct PendingFlags {
+    Mnemonic instr {Nop};
+    u16 a {0}, b {0}, val {0};
+    u8 w {0};
+    bool pending {false};
+};
+
+
+struct History;
+
+
+// An 8086 with its 1 MB of memory, its devices and the count of instructions
+// it went through. Programs are loaded at 0:0, over the interrupt vector table,
+// and run from there.
+struct Cpu {
+    std::vector<u8> memory;  // MEMORY_SIZE, then a few bytes for decoding to run into
+    u16 regs[13] {};         // ax cx dx bx sp bp si di, es cs ss ds; the last one is NO_REG, never written
+    u16 flags {0};           // XXXXODITSZXAXPXC
+    u16 ip {0};
+    bool halted {false};
+    u64 executed {0};        // instructions stepped, the timer counts them
+    size_t program_size {0};
+    u8 dirty[NB_PAGES] {};   // pages written since the user of the Cpu last cleared them
+    // Vectors still as loaded are not handlers the program installed
+    u8 loaded_vectors[1024] {};
+    std::array<std::array<u8, 3>, 256> palette;  // 6 bit components, grays until programmed
+    u8 dac_index {0}, dac_component {0};
+    std::string console;     // what the program wrote to the console, for the user of the Cpu to take
+    std::vector<Decoded> decoded;  // by physical address in the program, once run_decoded ran
+    u32 decoded_end {0};     // writes below may change decoded instructions
+    u32 decoded_generation {1};  // loading a program forgets them all at once
+    PendingFlags pending;
+    History *history {nullptr};  // told about writes before they happen, while attached
+
+    Cpu();
+
+    // Resets the registers, flags and counters, and puts the program at 0:0;
+    // memory past it is left as it is
+    void load_program(const u8 *program, const size_t &size);
+    // not halted and cs:ip still in the program
+    bool running() const;
+    // Executes the instruction at cs:ip, returned decoded
+    Instr step();
+    // Steps up to n instructions while running, returns how many it did
+    u64 run(const u64 &n);
+    // Executes a decoded instruction, ip already points past it
+    void execute(const Instr &instr);
+    // Steps up to n instructions like run, decoding each address once, and
+    // executing superinstructions when fuse is set: same results as run,
+    // flags computed by the time it returns. Memory changed other than
+    // through the Cpu needs forget_decoded.
+    u64 run_decoded(const u64 &n, const bool &fuse);
+    void forget_decoded(const u32 &begin, const u32 &len);
+
+    u8 *byte_regs() { return reinterpret_cast<u8*>(regs); }
+    void mark_dirty(const u32 &begin, const u32 &len);
+    u16 get_addr(const struct Mem &mem);
+    u16 read_mem(const u16 &seg, const u16 &addr, const u8 &w);
+    void write_mem(const u16 &seg, const u16 &addr, const u16 &val, const u8 &w);
+    u16 load(const struct Mem &mem, const u8 &w);
+    void store(const struct Mem &mem, const u16 &val, const u8 &w);
+    u16 reg_val(const struct Reg &reg);
+    void set_reg(const struct Reg &reg, const u16 &val);
+    u16 read_op(const OpType &op_t, const Op &op, const u8 &w);
+    void write_op(const OpType &op_t, const Op &op, const u8 &w, const u16 &val);
+    void push(const u16 &val);
+    u16 pop();
+    u16 arith(const Mnemonic &instr, const u16 &x, const u16 &y, const u8 &w);
+    u16 inc_dec(const Mnemonic &instr, const u16 &a, const u8 &w);
+    u16 shift(const Mnemonic &instr, const u16 &a, const u8 &count, const u8 &w);
+    bool multiply_divide(const Mnemonic &instr, const u16 &src, const u8 &w);
+    bool decimal_adjust(const Mnemonic &instr, const u8 &base);
+    bool condition(const Mnemonic &instr);
+    void string_step(const Mnemonic &instr, const u8 &w, const u8 &seg);
+    void string_repeat(const Mnemonic &instr, const u8 &w, const bool &until_zero, const u8 &seg);
+    void interrupt(const u8 &n, const u8 &service);
+    Decoded &decode_at(const u32 &phys);
+    void execute_first(const Instr &instr);
+    void execute_second(const Instr &instr);
+    bool pending_condition(const Mnemonic &jump);
+    void materialize_flags();
+};
+
+
+// What a step changes other than memory, as it was before it
+struct UndoStep {
+    u16 regs[12];
+    u16 flags, ip;
+    bool halted;
+    u8 dac_index, dac_component;
+    u8 dac_value;            // the palette component an out to the dac may change
+    u32 console;             // length
+    u32 writes;              // its first UndoWrite
+};
+
+struct UndoWrite {
+    u32 phys;
+    u8 old;
+};
+
+// A Cpu's state as it was at some count of instructions, and the pages as
+// they were then that were written after it, up to the next checkpoint
+struct Checkpoint {
+    u64 executed;
+    u16 regs[12];
+    u16 flags, ip;
+    bool halted;
+    u8 dac_index, dac_component;
+    std::array<std::array<u8, 3>, 256> palette;
+    size_t console;
+    std::vector<u32> pages;
+    std::vector<u8> contents;  // PAGE_SIZE per page
+};
+
+// Time travel for a Cpu it runs. A checkpoint is taken every `every`
+// instructions and the last `capacity` of them are kept; since the last one,
+// each step can be undone. Going back further restores the closest
+// checkpoint before and runs forward from there, as do the queries about
+// what happened before. Runs are deterministic, the timer counting
+// instructions, so running again gives the same history. The console is
+// kept whole, for going back to cut.
+struct History {
+    Cpu &cpu;
+    u64 every;
+    size_t capacity;
+    std::vector<Checkpoint> checkpoints;  // oldest first
+    std::vector<u32> saved;               // by page, the interval it was last saved for
+    u32 interval {0};                     // counts checkpoints, never reused
+    std::vector<UndoStep> steps;          // since the last checkpoint
+    std::vector<UndoWrite> writes;
+
+    // Attaches to the Cpu, with a checkpoint where it is
+    History(Cpu &cpu, const u64 &every, const size_t &capacity);
+    ~History();
+    History(const History&) = delete;
+    History &operator=(const History&) = delete;
+
+    // Steps up to n instructions while running, recording them
+    u64 run(const u64 &n);
+    // To where the Cpu was after target instructions, false if that is
+    // before the oldest checkpoint or past where it stops running
+    bool go_to(const u64 &target);
+    // Back to just before the last instruction that wrote the byte at phys,
+    // or the last that changed a register (12 for the flags), returning that
+    // count; asking again goes further back. The Cpu stays where it is when
+    // there is none since the oldest checkpoint.
+    std::optional<u64> last_write(const u32 &phys);
+    std::optional<u64> last_change(const u8 &reg);
+    // the oldest count of instructions it can go back to
+    u64 oldest() const { return checkpoints.front().executed; }
+
+    // from the Cpu, before it writes len bytes at phys
+    void writing(const u32 &phys, const u32 &len);
+
+private:
+    void checkpoint();
+    void undo_step();
+    void restore(const size_t &k);
+    // Before the last step matching, in the steps since the last checkpoint
+    // then in the intervals between checkpoints that may_have it
+    template<typename Match, typename Interval> std::optional<u64> find(Match &&match, Interval &&may_have);
+};
+
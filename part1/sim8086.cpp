@@ -1,21 +1,28 @@
+#include "lib8086.h"
+#include "../common/profiler.h"
+
+#include <algorithm>
 #include <cassert>
-#include <cstdint>
+#include <cctype>
+#include <chrono>
 #include <cstring>
 #include <format>
 #include <iostream>
+#include <limits>
+#include <optional>
+#include <random>
 #include <stdexcept>
+#include <thread>
+#include <vector>
 
 
-using u8  = uint8_t;
-using u16 = uint16_t;
-using s8  = int8_t;
-using s16 = int16_t;
-
+// -d only dumps the first 64 KB (segment 0), which is where the listings draw
+static constexpr u32 DUMP_SIZE {1 << 16};
 
-static u8 MEMORY[1 << 16];
 
-
-void read_instructions(const char* file_path, size_t &size) {
+// the program, followed by a few zeros for decoding to run into
+std::vector<u8> read_instructions(const char* file_path, size_t &size) {
+    ProfileScope profile {"read"};
     auto file = fopen(file_path, "rb");
     if (file == nullptr)
         throw std::runtime_error{std::format(
@@ -26,195 +33,30 @@ void read_instructions(const char* file_path, size_t &size) {
     fseek(file, 0, SEEK_END);
     size = ftell(file);
     rewind(file);
+    if (size > MEMORY_SIZE)
+        throw std::runtime_error{std::format(
+            "File {} does not fit in memory ({} bytes)",
+            std::string{file_path},
+            size
+        )};
 
-    fread(MEMORY, 1, size, file);
+    std::vector<u8> program(size + 16);
+    fread(program.data(), 1, size, file);
     fclose(file);
+    return program;
 }
 
 
-static constexpr struct {
-    char value[3];
-} REG_ENCODING[2][12] = {
-    {{"al"}, {"cl"}, {"dl"}, {"bl"}, {"ah"}, {"ch"}, {"dh"}, {"bh"}},  // w = 0
-    {{"ax"}, {"cx"}, {"dx"}, {"bx"}, {"sp"}, {"bp"}, {"si"}, {"di"},   // w = 1
-     {"es"}, {"cs"}, {"ss"}, {"ds"}}  // reg mem, also wide
-};
-
-
-static constexpr struct {
-    char value[8];
-} MEM_ENCODING[8] = {
-    {"bx + si"},
-    {"bx + di"},
-    {"bp + si"},
-    {"bp + di"},
-    {"si"},
-    {"di"},
-    {"bp"},
-    {"bx"},
-};
-
-
-static constexpr struct {
-    char value[4];
-} OPS_ENCODING[8] {"add", "or", "adc", "sbb", "and", "sub", "", "cmp"};
+static u64 CLOCKS {0};
+static u64 QUEUE_STALLS {0}, BUS_STALLS {0};
+static u64 UNTIMED {0};  // instructions without clocks, counted as none
 
 
-static constexpr struct {
-    char value[5];
-} JUMP_ENCODING[16] {
-    {"jo"}, {"jno"}, {"jb"}, {"jnb"}, {"je"}, {"jne"}, {"jbe"}, {"jnbe"},
-    {"js"}, {"jns"}, {"jp"}, {"jnp"}, {"jl"}, {"jnl"}, {"jle"}, {"jnle"}
+static constexpr char FLAG_NAMES[16][2] {
+    {"C"}, {""}, {"P"}, {""}, {"A"}, {""}, {"Z"}, {"S"}, {"T"}, {"I"}, {"D"}, {"O"}, {""}, {""}, {""}, {""}
 };
 
 
-static constexpr struct {
-    char value[7];
-} LOOP_ENCODING[4] { {"loopnz"}, {"loopz"}, {"loop"}, {"jcxz"} };
-
-
-static u16 REGS[12] = {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0};
-
-static u16 CLOCKS {0};
-
-
-static u8 *const HALF_REGS[8] = {
-    reinterpret_cast<u8*>(&REGS[0]),
-    reinterpret_cast<u8*>(&REGS[1]),
-    reinterpret_cast<u8*>(&REGS[2]),
-    reinterpret_cast<u8*>(&REGS[3]),
-    reinterpret_cast<u8*>(&REGS[0]) + 1,
-    reinterpret_cast<u8*>(&REGS[1]) + 1,
-    reinterpret_cast<u8*>(&REGS[2]) + 1,
-    reinterpret_cast<u8*>(&REGS[3]) + 1,
-};
-
-
-enum Flags { Sign, Zero, Parity };
-
-
-// for now only parity, zero and sign
-static constexpr char FLAG_NAMES[16][3] {
-    {"S"}, {"Z"}, {"P"}
-};
-
-
-// XXXXXXXXXXXXXPZS
-static u16 FLAGS {0};
-
-
-static u16 IP {0};
-
-
-struct Reg {
-    u8 val;
-    u8 w;
-};
-std::string to_string(const Reg &reg) {
-    return REG_ENCODING[reg.w][reg.val].value;
-}
-
-
-struct Mem {
-    bool has_reg;
-    u8 reg;
-    bool has_disp;
-    u16 disp;
-};
-std::string to_string(const Mem &mem) {
-    s16 disp = (s16)mem.disp;
-    if (mem.has_reg && mem.has_disp)
-        return std::format("[{} {} {}]", MEM_ENCODING[mem.reg].value, disp >= 0 ? "+" : "-", std::abs(disp));
-    if (mem.has_reg)
-        return std::format("[{}]", MEM_ENCODING[mem.reg].value);
-    if (mem.has_disp)
-        return std::format("[{}]", mem.disp);
-    throw std::runtime_error("Neither reg nor mem");
-}
-
-
-struct Imm {
-    u16 val;
-    u8 w;
-};
-std::string to_string(const Imm &imm) {
-    return std::format("{}", (s16)imm.val);
-}
-
-
-union Op {
-    Reg reg;
-    Mem mem;
-    Imm imm;
-};
-
-
-enum OpType {
-    Reg,
-    Mem,
-    Imm
-};
-
-
-struct Instr {
-    std::string instr;
-    OpType op0_t;
-    OpType op1_t;
-    Op op0;
-    Op op1;
-    bool reversed;  // if true, INSTR op1, op0
-};
-std::string to_string(const Instr &instr) {
-    std::string op0;
-    std::string op1;
-    switch (instr.op0_t) {
-        case Reg:
-            op0 = to_string(instr.op0.reg); break;
-        case Mem:
-            op0 = to_string(instr.op0.mem); break;
-        case Imm:
-            op0 = to_string(instr.op0.imm); break;
-    }
-    switch (instr.op1_t) {
-        case Reg:
-            op1 = to_string(instr.op1.reg); break;
-        case Mem:
-            op1 = to_string(instr.op1.mem); break;
-        case Imm:
-            op1 = to_string(instr.op1.imm); break;
-    }
-    std::string suffix_instr;
-    std::string prefix_imm;
-    if (instr.op1_t == Imm && instr.op0_t == Mem) {
-        // size is ambiguous, need to specify
-        assert(!instr.reversed);
-        if (instr.instr == "mov")
-            prefix_imm = instr.op1.imm.w == 1 ? "word " : " byte ";
-        else
-            suffix_instr = instr.op1.imm.w == 1 ? " word" : " byte";
-    }
-    if (instr.op0_t == Imm) {  // special instruction, ignore op1, only op0 is used
-                               // $ means relative jump
-                               // need to add two (otherwise points to next instr) and always explicitely sign
-        s16 reljump = ((s16)instr.op0.imm.val) + 2;
-        return std::format("{} ${}{}", instr.instr, reljump >=0 ? "+" : "-", std::abs(reljump));
-    }
-    if (instr.reversed)
-        return std::format("{}{} {}, {}", instr.instr, suffix_instr, op1, op0);
-    return std::format("{}{} {}, {}{}", instr.instr, suffix_instr, op0, prefix_imm, op1);
-}
-
-
-std::string print_reg_val(const struct Reg &reg) {
-    char hex[7];
-    if (reg.w == 1)
-        sprintf(hex, "%x", REGS[reg.val]);
-    else
-        sprintf(hex, "%x", REGS[reg.val % 4]);
-    return std::string(hex);
-}
-
-
 void print_one_reg(const char* name, const u16 &value) {
     char hex[2];
     std::cout << "\t\t" << name << ": 0x";
@@ -226,139 +68,48 @@ void print_one_reg(const char* name, const u16 &value) {
 }
 
 
-void print_all_regs() {
+void print_all_regs(const Cpu &cpu) {
     std::cout << "Final registers:" << std::endl;
-    print_one_reg("ip", IP);
+    print_one_reg("ip", cpu.ip);
     for (u8 i = 0; i < 12; ++i)
-        print_one_reg(REG_ENCODING[1][i].value, REGS[i]);
-}
-
-
-template<typename U>
-void update_flags(const U &val, const u8 &w) {
-    u8 nbbits = (w + 1) * 8;
-    FLAGS = 0;
-    FLAGS |= ((u16)val == 0) << Flags::Zero;
-    FLAGS |= ((u16)((val >> (nbbits - 1)) & 1)) << Flags::Sign;
-    FLAGS |= ((u16)(1 ^ __builtin_parity(val & 0xFF))) << Flags::Parity;
-}
-
-
-u16 get_addr(const struct Mem &mem) {
-    u16 addr {0};
-    if (mem.has_reg) {
-        switch(mem.reg) {
-            case 0:  // bx + si
-                addr += REGS[3] + REGS[6];  break;
-            case 1:  // bx + di
-                addr += REGS[3] + REGS[7];  break;
-            case 2:  // bp + si
-                addr += REGS[5] + REGS[6];  break;
-            case 3:  // bp + di
-                addr += REGS[5] + REGS[7];  break;
-            case 4:  // si
-                addr += REGS[6];            break;
-            case 5:  // di
-                addr += REGS[7];            break;
-            case 6:  // bp
-                addr += REGS[5];            break;
-            case 7:  // bx
-                addr += REGS[3];            break;
-        }
-    }
-    if (mem.has_disp) {
-        addr += mem.disp;
-    }
-    return addr;
-}
-
-
-u16 load(const struct Mem &mem) {
-    u16 addr {get_addr(mem)};
-    return ((u16)MEMORY[addr]) + (((u16)MEMORY[addr + 1]) << 8);
-}
-
-
-void store(const struct Mem &mem, const u16 &val) {
-    u16 addr {get_addr(mem)};
-    MEMORY[addr] = (u8)(val & 0xFF);
-    MEMORY[addr + 1] = (u8)((val >> 8) &0xFF);
+        print_one_reg(REG_ENCODING[1][i].value, cpu.regs[i]);
 }
 
 
-void apply_instr(const std::string &instr, const OpType &dest_t, const OpType &src_t, const Op &dest, const Op &src) {
-    u16 src_val;
-    if(src_t == Imm)
-        src_val = src.imm.val;
-    else if (src_t == Mem)
-        src_val = load(src.mem);
-    else
-        src_val = src.reg.w == 1 ? REGS[src.reg.val] : (u16)*HALF_REGS[src.reg.val];
-
-    u16 dest_val;
-    if (dest_t == Mem)
-        dest_val = load(dest.mem);
-    else if (dest_t == Reg)
-        dest_val = dest.reg.w == 1 ? REGS[dest.reg.val] : (u16)*HALF_REGS[dest.reg.val];
-    else
-        throw std::runtime_error{"Should not get to apply_instr in the instruction destination is an immediate"};
-
-    if (instr == "mov") {
-        dest_val = src_val;
-        goto update_values;
-    } else if (instr == "add") {
-        dest_val += src_val;
-        goto update_flags_dest;
-    } else if (instr == "sub") {
-        dest_val -= src_val;
-        goto update_flags_dest;
-    } else if (instr == "cmp") {
-        if (dest_t == Reg && dest.reg.w == 0)
-            update_flags((u8)dest_val - (u8)src_val, 0);
-        else
-            update_flags(dest_val - src_val, 1);
-    } else {
-        throw std::runtime_error(std::format("Instruction application not implemented: {}", instr));
-    }
-    return;
-
-    update_flags_dest:
-    update_flags(dest_val, dest_t == Reg ? dest.reg.w : 1);
-
-    update_values:
-    if (dest_t == Mem)
-        store(dest.mem, dest_val);
-    else {
-        if (dest.reg.w == 1)
-            REGS[dest.reg.val] = dest_val;
-        else
-            *HALF_REGS[dest.reg.val] = (u8)dest_val;
-    }
+// opened for writing, or throws
+FILE *open_output(const char *path) {
+    auto file = fopen(path, "wb");
+    if (file == nullptr)
+        throw std::runtime_error{std::format("Cannot write {}", path)};
+    return file;
 }
 
 
-void cond_jump(const std::string &instr, const struct Imm &imm, const std::string jump, const std::string neg_jump, Flags flag) {
-    if (instr == jump) {
-        if((FLAGS >> flag & 1) == 1)
-            IP += (s16)imm.val;
-    } else if (instr == neg_jump) {
-        if((FLAGS >> flag & 1) == 0)
-            IP += (s16)imm.val;
+// all the size bytes, or throws
+void write_output(FILE *file, const char *path, const void *data, const size_t &size) {
+    if (fwrite(data, 1, size, file) != size) {
+        fclose(file);
+        throw std::runtime_error{std::format("Cannot write {}", path)};
     }
 }
 
 
-void apply_jump(const std::string &instr, const Op &dest) {
-    cond_jump(instr, dest.imm, "je", "jne", Flags::Zero);
-    cond_jump(instr, dest.imm, "jp", "jnp", Flags::Parity);
-    cond_jump(instr, dest.imm, "js", "jns", Flags::Sign);
-    // others not defined, programs containing them may loop
+void write_framebuffer(const Cpu &cpu, const char *path) {
+    std::vector<u8> image(FRAMEBUFFER_WIDTH * FRAMEBUFFER_HEIGHT * 3);
+    for (u32 p = 0; p < FRAMEBUFFER_WIDTH * FRAMEBUFFER_HEIGHT; ++p)
+        for (u8 c = 0; c < 3; ++c)
+            image[p * 3 + c] = cpu.palette[cpu.memory[FRAMEBUFFER + p]][c] * 255 / 63;
+    auto file = open_output(path);
+    const std::string header {std::format("P6\n{} {}\n255\n", FRAMEBUFFER_WIDTH, FRAMEBUFFER_HEIGHT)};
+    write_output(file, path, header.data(), header.size());
+    write_output(file, path, image.data(), image.size());
+    fclose(file);
 }
 
 
 std::string flags_to_string(const u16 &flags) {
     std::string ret;
-    for(int flag = Flags::Sign; flag <= Flags::Parity; ++flag)
+    for (int flag = 0; flag < 16; ++flag)
         if (((flags >> flag) & 1) == 1)
             ret += FLAG_NAMES[flag];
     return ret;
@@ -373,595 +124,1139 @@ std::string flag_change(const u16 &prev, const u16 &next) {
 }
 
 
-std::string ip_change(const u16 &prev_IP) {
+std::string ip_change(const u16 &prev_IP, const u16 &next_IP) {
     char prev[7];
     char next[7];
     sprintf(prev, "%x", prev_IP);
-    sprintf(next, "%x", IP);
+    sprintf(next, "%x", next_IP);
     return std::format("ip:0x{}->0x{}", prev, next);
 }
 
 
-std::string sim_instr(const Instr &instr, const u16 &prev_IP) {
-    const OpType& dest_t = instr.reversed ? instr.op1_t : instr.op0_t;
-    const OpType& src_t  = instr.reversed ? instr.op0_t : instr.op1_t;
-    const Op& dest = instr.reversed ? instr.op1 : instr.op0;
-    const Op& src  = instr.reversed ? instr.op0 : instr.op1;
-    std::string dis = to_string(instr);
-    std::string reg = REG_ENCODING[dest.reg.w][dest.reg.val].value;
-    u16 flags = FLAGS;
-    std::string reg_change;
-    if (dest_t == Reg) {
-        std::string init = print_reg_val(dest.reg);
-        apply_instr(instr.instr, dest_t, src_t, dest, src);
-        std::string final = print_reg_val(dest.reg);
-        reg_change = init != final ? std::format(" {}:0x{}->0x{}", reg, init, final) : "";
-    } else if (dest_t == Imm) {
-        apply_jump(instr.instr, dest);
-    } else if (dest_t == Mem) {
-        apply_instr(instr.instr, dest_t, src_t, dest, src);
-    }
-    return std::format("{} ; {}{}{}", dis, ip_change(prev_IP), reg_change, flag_change(flags, FLAGS));
-}
-
-
-u16 ea(const struct Mem &mem) {
-    if (mem.has_disp && !mem.has_reg)
-        return 6;
-    if (mem.has_reg && (!mem.has_disp || mem.disp == 0)) {
-        if (mem.reg > 3)
-            return 5;
-        if (mem.reg == 0 || mem.reg == 3)
-            return 7;
-        return 8;
-    }
-    if (mem.reg > 3)
-        return 9;
-    if (mem.reg == 0 || mem.reg == 3)
-        return 11;
-    return 12;
-}
-
-
-u16 estimate_clocks_mov(const OpType &dest_t, const OpType &src_t, const Op &dest, const Op &src) {
-    // ignoring segment registers here
-    if (dest_t == Mem) {
-        if (src_t == Reg) {
-            if (src.reg.val == 0 || (src.reg.val == 4 && src.reg.w == 0))
-                return 10;                  // mem <- acc
-            return 9 + ea(dest.mem);        // mem <- reg
-        }
-        return 10 + ea(dest.mem);           // mem <- imm
+// clocks with the prefetch queue, and what of them was waiting; the queue
+// starts over after an instruction without clocks
+std::string queue_clocks(Prefetch &queue, const Instr &instr, const bool &taken, const u16 &reps, const u16 &next_ip) {
+    BusTiming t;
+    try {
+        t = queue.step(instr, taken, reps, next_ip);
+    } catch (const std::runtime_error &) {
+        ++UNTIMED;
+        queue.restart(next_ip);
+        return std::format("Clocks: untimed = {}", CLOCKS);
     }
-    if (src_t == Mem && (dest.reg.val == 0 || (src.reg.val == 4 && src.reg.w == 0)))
-        return 10;                          // acc <- mem
-    if (src_t == Reg)
-        return 2;                           // reg <- reg
-    if (src_t == Imm)
-        return 4;                           // reg <- imm
-    return 8 + ea(src.mem);                 // reg <- mem
+    CLOCKS += t.clocks;
+    QUEUE_STALLS += t.queue_stall;
+    BUS_STALLS += t.bus_stall;
+    return std::format("Clocks: +{} = {} | queue +{} bus +{}", t.clocks, CLOCKS, t.queue_stall, t.bus_stall);
 }
 
 
-u16 estimate_clocks_add(const OpType &dest_t, const OpType &src_t, const Op &dest, const Op &src) {
-    if (dest_t == Mem) {
-        if (src_t == Imm)
-            return 17 + ea(dest.mem);       // mem += imm
-        return 16 + ea(dest.mem);           // mem += reg
-    }
-    if (src_t == Mem)
-        return 9 + ea(src.mem);             // reg += mem
-    if (src_t == Reg)
-        return 3;                           // reg += reg
-    return 4;                               // reg += imm
+// steps the cpu, every changed register is listed, a byte destination under
+// its own name; clocks first with the prefetch queue, if any
+std::string sim_instr(Cpu &cpu, Prefetch *queue) {
+    const u16 prev_IP {cpu.ip}, flags {cpu.flags};
+    u16 regs[12];
+    memcpy(regs, cpu.regs, sizeof(regs));
+    const Instr instr {cpu.step()};
+    const std::string clocks {queue == nullptr ? "" : queue_clocks(
+        *queue, instr, cpu.ip != (u16)(prev_IP + instr.size), clock_reps(instr, regs[1], cpu.regs[1]), cpu.ip
+    ) + " | "};
+    const Op& dest = instr.reversed ? instr.op1 : instr.op0;
+    const bool byte_dest = (instr.reversed ? instr.op1_t : instr.op0_t) == Reg && dest.reg.w == 0;
+    std::string reg_changes;
+    for (u8 r = 0; r < 12; ++r)
+        if (cpu.regs[r] != regs[r]) {
+            const char *name = byte_dest && (dest.reg.val & 0b11) == r ? REG_ENCODING[0][dest.reg.val].value : REG_ENCODING[1][r].value;
+            reg_changes += std::format(" {}:0x{:x}->0x{:x}", name, regs[r], cpu.regs[r]);
+        }
+    return std::format("{} ; {}{}{}{}", to_string(instr), clocks, ip_change(prev_IP, cpu.ip), reg_changes, flag_change(flags, cpu.flags));
 }
 
+
+// without simulation, conditional jumps are counted as not taken and repeated
+// string instructions as going once
 std::string estimate_clocks(const Instr &instr) {
-    const OpType& dest_t = instr.reversed ? instr.op1_t : instr.op0_t;
-    const OpType& src_t  = instr.reversed ? instr.op0_t : instr.op1_t;
-    const Op& dest = instr.reversed ? instr.op1 : instr.op0;
-    const Op& src  = instr.reversed ? instr.op0 : instr.op1;
-    std::string dis = to_string(instr);
-    u16 clocks;
-    if (instr.instr == "mov")
-        clocks = estimate_clocks_mov(dest_t, src_t, dest, src);
-    else if (instr.instr == "add")
-        clocks = estimate_clocks_add(dest_t, src_t, dest, src);
-    else
-        throw std::runtime_error{"Clocks not implemented for this instruction"};
+    u32 clocks;
+    try {
+        clocks = instr_clocks(instr, false, 1);
+    } catch (const std::runtime_error &) {
+        ++UNTIMED;
+        return std::format("{} ; Clocks: untimed = {}", to_string(instr), CLOCKS);
+    }
     CLOCKS += clocks;
-    return std::format("{} ; Clocks: +{} = {}", dis, clocks, CLOCKS);
+    return std::format("{} ; Clocks: +{} = {}", to_string(instr), clocks, CLOCKS);
 }
 
 
-void unimplemented(const u8 *& /* unused */, Instr & /* unused */) {
-    throw std::runtime_error("unimplemented");
+// Delta dumps (-D): snapshots appended to dump.delta, each with only the
+// pages written since the previous one (the first one has the program), so
+// that applying them in order over zeroed memory gives the memory at each
+// snapshot. Little endian:
+//   "D86\0", u64 instructions executed, u16 ip, u16 flags, u16 regs[12], u32 page count
+//   then for each page: u32 page number, its 256 bytes
+void write_snapshot(Cpu &cpu, FILE *file) {
+    u32 nb_pages {0};
+    for (u32 p = 0; p < NB_PAGES; ++p)
+        nb_pages += cpu.dirty[p];
+    fwrite("D86", 1, 4, file);
+    fwrite(&cpu.executed, sizeof(cpu.executed), 1, file);
+    fwrite(&cpu.ip, sizeof(cpu.ip), 1, file);
+    fwrite(&cpu.flags, sizeof(cpu.flags), 1, file);
+    fwrite(cpu.regs, sizeof(cpu.regs[0]), 12, file);
+    fwrite(&nb_pages, sizeof(nb_pages), 1, file);
+    for (u32 p = 0; p < NB_PAGES; ++p)
+        if (cpu.dirty[p]) {
+            fwrite(&p, sizeof(p), 1, file);
+            fwrite(&cpu.memory[p << PAGE_BITS], 1, PAGE_SIZE, file);
+            cpu.dirty[p] = 0;
+        }
 }
 
 
-// load flag
-void lf(const u8 *const &b, u8 &outflag, const u8 offset, const u8 nbbits) {
-    outflag = *b >> offset & ((1 << nbbits) - 1);
+// deltas, if any, get a snapshot every delta_every simulated instructions (0
+// for none). With a prefetch queue, clocks are estimated with it, simulating or not.
+void disassembly(Cpu &cpu, const char *file_path, const bool &simulation, const bool &clocks, FILE *deltas, const u64 &delta_every, Prefetch *queue) {
+    size_t size;
+    const std::vector<u8> program {read_instructions(file_path, size)};
+    cpu.load_program(program.data(), size);
+
+    std::cout << "; " << file_path << std::endl;
+    ProfileScope profile {simulation ? "simulate" : clocks ? "clocks" : "disassemble"};
+    Instr instr;
+    const u8 *b;
+    u16 prev_IP;
+    while (cpu.running()) {
+        if (simulation) {
+            const std::string line {sim_instr(cpu, queue)};
+            fwrite(cpu.console.data(), 1, cpu.console.size(), stderr);  // stdout has the trace
+            cpu.console.clear();
+            std::cout << line << std::endl;
+            if (deltas != nullptr && delta_every != 0 && cpu.executed % delta_every == 0)
+                write_snapshot(cpu, deltas);
+            continue;
+        }
+        b = &cpu.memory[phys_addr(cpu.regs[8 + Cs], cpu.ip)];
+        decode(b, instr);
+        prev_IP = cpu.ip;
+        cpu.ip += instr.size;
+        if (cpu.ip < prev_IP)
+            cpu.regs[8 + Cs] += 0x1000;  // linear sweep past 64 KB, move on to the next segment
+        if (queue != nullptr)
+            std::cout << to_string(instr) << " ; " << queue_clocks(*queue, instr, false, 1, cpu.ip) << std::endl;
+        else if (clocks)
+            std::cout << estimate_clocks(instr) << std::endl;
+        else
+            std::cout << to_string(instr) << std::endl;
+        if (cpu.ip < prev_IP && cpu.regs[8 + Cs] == 0)
+            break;  // past the end of memory, the program fills all of it
+    }
+    if (queue != nullptr)
+        std::cout << std::format(
+            "; {} clocks, {} waiting for the queue, {} for the bus{}", CLOCKS, QUEUE_STALLS, BUS_STALLS,
+            UNTIMED > 0 ? std::format(", {} instructions untimed", UNTIMED) : ""
+        ) << std::endl;
+    if(simulation) {
+        std::cout << std::endl;
+        print_all_regs(cpu);
+        std::cout << "\tflags: " << flags_to_string(cpu.flags) << std::endl;
+    }
 }
 
 
-void instr_rm_op(OpType &op_t, Op &op, const u8 &w, const u8 &mod, const u8 &rm) {
-    op_t = mod == 0b11 ? Reg : Mem;
-    if (mod == 0b11) {
-        op.reg = {rm, w};
-    } else {
-        op.mem.has_reg = (mod != 0b00 || rm != 0b110);
-        if (op.mem.has_reg)
-            op.mem.reg = rm;
+// same output as disassembly, formatted into one buffer written in large chunks
+// for large inputs; throughput is reported on stderr
+void bulk_disassembly(const char *file_path) {
+    size_t size;
+    const std::vector<u8> program {read_instructions(file_path, size)};
+    const u8 *bytes {program.data()};
+
+    constexpr size_t flush_size {1 << 20};
+    std::string buffer(flush_size + MAX_INSTR_TEXT, '\0');
+    char *out = buffer.data();
+    auto flush = [&]() {
+        fwrite(buffer.data(), 1, out - buffer.data(), stdout);
+        out = buffer.data();
+    };
+    std::cout << "; " << file_path << std::endl;
+
+    ProfileScope profile {"bulk disassembly"};
+    auto start = std::chrono::steady_clock::now();
+    Instr instr;
+    size_t nb_instrs {0};
+    const u8 *b = bytes;
+    while (b < bytes + size) {
+        decode(b, instr);
+        out = emit(out, instr);
+        *out++ = '\n';
+        ++nb_instrs;
+        if ((size_t)(out - buffer.data()) >= flush_size)
+            flush();
+    }
+    flush();
+    fflush(stdout);
+    std::chrono::duration<f64> elapsed = std::chrono::steady_clock::now() - start;
+    std::cerr << std::format(
+        "bulk: {} bytes, {} instructions, {:.3f} ms, {:.1f} MB/s, {:.1f} Minstr/s",
+        size, nb_instrs, elapsed.count() * 1e3, size / elapsed.count() / 1e6, nb_instrs / elapsed.count() / 1e6
+    ) << std::endl;
+}
+
+
+// A part of the input decoded on its own thread. It may start in the middle of
+// an instruction, the stitching keeps its instructions only from a boundary of
+// the sequential sweep.
+struct SweepRange {
+    size_t begin;
+    size_t end;
+    std::vector<u32> starts;     // offsets of the decoded instructions
+    std::vector<u32> text_ends;  // end of each instruction line in text
+    std::string text;
+    size_t next {0};             // offset after the last decoded instruction
+    const u8 *bytes;             // the whole input
+};
+
+
+void sweep_range(SweepRange &range) {
+    range.text.resize(std::max<size_t>(8 * (range.end - range.begin), 2 * MAX_INSTR_TEXT));
+    size_t used {0};
+    Instr instr;
+    const u8 *b = range.bytes + range.begin;
+    while (b < range.bytes + range.end) {
+        const u8 *start = b;
+        try {
+            decode(b, instr);
+        } catch (const std::runtime_error &) {
+            // the sequential sweep never goes through here or it would fail the same way,
+            // so neither does anything decoded so far in this range
+            range.starts.clear();
+            range.text_ends.clear();
+            used = 0;
+            b = start + 1;
+            continue;
+        }
+        if (range.text.size() - used <= MAX_INSTR_TEXT)
+            range.text.resize(2 * range.text.size());
+        char *out = emit(range.text.data() + used, instr);
+        *out++ = '\n';
+        used = out - range.text.data();
+        range.starts.push_back(start - range.bytes);
+        range.text_ends.push_back(used);
     }
+    range.text.resize(used);
+    range.next = b - range.bytes;
+}
+
+
+// same output as disassembly, with the input split into ranges decoded in parallel,
+// then stitched where the instruction boundaries of the ranges meet the sequential
+// ones, re-decoding the seams until they do
+void parallel_disassembly(const char *file_path, const size_t &nb_threads) {
+    size_t size;
+    const std::vector<u8> program {read_instructions(file_path, size)};
+    const u8 *bytes {program.data()};
+
+    ProfileScope profile {"parallel disassembly"};
+    auto start = std::chrono::steady_clock::now();
+    constexpr size_t min_range {1 << 16};
+    size_t nb_ranges = std::max<size_t>(1, std::min(nb_threads, size / min_range));
+    std::vector<SweepRange> ranges(nb_ranges);
+    std::vector<std::thread> threads;
+    for (size_t r = 0; r < nb_ranges; ++r) {
+        ranges[r].begin = size * r / nb_ranges;
+        ranges[r].end = size * (r + 1) / nb_ranges;
+        ranges[r].bytes = bytes;
+        threads.emplace_back(sweep_range, std::ref(ranges[r]));
+    }
+    for (auto &thread : threads)
+        thread.join();
+
+    std::cout << "; " << file_path << std::endl;
+    char seam[MAX_INSTR_TEXT + 1];
+    size_t pos {0};  // next instruction of the sequential sweep
+    size_t nb_instrs {0};
+    size_t nb_seam_instrs {0};
+    for (const auto &range : ranges) {
+        auto found = std::lower_bound(range.starts.begin(), range.starts.end(), pos);
+        while (pos < range.end && (found == range.starts.end() || *found != pos)) {
+            const u8 *b = bytes + pos;
+            Instr instr;
+            decode(b, instr);
+            char *out = emit(seam, instr);
+            *out++ = '\n';
+            fwrite(seam, 1, out - seam, stdout);
+            pos = b - bytes;
+            ++nb_seam_instrs;
+            found = std::lower_bound(found, range.starts.end(), pos);
+        }
+        if (pos >= range.end)
+            continue;
+        size_t first = found - range.starts.begin();
+        size_t text_begin = first == 0 ? 0 : range.text_ends[first - 1];
+        fwrite(range.text.data() + text_begin, 1, range.text.size() - text_begin, stdout);
+        nb_instrs += range.starts.size() - first;
+        pos = range.next;
+    }
+    fflush(stdout);
+    std::chrono::duration<f64> elapsed = std::chrono::steady_clock::now() - start;
+    std::cerr << std::format(
+        "parallel: {} ranges, {} bytes, {} instructions ({} re-decoded at seams), {:.3f} ms, {:.1f} MB/s, {:.1f} Minstr/s",
+        nb_ranges, size, nb_instrs + nb_seam_instrs, nb_seam_instrs,
+        elapsed.count() * 1e3, size / elapsed.count() / 1e6, (nb_instrs + nb_seam_instrs) / elapsed.count() / 1e6
+    ) << std::endl;
+}
+
+
+// ---------------------------------------------------------------------------
+// Static analysis (-a): the control flow graph of a program from its
+// disassembly, timed without running it
+
+
+// Instructions only entered at begin and only left after the last one
+struct Block {
+    u32 begin, end;               // offsets in the program
+    u32 first, last;              // instructions
+    u32 clocks {0};               // through its last instruction not taken
+    u32 taken_clocks {0};         // its last instruction taken
+    u32 queue_clocks {0};         // the same with the prefetch queue, the block entered by a jump
+    u32 queue_taken_clocks {0};
+    u32 nb_unknown {0};           // instructions without clocks, counted as none
+    s32 taken {-1};               // the block the last instruction jumps to
+    s32 next {-1};                // the block after, when it falls through
+    bool exit {false};            // returns, halts, jumps where the disassembly does not tell, or ends the program
+    bool falls_off {false};       // ends the program when not taken
+};
+
+// Blocks repeated by jumps back to a header dominating them, inner loops
+// counted once per iteration
+struct NaturalLoop {
+    u32 header;
+    std::vector<u32> blocks;      // header first, then in order
+    u32 min_clocks {0}, max_clocks {0};              // per iteration
+    u32 min_queue_clocks {0}, max_queue_clocks {0};
+    std::vector<u32> critical;    // blocks of the longest iteration
+    bool lower_bound {false};     // some of its blocks have instructions without clocks
+};
+
+struct Cfg {
+    std::vector<Block> blocks;
+    std::vector<u32> roots;       // the entry, then the blocks calls go to
+    std::vector<NaturalLoop> loops;
+    std::vector<u32> entry_path;  // the longest from the entry to an exit, loops once
+    u32 entry_clocks {0}, entry_queue_clocks {0};
+    bool entry_lower_bound {false};  // some block reached from the entry has instructions without clocks
+};
+
+
+static bool conditional(const Mnemonic &m) {
+    return (m >= Jo && m <= Jnle) || (m >= Loopnz && m <= Jcxz);
 }
-void instr_rm_op0(Instr &i, const u8 &w, const u8 &mod, const u8 &rm) { instr_rm_op(i.op0_t, i.op0, w, mod, rm); }
-void instr_rm_op1(Instr &i, const u8 &w, const u8 &mod, const u8 &rm) { instr_rm_op(i.op1_t, i.op1, w, mod, rm); }
 
 
-void instr_reg_op(OpType &op_t, Op &op, const u8 &w, const u8 &reg) {
-    op_t = Reg;
-    op.reg = {reg, w};
+// where a jump or call relative to ip goes, in the 64 KB of the program it is in
+static std::optional<u32> rel_target(const u32 &offset, const Instr &instr) {
+    if (!conditional(instr.instr) && !((instr.instr == Jmp || instr.instr == Call) && instr.op0_t == Rel))
+        return std::nullopt;
+    return (offset & ~0xFFFFu) + (u16)(offset + instr.size + instr.op0.imm.val);
 }
-void instr_reg_op0(Instr &i, const u8 &w, const u8 &reg) { instr_reg_op(i.op0_t, i.op0, w, reg); }
-void instr_reg_op1(Instr &i, const u8 &w, const u8 &reg) { instr_reg_op(i.op1_t, i.op1, w, reg); }
 
 
-u16 read_data(const u8 *&b, const u8 size) {
-    assert(size > 0);
+static bool ends_block(const Mnemonic &m) {
+    return conditional(m) || m == Jmp || m == JmpFar || m == Ret || m == Retf || m == Iret || m == Hlt;
+}
 
-    if (size == 1)
-        return (s16)*(s8*)b++;
 
-    u16 ret = (u16)*b++;
-    if (size == 2)
-        ret |= ((u16)*b++) << 8;
+static std::vector<u32> successors(const Block &b) {
+    std::vector<u32> ret;
+    if (b.taken >= 0)
+        ret.push_back(b.taken);
+    if (b.next >= 0 && b.next != b.taken)
+        ret.push_back(b.next);
     return ret;
 }
 
 
-void disp_op(const u8 *&b, Op &op, const u8 &mod, const u8 &rm) {
-    u8 size = mod == 0 && rm == 0b110 ? 2 : mod % 0b11;
-    op.mem.has_disp = (size > 0);
-    if (size > 0)
-        op.mem.disp = read_data(b, size);
+// to the block to, or out of the program (-1)
+static u32 edge_clocks(const Block &b, const s32 &to, const bool &queue) {
+    if (to == b.taken || (to < 0 && !b.falls_off))
+        return queue ? b.queue_taken_clocks : b.taken_clocks;
+    return queue ? b.queue_clocks : b.clocks;
 }
-void disp_op0(const u8 *&b, Instr &i, const u8 &mod, const u8 &rm) { disp_op(b, i.op0, mod, rm); }
-void disp_op1(const u8 *&b, Instr &i, const u8 &mod, const u8 &rm) { disp_op(b, i.op1, mod, rm); }
 
 
-void instr_imm_op(const u8 *&b, OpType &op_t, Op &op, const u8 &w, const u8 s = 0) {
-    op_t = Imm;
-    op.imm = {read_data(b, s == 1 ? 1 : w + 1), w};
+// Blocks reachable from the roots through the ones inside (all when empty),
+// in reverse postorder. seen is all false for every block, and left so: the
+// blocks of a loop take time for themselves only.
+static std::vector<u32> reverse_postorder(const Cfg &cfg, const std::vector<u32> &roots, const std::vector<bool> &inside,
+                                          std::vector<bool> &seen) {
+    std::vector<u32> order;
+    std::vector<std::pair<u32, std::vector<u32>>> stack;
+    for (const u32 &root : roots) {
+        if (seen[root])
+            continue;
+        seen[root] = true;
+        stack.push_back({root, successors(cfg.blocks[root])});
+        while (!stack.empty()) {
+            auto &[v, next] = stack.back();
+            if (next.empty()) {
+                order.push_back(v);
+                stack.pop_back();
+                continue;
+            }
+            const u32 s {next.back()};
+            next.pop_back();
+            if (!seen[s] && (inside.empty() || inside[s])) {
+                seen[s] = true;
+                stack.push_back({s, successors(cfg.blocks[s])});
+            }
+        }
+    }
+    for (const u32 &v : order)
+        seen[v] = false;
+    std::reverse(order.begin(), order.end());
+    return order;
 }
-void instr_imm_op0(const u8 *&b, Instr &i, const u8 &w, const u8 s = 0) { instr_imm_op(b, i.op0_t, i.op0, w, s); }
-void instr_imm_op1(const u8 *&b, Instr &i, const u8 &w, const u8 s = 0) { instr_imm_op(b, i.op1_t, i.op1, w, s); }
 
 
-void move_regmem_to_from_reg(const u8 *&b, Instr &i) {
-    u8 d, w, mod, reg, rm;
-    lf(b, d, 1, 1); lf(b, w, 0, 1); ++b;
-    lf(b, mod, 6, 2); lf(b, reg, 3, 3); lf(b, rm, 0, 3); ++b;
-    instr_rm_op0(i, w, mod, rm);
-    disp_op0(b, i, mod, rm);
-    instr_reg_op1(i, w, reg);
-    i.reversed = d == 1;
-    i.instr = "mov";
+// Longest or shortest clocks from order[0] to the end of each block in order,
+// edges going back in it left out; -1 where not reached. dist and pred are
+// only set for the blocks in order, pos is -1 for every block and left so.
+static void paths(const Cfg &cfg, const std::vector<u32> &order, const bool &queue, const bool &longest,
+                  std::vector<s32> &pos, std::vector<s64> &dist, std::vector<s32> &pred) {
+    for (u32 i = 0; i < order.size(); ++i)
+        pos[order[i]] = i, dist[order[i]] = -1, pred[order[i]] = -1;
+    dist[order[0]] = 0;
+    for (const u32 &u : order) {
+        if (dist[u] < 0)
+            continue;
+        for (const u32 &s : successors(cfg.blocks[u])) {
+            if (pos[s] <= pos[u])
+                continue;
+            const s64 d = dist[u] + edge_clocks(cfg.blocks[u], s, queue);
+            if (dist[s] < 0 || (longest ? d > dist[s] : d < dist[s]))
+                dist[s] = d, pred[s] = u;
+        }
+    }
+    for (const u32 &u : order)
+        pos[u] = -1;
 }
 
 
-void imm_to_regmem(const u8 *&b, Instr &i, const u8 s = 0) {
-    u8 w, mod, rm;
-    lf(b, w, 0, 1); ++b;
-    lf(b, mod, 6, 2); lf(b, rm, 0, 3); ++b;
-    instr_rm_op0(i, w, mod, rm);
-    disp_op0(b, i, mod, rm);
-    instr_imm_op1(b, i, w, s);
-    i.reversed = false;
+Cfg control_flow(const u8 *bytes, const size_t &size, const bool &i8088) {
+    std::vector<Instr> instrs;
+    std::vector<u32> offsets;
+    const u8 *b = bytes;
+    while (b < bytes + size) {
+        offsets.push_back(b - bytes);
+        instrs.emplace_back();
+        decode(b, instrs.back());
+    }
+    const u32 nb_instrs = instrs.size();
+    std::vector<s32> instr_at(size, -1);
+    for (u32 i = 0; i < nb_instrs; ++i)
+        instr_at[offsets[i]] = i;
+
+    // blocks start at the entry, at jump targets and after jumps
+    std::vector<bool> leader(nb_instrs + 1);
+    std::vector<u32> called;
+    leader[0] = true;
+    for (u32 i = 0; i < nb_instrs; ++i) {
+        const auto target = rel_target(offsets[i], instrs[i]);
+        if (target && *target < size && instr_at[*target] >= 0) {
+            leader[instr_at[*target]] = true;
+            if (instrs[i].instr == Call)
+                called.push_back(instr_at[*target]);
+        }
+        if (ends_block(instrs[i].instr))
+            leader[i + 1] = true;
+    }
+
+    Cfg cfg;
+    std::vector<s32> block_of(nb_instrs);
+    for (u32 i = 0; i < nb_instrs; ++i) {
+        if (leader[i])
+            cfg.blocks.push_back({offsets[i], 0, i, i});
+        cfg.blocks.back().last = i;
+        cfg.blocks.back().end = i + 1 < nb_instrs ? offsets[i + 1] : size;
+        block_of[i] = cfg.blocks.size() - 1;
+    }
+    cfg.roots.push_back(0);
+    for (const u32 &i : called)
+        if (std::find(cfg.roots.begin(), cfg.roots.end(), block_of[i]) == cfg.roots.end())
+            cfg.roots.push_back(block_of[i]);
+
+    for (auto &block : cfg.blocks) {
+        const Instr &last {instrs[block.last]};
+        const auto target = rel_target(offsets[block.last], last);
+        if (target && last.instr != Call && *target < size && instr_at[*target] >= 0)
+            block.taken = block_of[instr_at[*target]];
+        const bool falls = last.instr != Jmp && last.instr != JmpFar && last.instr != Ret && last.instr != Retf
+            && last.instr != Iret && last.instr != Hlt;
+        if (falls && block.last + 1 < nb_instrs)
+            block.next = block_of[block.last + 1];
+        block.falls_off = falls && block.last + 1 == nb_instrs;
+        block.exit = block.falls_off || (block.taken < 0 && !falls);
+
+        // through the block with its last instruction not taken and taken, the
+        // queue as after a jump to it
+        Prefetch queue {i8088};
+        queue.jumped(block.begin);
+        for (u32 i = block.first; i <= block.last; ++i) {
+            try {
+                block.clocks += instr_clocks(instrs[i], false, 1);
+                if (i == block.last)
+                    block.taken_clocks = block.clocks - instr_clocks(instrs[i], false, 1) + instr_clocks(instrs[i], true, 1);
+            } catch (const std::runtime_error &) {
+                ++block.nb_unknown;  // not timed yet
+                block.taken_clocks = block.clocks;
+            }
+            const u16 next_ip {(u16)(offsets[i] + instrs[i].size)};
+            const bool jumps {i == block.last && last.instr == Jmp && target.has_value()};
+            Prefetch taken_queue {queue};
+            try {
+                queue.step(instrs[i], jumps, 1, jumps ? (u16)*target : next_ip);
+            } catch (const std::runtime_error &) {
+            }
+            block.queue_clocks = block.queue_taken_clocks = queue.now;
+            if (i == block.last && conditional(last.instr)) {
+                try {
+                    taken_queue.step(instrs[i], true, 1, target.value_or(next_ip));
+                } catch (const std::runtime_error &) {
+                }
+                block.queue_taken_clocks = taken_queue.now;
+            }
+        }
+    }
+
+    // dominators (Cooper, Harvey and Kennedy), from a root before all the roots
+    const u32 nb_blocks = cfg.blocks.size();
+    std::vector<bool> seen(nb_blocks), inside(nb_blocks);
+    std::vector<s32> pos(nb_blocks, -1), idom(nb_blocks, -1), pred(nb_blocks);
+    std::vector<s64> dist(nb_blocks);
+    const std::vector<u32> order {reverse_postorder(cfg, cfg.roots, {}, seen)};
+    for (u32 i = 0; i < order.size(); ++i)
+        pos[order[i]] = i;
+    std::vector<std::vector<u32>> preds(nb_blocks);
+    for (const u32 &u : order)
+        for (const u32 &s : successors(cfg.blocks[u]))
+            preds[s].push_back(u);
+    constexpr s32 ROOT {-2};
+    for (const u32 &root : cfg.roots)
+        idom[root] = ROOT;
+    auto intersect = [&](s32 a, s32 b) {
+        while (a != b) {
+            if (a == ROOT || b == ROOT)
+                return ROOT;
+            while (a != ROOT && b != ROOT && pos[a] > pos[b])
+                a = idom[a];
+            while (a != ROOT && b != ROOT && pos[b] > pos[a])
+                b = idom[b];
+        }
+        return a;
+    };
+    for (bool changed = true; changed;) {
+        changed = false;
+        for (const u32 &v : order) {
+            if (idom[v] == ROOT && std::find(cfg.roots.begin(), cfg.roots.end(), v) != cfg.roots.end())
+                continue;
+            s32 dom {-1};
+            for (const u32 &p : preds[v])
+                if (idom[p] != -1)
+                    dom = dom == -1 ? (s32)p : intersect(p, dom);
+            if (dom != idom[v])
+                idom[v] = dom, changed = true;
+        }
+    }
+    for (const u32 &v : order)
+        pos[v] = -1;
+    // h dominates v when v is under h in the dominator tree, numbered depth first
+    std::vector<std::vector<u32>> children(nb_blocks);
+    std::vector<u32> tops, enter(nb_blocks), leave(nb_blocks);
+    for (const u32 &v : order)
+        (idom[v] < 0 ? tops : children[idom[v]]).push_back(v);
+    u32 number {0};
+    for (const u32 &top : tops) {
+        std::vector<std::pair<u32, u32>> stack {{top, 0}};
+        enter[top] = number++;
+        while (!stack.empty()) {
+            auto &[v, child] = stack.back();
+            if (child == children[v].size()) {
+                leave[v] = number++;
+                stack.pop_back();
+                continue;
+            }
+            const u32 c {children[v][child++]};
+            enter[c] = number++;
+            stack.push_back({c, 0});
+        }
+    }
+    auto dominates = [&](const u32 &h, const u32 &v) {
+        return enter[h] <= enter[v] && leave[v] <= leave[h];
+    };
+
+    // natural loops, one per header
+    std::vector<std::vector<u32>> latches(nb_blocks);
+    for (const u32 &u : order)
+        for (const u32 &s : successors(cfg.blocks[u]))
+            if (dominates(s, u))
+                latches[s].push_back(u);
+    for (u32 h = 0; h < nb_blocks; ++h) {
+        if (latches[h].empty())
+            continue;
+        inside[h] = true;
+        std::vector<u32> work {latches[h]};
+        while (!work.empty()) {
+            const u32 v {work.back()};
+            work.pop_back();
+            if (inside[v])
+                continue;
+            inside[v] = true;
+            for (const u32 &p : preds[v])
+                work.push_back(p);
+        }
+        NaturalLoop loop {h};
+        loop.blocks = reverse_postorder(cfg, {h}, inside, seen);
+        for (const u32 &v : loop.blocks)
+            loop.lower_bound |= cfg.blocks[v].nb_unknown > 0;
+        for (const bool queue : {false, true})
+            for (const bool longest : {false, true}) {
+                paths(cfg, loop.blocks, queue, longest, pos, dist, pred);
+                s64 best {-1};
+                s32 best_latch {-1};
+                for (const u32 &l : latches[h]) {
+                    if (dist[l] < 0)
+                        continue;
+                    const s64 d = dist[l] + edge_clocks(cfg.blocks[l], h, queue);
+                    if (best < 0 || (longest ? d > best : d < best))
+                        best = d, best_latch = l;
+                }
+                (queue ? (longest ? loop.max_queue_clocks : loop.min_queue_clocks)
+                       : (longest ? loop.max_clocks : loop.min_clocks)) = best;
+                if (!queue && longest)
+                    for (s32 v = best_latch; v >= 0; v = pred[v])
+                        loop.critical.insert(loop.critical.begin(), v);
+            }
+        for (const u32 &v : loop.blocks)
+            inside[v] = false;  // every block of the loop is reached from its header
+        std::sort(loop.blocks.begin() + 1, loop.blocks.end());
+        cfg.loops.push_back(std::move(loop));
+    }
+
+    // the longest way through from the entry, to an exit
+    const std::vector<u32> from_entry {reverse_postorder(cfg, {0}, {}, seen)};
+    for (const u32 &u : from_entry)
+        cfg.entry_lower_bound |= cfg.blocks[u].nb_unknown > 0;
+    for (const bool queue : {false, true}) {
+        paths(cfg, from_entry, queue, true, pos, dist, pred);
+        s64 best {-1};
+        s32 exit {-1};
+        for (const u32 &u : from_entry)
+            if (dist[u] >= 0 && cfg.blocks[u].exit) {
+                const s64 d = dist[u] + edge_clocks(cfg.blocks[u], -1, queue);
+                if (d > best)
+                    best = d, exit = u;
+            }
+        (queue ? cfg.entry_queue_clocks : cfg.entry_clocks) = std::max<s64>(best, 0);
+        if (!queue)
+            for (s32 v = exit; v >= 0; v = pred[v])
+                cfg.entry_path.insert(cfg.entry_path.begin(), v);
+    }
+    return cfg;
 }
 
 
-void move_imm_to_regmem(const u8 *&b, Instr &i) {
-    imm_to_regmem(b, i);
-    i.instr = "mov";
+// offsets of the blocks, in hex for text or as json numbers
+static std::string block_list(const Cfg &cfg, const std::vector<u32> &blocks, const bool &json) {
+    std::string ret;
+    for (const u32 &b : blocks)
+        ret += json ? std::format("{}{}", ret.empty() ? "" : ", ", cfg.blocks[b].begin)
+                    : std::format("{}{:#x}", ret.empty() ? "" : " ", cfg.blocks[b].begin);
+    return ret;
 }
 
 
-void imm_to_reg(const u8 *&b, Instr &i) {
-    u8 w, reg;
-    lf(b, w, 3, 1); lf(b, reg, 0, 3); ++b;
-    instr_reg_op0(i, w, reg);
-    instr_imm_op1(b, i, w);
-    i.reversed = false;
-    i.instr = "mov";
+// Blocks, loops and the longest path from the entry, as text or json. Jumps
+// are timed taken or not by the edge they go through; calls and repeated
+// string instructions count once. Instructions without clocks count none,
+// which makes the clocks of what may go through them lower bounds.
+void analysis(const char *file_path, const bool &json, const bool &i8088) {
+    size_t size;
+    const std::vector<u8> program {read_instructions(file_path, size)};
+    ProfileScope profile {"analysis"};
+    const Cfg cfg {control_flow(program.data(), size, i8088)};
+
+    if (json) {
+        std::cout << std::format("{{\"file\": \"{}\", \"cpu\": \"{}\", \"blocks\": [", file_path, i8088 ? "8088" : "8086");
+        for (u32 i = 0; i < cfg.blocks.size(); ++i) {
+            const Block &b {cfg.blocks[i]};
+            std::cout << std::format(
+                "{}\n  {{\"begin\": {}, \"end\": {}, \"instructions\": {}, \"unknown\": {}, \"clocks\": {}, \"taken_clocks\": {}, "
+                "\"queue_clocks\": {}, \"queue_taken_clocks\": {}, \"lower_bound\": {}, \"taken\": {}, \"next\": {}, \"exit\": {}}}",
+                i == 0 ? "" : ",", b.begin, b.end, b.last - b.first + 1, b.nb_unknown, b.clocks, b.taken_clocks,
+                b.queue_clocks, b.queue_taken_clocks, b.nb_unknown > 0,
+                b.taken < 0 ? "null" : std::to_string(cfg.blocks[b.taken].begin),
+                b.next < 0 ? "null" : std::to_string(cfg.blocks[b.next].begin), b.exit
+            );
+        }
+        std::cout << "],\n\"loops\": [";
+        for (u32 i = 0; i < cfg.loops.size(); ++i) {
+            const NaturalLoop &l {cfg.loops[i]};
+            std::cout << std::format(
+                "{}\n  {{\"header\": {}, \"blocks\": [{}], \"min_clocks\": {}, \"max_clocks\": {}, "
+                "\"min_queue_clocks\": {}, \"max_queue_clocks\": {}, \"lower_bound\": {}, \"critical_path\": [{}]}}",
+                i == 0 ? "" : ",", cfg.blocks[l.header].begin, block_list(cfg, l.blocks, true), l.min_clocks, l.max_clocks,
+                l.min_queue_clocks, l.max_queue_clocks, l.lower_bound, block_list(cfg, l.critical, true)
+            );
+        }
+        std::cout << std::format(
+            "],\n\"entry_path\": {{\"blocks\": [{}], \"clocks\": {}, \"queue_clocks\": {}, \"lower_bound\": {}}}}}",
+            block_list(cfg, cfg.entry_path, true), cfg.entry_clocks, cfg.entry_queue_clocks, cfg.entry_lower_bound
+        ) << std::endl;
+        return;
+    }
+
+    u32 nb_unknown {0};
+    for (const auto &b : cfg.blocks)
+        nb_unknown += b.nb_unknown;
+    std::cout << std::format(
+        "; {}: {} blocks, {} loops, {} instructions without clocks, {} queue",
+        file_path, cfg.blocks.size(), cfg.loops.size(), nb_unknown, i8088 ? "8088" : "8086"
+    ) << std::endl;
+    auto at_least = [](const bool &lower_bound) { return lower_bound ? "at least " : ""; };
+    for (const auto &b : cfg.blocks) {
+        std::string clocks = b.taken_clocks == b.clocks && b.queue_taken_clocks == b.queue_clocks
+            ? std::format("{} clocks, {} with the queue", b.clocks, b.queue_clocks)
+            : std::format("{} clocks ({} taken), {} with the queue ({} taken)", b.clocks, b.taken_clocks, b.queue_clocks, b.queue_taken_clocks);
+        clocks = at_least(b.nb_unknown > 0) + clocks;
+        std::string next;
+        if (b.taken >= 0)
+            next += std::format(" -> {:#x} taken", cfg.blocks[b.taken].begin);
+        if (b.next >= 0)
+            next += std::format(" -> {:#x}", cfg.blocks[b.next].begin);
+        if (b.exit)
+            next += " -> exit";
+        std::cout << std::format(
+            "block {:#x}..{:#x}: {} instructions{}, {}{}",
+            b.begin, b.end, b.last - b.first + 1, b.nb_unknown > 0 ? std::format(" ({} without clocks)", b.nb_unknown) : "", clocks, next
+        ) << std::endl;
+    }
+    for (const auto &l : cfg.loops)
+        std::cout << std::format(
+            "loop at {:#x}: blocks {}, {}{}..{} clocks per iteration, {}..{} with the queue, longest through {}",
+            cfg.blocks[l.header].begin, block_list(cfg, l.blocks, false), at_least(l.lower_bound), l.min_clocks, l.max_clocks,
+            l.min_queue_clocks, l.max_queue_clocks, block_list(cfg, l.critical, false)
+        ) << std::endl;
+    if (cfg.entry_path.empty())
+        std::cout << "no way from the entry to an exit" << std::endl;
+    else
+        std::cout << std::format(
+            "longest from the entry: blocks {}, {}{} clocks, {} with the queue, loops once",
+            block_list(cfg, cfg.entry_path, false), at_least(cfg.entry_lower_bound), cfg.entry_clocks, cfg.entry_queue_clocks
+        ) << std::endl;
 }
 
 
-void mem_to_acc(const u8 *&b, Instr &i) {
-    u8 w; lf(b, w, 0, 1); ++b;
-    instr_reg_op0(i, w, 0);           // 0 is acc
-    instr_rm_op1(i, w, 0b00, 0b110);  // disp only
-    disp_op1(b, i, 0b00, 0b110);
-    i.reversed = false;
-    i.instr = "mov";
+struct RepetitionResults {
+    u64 count {0};
+    f64 min {std::numeric_limits<f64>::max()};
+    f64 total {0};
+};
+
+
+// repeats a test until its fastest run has not improved for a second
+template<typename Test>
+RepetitionResults repetition_test(Test &&test) {
+    RepetitionResults results;
+    auto last_min = std::chrono::steady_clock::now();
+    while (std::chrono::steady_clock::now() - last_min < std::chrono::seconds(1)) {
+        auto start = std::chrono::steady_clock::now();
+        test();
+        auto end = std::chrono::steady_clock::now();
+        f64 elapsed = std::chrono::duration<f64>(end - start).count();
+        ++results.count;
+        results.total += elapsed;
+        if (elapsed < results.min) {
+            results.min = elapsed;
+            last_min = end;
+        }
+    }
+    return results;
 }
 
 
-void acc_to_mem(const u8 *&b, Instr &i) {
-    mem_to_acc(b, i);
-    i.reversed = true;
+// Times decoding, simulation and simulation with clocks of a program, and
+// simulation from decoded instructions without and with superinstructions,
+// without output. One csv line per mode:
+// workload,mode,instructions,repetitions,min_ns_per_instr,avg_ns_per_instr,max_instr_per_s,avg_instr_per_s
+void benchmark(const char *file_path) {
+    size_t size;
+    const std::vector<u8> program {read_instructions(file_path, size)};
+    const u8 *bytes {program.data()};
+
+    constexpr size_t min_decoded {1 << 20};  // small programs are decoded several times per run
+    constexpr size_t max_executed {1 << 26};  // in case a program never ends
+    size_t nb_instrs {0};
+    u64 checksum {0};  // keeps the results alive
+
+    auto decode_only = [&]() {
+        nb_instrs = 0;
+        Instr instr;
+        while (nb_instrs < min_decoded) {
+            const u8 *b = bytes;
+            while (b < bytes + size) {
+                decode(b, instr);
+                checksum += instr.instr + instr.size;
+                ++nb_instrs;
+            }
+        }
+    };
+    Cpu cpu;
+    auto run = [&](const bool clocks) {
+        cpu.load_program(bytes, size);
+        CLOCKS = 0;
+        nb_instrs = 0;
+        while (cpu.running() && nb_instrs < max_executed) {
+            const u16 prev_IP {cpu.ip}, cx {cpu.regs[1]};
+            const Instr instr {cpu.step()};
+            if (clocks)
+                CLOCKS += instr_clocks(instr, cpu.ip != (u16)(prev_IP + instr.size), clock_reps(instr, cx, cpu.regs[1]));
+            ++nb_instrs;
+        }
+        checksum += cpu.regs[0] + cpu.flags + CLOCKS;
+    };
+    auto run_decoded = [&](const bool fuse) {
+        cpu.load_program(bytes, size);
+        nb_instrs = cpu.run_decoded(max_executed, fuse);
+        checksum += cpu.regs[0] + cpu.flags;
+    };
+
+    auto report = [&](const char *mode, const RepetitionResults &r) {
+        f64 avg = r.total / r.count;
+        std::cout << std::format(
+            "{},{},{},{},{:.3f},{:.3f},{:.0f},{:.0f}",
+            file_path, mode, nb_instrs, r.count, r.min / nb_instrs * 1e9, avg / nb_instrs * 1e9, nb_instrs / r.min, nb_instrs / avg
+        ) << std::endl;
+    };
+    {
+        ProfileScope profile {"benchmark decode"};
+        report("decode", repetition_test(decode_only));
+    }
+    {
+        ProfileScope profile {"benchmark simulate"};
+        report("simulate", repetition_test([&]() { run(false); }));
+    }
+    {
+        ProfileScope profile {"benchmark clocks"};
+        report("clocks", repetition_test([&]() { run(true); }));
+    }
+    {
+        ProfileScope profile {"benchmark decoded"};
+        report("decoded", repetition_test([&]() { run_decoded(false); }));
+    }
+    {
+        ProfileScope profile {"benchmark fused"};
+        report("fused", repetition_test([&]() { run_decoded(true); }));
+    }
+    std::cerr << "checksum " << checksum << std::endl;
 }
 
 
-void regmem_to_seg(const u8 *&b, Instr &i) {
-    u8 mod, sr, rm; ++b;
-    lf(b, mod, 6, 2); lf(b, sr, 3, 2); lf(b, rm, 0, 3); ++b;
-    instr_reg_op0(i, 1, 8 + sr);  // SR is wide, and kept here after other wide regs
-    instr_rm_op1(i, 1, mod, rm);
-    disp_op1(b, i, mod, rm);
-    i.reversed = false;
-    i.instr = "mov";
+// what differs between two Cpus in their registers, devices and memory up to
+// memory_end, empty when nothing does
+std::string state_difference(const Cpu &a, const Cpu &b, const u32 &memory_end) {
+    static constexpr const char *names[] {"ax", "cx", "dx", "bx", "sp", "bp", "si", "di", "es", "cs", "ss", "ds"};
+    std::string diff;
+    for (u8 r = 0; r < 12; ++r)
+        if (a.regs[r] != b.regs[r])
+            diff += std::format(" {} {:#06x} != {:#06x}", names[r], a.regs[r], b.regs[r]);
+    if (a.flags != b.flags)
+        diff += std::format(" flags {:#06x} != {:#06x}", a.flags, b.flags);
+    if (a.ip != b.ip)
+        diff += std::format(" ip {:#06x} != {:#06x}", a.ip, b.ip);
+    if (a.executed != b.executed || a.halted != b.halted)
+        diff += std::format(" executed {} != {}", a.executed, b.executed);
+    if (a.console != b.console || a.palette != b.palette)
+        diff += " devices";
+    if (memcmp(a.memory.data(), b.memory.data(), memory_end) != 0) {
+        auto [at, _] = std::mismatch(a.memory.begin(), a.memory.begin() + memory_end, b.memory.begin());
+        diff += std::format(" memory at {:#x}", at - a.memory.begin());
+    }
+    return diff;
 }
 
 
-void seg_to_regmem(const u8 *&b, Instr &i) {
-    regmem_to_seg(b, i);
-    i.reversed = true;
+// Every fused pair on small programs: an instruction setting the flags on two
+// registers, all byte operands and the edges of the word ones, then each jump
+// of a superinstruction, then pushf reading the flags or add overwriting them,
+// stopping anywhere in between. Run one instruction at a time and fused.
+bool kernel_equivalence() {
+    ProfileScope profile {"kernel equivalence"};
+    // op r/m, reg with al, bl / ax, bx
+    static constexpr u8 firsts[][2] {
+        {0x00, 0xD8}, {0x28, 0xD8}, {0x38, 0xD8}, {0x20, 0xD8}, {0x08, 0xD8}, {0x30, 0xD8}, {0x84, 0xD8},
+        {0xFE, 0xC0}, {0xFE, 0xC8},  // inc, dec
+    };
+    static constexpr u8 thirds[][2] {{0x9C, 0x90}, {0x01, 0xD2}};  // pushf, add dx, dx
+    std::vector<u16> words {0, 1, 2, 0x7F, 0x80, 0xFF, 0x100, 0x7FFE, 0x7FFF, 0x8000, 0x8001, 0xFFFE, 0xFFFF};
+    std::mt19937 generator {8086};
+    for (u16 i = 0; i < 64; ++i)
+        words.push_back(generator());
+
+    Cpu stepped, fused;
+    u8 program[7] {};
+    u64 nb_checked {0};
+    auto check = [&](const u16 &a, const u16 &b, const u16 &cx, const u16 &flags, const u64 &n) {
+        for (Cpu *cpu : {&stepped, &fused}) {
+            memset(cpu->regs, 0, sizeof(cpu->regs));
+            cpu->regs[0] = a, cpu->regs[3] = b, cpu->regs[1] = cx, cpu->regs[2] = a ^ b, cpu->regs[4] = 0x1000;
+            cpu->flags = flags, cpu->ip = 0, cpu->executed = 0;
+        }
+        stepped.run(n);
+        fused.run_decoded(n, true);
+        ++nb_checked;
+        const std::string diff {state_difference(stepped, fused, 0x1000)};
+        if (diff.empty())
+            return true;
+        std::cerr << std::format(
+            "superinstruction {:02x} {:02x} {:02x} {:02x} {:02x} {:02x} {:02x}, ax {:#06x} bx {:#06x} cx {} flags {:#06x}, {} instructions:{}",
+            program[0], program[1], program[2], program[3], program[4], program[5], program[6], a, b, cx, flags, n, diff
+        ) << std::endl;
+        return false;
+    };
+
+    for (u8 w = 0; w < 2; ++w)
+        for (const auto &first : firsts)
+            for (u8 second = 0; second < 20; ++second)
+                for (u8 third = 0; third < 2; ++third) {
+                    // first, second over the nop when taken, third
+                    program[0] = first[0] | w, program[1] = first[1];
+                    program[2] = second < 16 ? 0x70 + second : 0xE0 + second - 16, program[3] = 1;
+                    program[4] = 0x90;
+                    program[5] = thirds[third][0], program[6] = thirds[third][1];
+                    for (Cpu *cpu : {&stepped, &fused}) {
+                        cpu->load_program(program, sizeof(program));
+                        cpu->memory[0x0FFE] = cpu->memory[0x0FFF] = 0;
+                    }
+                    const u16 flags = third == 0 ? 0 : 0x08D5;  // inc and dec keep the carry
+                    if (w == 0) {
+                        for (u32 ab = 0; ab < 1 << 16; ++ab)
+                            if (!check(ab & 0xFF, ab >> 8, ab % 3, flags, 1 + ab % 5))
+                                return false;
+                    } else {
+                        for (const u16 &a : words)
+                            for (const u16 &b : words)
+                                if (!check(a, b, (a + b) % 3, flags, 1 + (a ^ b) % 5))
+                                    return false;
+                    }
+                }
+    std::cerr << std::format("kernel equivalence: {} programs", nb_checked) << std::endl;
+    return true;
 }
 
 
-void op_regmem_and_reg_to_either(const u8 *&b, Instr &i) {
-    u8 op; lf(b, op, 3, 3);
-    assert(op != 0b110);  // no op 110
-    move_regmem_to_from_reg(b, i);
-    i.instr = OPS_ENCODING[op].value;
-}
-
-
-void op_imm_from_regmem(const u8 *&b, Instr &i) {
-    u8 op, s; lf(b + 1, op, 3, 3); lf(b, s, 1, 1);
-    assert(op != 0b110);  // no op 110
-    imm_to_regmem(b, i, s);
-    i.instr = OPS_ENCODING[op].value;
-}
-
-
-void op_imm_from_acc(const u8 *&b, Instr &i) {
-    u8 op, w; lf(b, op, 3, 3); lf(b, w, 0, 1); ++b;
-    instr_reg_op0(i, w, 0);           // 0 is acc
-    instr_imm_op1(b, i, w);
-    i.instr = OPS_ENCODING[op].value;
-    i.reversed = false;
-}
-
-
-void jumps(const u8 *&b, Instr &i) {
-    u8 jump; lf(b, jump, 0, 4); ++b;
-    instr_imm_op0(b, i, 0, 1);  // 8 bit and signed
-    i.instr = JUMP_ENCODING[jump].value;
-    i.reversed = false;
-}
-
-
-void loops(const u8 *&b, Instr &i) {
-    u8 loop; lf(b, loop, 0, 2); ++b;
-    instr_imm_op0(b, i, 0, 1);  // 8 bit and signed
-    i.instr = LOOP_ENCODING[loop].value;
-    i.reversed = false;
-}
-
-
-static void(*disassembly_table[256])(const u8 *&, Instr &instr) {
-    /* 00000000 */  op_regmem_and_reg_to_either,
-    /* 00000001 */  op_regmem_and_reg_to_either,
-    /* 00000010 */  op_regmem_and_reg_to_either,
-    /* 00000011 */  op_regmem_and_reg_to_either,
-    /* 00000100 */  op_imm_from_acc,
-    /* 00000101 */  op_imm_from_acc,
-    /* 00000110 */  unimplemented,
-    /* 00000111 */  unimplemented,
-    /* 00001000 */  op_regmem_and_reg_to_either,
-    /* 00001001 */  op_regmem_and_reg_to_either,
-    /* 00001010 */  op_regmem_and_reg_to_either,
-    /* 00001011 */  op_regmem_and_reg_to_either,
-    /* 00001100 */  op_imm_from_acc,
-    /* 00001101 */  op_imm_from_acc,
-    /* 00001110 */  unimplemented,
-    /* 00001111 */  unimplemented,
-    /* 00010000 */  op_regmem_and_reg_to_either,
-    /* 00010001 */  op_regmem_and_reg_to_either,
-    /* 00010010 */  op_regmem_and_reg_to_either,
-    /* 00010011 */  op_regmem_and_reg_to_either,
-    /* 00010100 */  op_imm_from_acc,
-    /* 00010101 */  op_imm_from_acc,
-    /* 00010110 */  unimplemented,
-    /* 00010111 */  unimplemented,
-    /* 00011000 */  op_regmem_and_reg_to_either,
-    /* 00011001 */  op_regmem_and_reg_to_either,
-    /* 00011010 */  op_regmem_and_reg_to_either,
-    /* 00011011 */  op_regmem_and_reg_to_either,
-    /* 00011100 */  op_imm_from_acc,
-    /* 00011101 */  op_imm_from_acc,
-    /* 00011110 */  unimplemented,
-    /* 00011111 */  unimplemented,
-    /* 00100000 */  op_regmem_and_reg_to_either,
-    /* 00100001 */  op_regmem_and_reg_to_either,
-    /* 00100010 */  op_regmem_and_reg_to_either,
-    /* 00100011 */  op_regmem_and_reg_to_either,
-    /* 00100100 */  op_imm_from_acc,
-    /* 00100101 */  op_imm_from_acc,
-    /* 00100110 */  unimplemented,
-    /* 00100111 */  unimplemented,
-    /* 00101000 */  op_regmem_and_reg_to_either,
-    /* 00101001 */  op_regmem_and_reg_to_either,
-    /* 00101010 */  op_regmem_and_reg_to_either,
-    /* 00101011 */  op_regmem_and_reg_to_either,
-    /* 00101100 */  op_imm_from_acc,
-    /* 00101101 */  op_imm_from_acc,
-    /* 00101110 */  unimplemented,
-    /* 00101111 */  unimplemented,
-    /* 00110000 */  op_regmem_and_reg_to_either,
-    /* 00110001 */  op_regmem_and_reg_to_either,
-    /* 00110010 */  op_regmem_and_reg_to_either,
-    /* 00110011 */  op_regmem_and_reg_to_either,
-    /* 00110100 */  op_imm_from_acc,
-    /* 00110101 */  op_imm_from_acc,
-    /* 00110110 */  unimplemented,
-    /* 00110111 */  unimplemented,
-    /* 00111000 */  op_regmem_and_reg_to_either,
-    /* 00111001 */  op_regmem_and_reg_to_either,
-    /* 00111010 */  op_regmem_and_reg_to_either,
-    /* 00111011 */  op_regmem_and_reg_to_either,
-    /* 00111100 */  op_imm_from_acc,
-    /* 00111101 */  op_imm_from_acc,
-    /* 00111110 */  unimplemented,
-    /* 00111111 */  unimplemented,
-    /* 01000000 */  unimplemented,
-    /* 01000001 */  unimplemented,
-    /* 01000010 */  unimplemented,
-    /* 01000011 */  unimplemented,
-    /* 01000100 */  unimplemented,
-    /* 01000101 */  unimplemented,
-    /* 01000110 */  unimplemented,
-    /* 01000111 */  unimplemented,
-    /* 01001000 */  unimplemented,
-    /* 01001001 */  unimplemented,
-    /* 01001010 */  unimplemented,
-    /* 01001011 */  unimplemented,
-    /* 01001100 */  unimplemented,
-    /* 01001101 */  unimplemented,
-    /* 01001110 */  unimplemented,
-    /* 01001111 */  unimplemented,
-    /* 01010000 */  unimplemented,
-    /* 01010001 */  unimplemented,
-    /* 01010010 */  unimplemented,
-    /* 01010011 */  unimplemented,
-    /* 01010100 */  unimplemented,
-    /* 01010101 */  unimplemented,
-    /* 01010110 */  unimplemented,
-    /* 01010111 */  unimplemented,
-    /* 01011000 */  unimplemented,
-    /* 01011001 */  unimplemented,
-    /* 01011010 */  unimplemented,
-    /* 01011011 */  unimplemented,
-    /* 01011100 */  unimplemented,
-    /* 01011101 */  unimplemented,
-    /* 01011110 */  unimplemented,
-    /* 01011111 */  unimplemented,
-    /* 01100000 */  unimplemented,
-    /* 01100001 */  unimplemented,
-    /* 01100010 */  unimplemented,
-    /* 01100011 */  unimplemented,
-    /* 01100100 */  unimplemented,
-    /* 01100101 */  unimplemented,
-    /* 01100110 */  unimplemented,
-    /* 01100111 */  unimplemented,
-    /* 01101000 */  unimplemented,
-    /* 01101001 */  unimplemented,
-    /* 01101010 */  unimplemented,
-    /* 01101011 */  unimplemented,
-    /* 01101100 */  unimplemented,
-    /* 01101101 */  unimplemented,
-    /* 01101110 */  unimplemented,
-    /* 01101111 */  unimplemented,
-    /* 01110000 */  jumps,
-    /* 01110001 */  jumps,
-    /* 01110010 */  jumps,
-    /* 01110011 */  jumps,
-    /* 01110100 */  jumps,
-    /* 01110101 */  jumps,
-    /* 01110110 */  jumps,
-    /* 01110111 */  jumps,
-    /* 01111000 */  jumps,
-    /* 01111001 */  jumps,
-    /* 01111010 */  jumps,
-    /* 01111011 */  jumps,
-    /* 01111100 */  jumps,
-    /* 01111101 */  jumps,
-    /* 01111110 */  jumps,
-    /* 01111111 */  jumps,
-    /* 10000000 */  op_imm_from_regmem,
-    /* 10000001 */  op_imm_from_regmem,
-    /* 10000010 */  op_imm_from_regmem,
-    /* 10000011 */  op_imm_from_regmem,
-    /* 10000100 */  unimplemented,
-    /* 10000101 */  unimplemented,
-    /* 10000110 */  unimplemented,
-    /* 10000111 */  unimplemented,
-    /* 10001000 */  move_regmem_to_from_reg,
-    /* 10001001 */  move_regmem_to_from_reg,
-    /* 10001010 */  move_regmem_to_from_reg,
-    /* 10001011 */  move_regmem_to_from_reg,
-    /* 10001100 */  seg_to_regmem,
-    /* 10001101 */  unimplemented,
-    /* 10001110 */  regmem_to_seg,
-    /* 10001111 */  unimplemented,
-    /* 10010000 */  unimplemented,
-    /* 10010001 */  unimplemented,
-    /* 10010010 */  unimplemented,
-    /* 10010011 */  unimplemented,
-    /* 10010100 */  unimplemented,
-    /* 10010101 */  unimplemented,
-    /* 10010110 */  unimplemented,
-    /* 10010111 */  unimplemented,
-    /* 10011000 */  unimplemented,
-    /* 10011001 */  unimplemented,
-    /* 10011010 */  unimplemented,
-    /* 10011011 */  unimplemented,
-    /* 10011100 */  unimplemented,
-    /* 10011101 */  unimplemented,
-    /* 10011110 */  unimplemented,
-    /* 10011111 */  unimplemented,
-    /* 10100000 */  mem_to_acc,
-    /* 10100001 */  mem_to_acc,
-    /* 10100010 */  acc_to_mem,
-    /* 10100011 */  acc_to_mem,
-    /* 10100100 */  unimplemented,
-    /* 10100101 */  unimplemented,
-    /* 10100110 */  unimplemented,
-    /* 10100111 */  unimplemented,
-    /* 10101000 */  unimplemented,
-    /* 10101001 */  unimplemented,
-    /* 10101010 */  unimplemented,
-    /* 10101011 */  unimplemented,
-    /* 10101100 */  unimplemented,
-    /* 10101101 */  unimplemented,
-    /* 10101110 */  unimplemented,
-    /* 10101111 */  unimplemented,
-    /* 10110000 */  imm_to_reg,
-    /* 10110001 */  imm_to_reg,
-    /* 10110010 */  imm_to_reg,
-    /* 10110011 */  imm_to_reg,
-    /* 10110100 */  imm_to_reg,
-    /* 10110101 */  imm_to_reg,
-    /* 10110110 */  imm_to_reg,
-    /* 10110111 */  imm_to_reg,
-    /* 10111000 */  imm_to_reg,
-    /* 10111001 */  imm_to_reg,
-    /* 10111010 */  imm_to_reg,
-    /* 10111011 */  imm_to_reg,
-    /* 10111100 */  imm_to_reg,
-    /* 10111101 */  imm_to_reg,
-    /* 10111110 */  imm_to_reg,
-    /* 10111111 */  imm_to_reg,
-    /* 11000000 */  unimplemented,
-    /* 11000001 */  unimplemented,
-    /* 11000010 */  unimplemented,
-    /* 11000011 */  unimplemented,
-    /* 11000100 */  unimplemented,
-    /* 11000101 */  unimplemented,
-    /* 11000110 */  move_imm_to_regmem,
-    /* 11000111 */  move_imm_to_regmem,
-    /* 11001000 */  unimplemented,
-    /* 11001001 */  unimplemented,
-    /* 11001010 */  unimplemented,
-    /* 11001011 */  unimplemented,
-    /* 11001100 */  unimplemented,
-    /* 11001101 */  unimplemented,
-    /* 11001110 */  unimplemented,
-    /* 11001111 */  unimplemented,
-    /* 11010000 */  unimplemented,
-    /* 11010001 */  unimplemented,
-    /* 11010010 */  unimplemented,
-    /* 11010011 */  unimplemented,
-    /* 11010100 */  unimplemented,
-    /* 11010101 */  unimplemented,
-    /* 11010110 */  unimplemented,
-    /* 11010111 */  unimplemented,
-    /* 11011000 */  unimplemented,
-    /* 11011001 */  unimplemented,
-    /* 11011010 */  unimplemented,
-    /* 11011011 */  unimplemented,
-    /* 11011100 */  unimplemented,
-    /* 11011101 */  unimplemented,
-    /* 11011110 */  unimplemented,
-    /* 11011111 */  unimplemented,
-    /* 11100000 */  loops,
-    /* 11100001 */  loops,
-    /* 11100010 */  loops,
-    /* 11100011 */  loops,
-    /* 11100100 */  unimplemented,
-    /* 11100101 */  unimplemented,
-    /* 11100110 */  unimplemented,
-    /* 11100111 */  unimplemented,
-    /* 11101000 */  unimplemented,
-    /* 11101001 */  unimplemented,
-    /* 11101010 */  unimplemented,
-    /* 11101011 */  unimplemented,
-    /* 11101100 */  unimplemented,
-    /* 11101101 */  unimplemented,
-    /* 11101110 */  unimplemented,
-    /* 11101111 */  unimplemented,
-    /* 11110000 */  unimplemented,
-    /* 11110001 */  unimplemented,
-    /* 11110010 */  unimplemented,
-    /* 11110011 */  unimplemented,
-    /* 11110100 */  unimplemented,
-    /* 11110101 */  unimplemented,
-    /* 11110110 */  unimplemented,
-    /* 11110111 */  unimplemented,
-    /* 11111000 */  unimplemented,
-    /* 11111001 */  unimplemented,
-    /* 11111010 */  unimplemented,
-    /* 11111011 */  unimplemented,
-    /* 11111100 */  unimplemented,
-    /* 11111101 */  unimplemented,
-    /* 11111110 */  unimplemented,
-    /* 11111111 */  unimplemented,
-};
+// Runs a program one instruction at a time and fused side by side, comparing
+// their whole states every 1000 instructions, after checking the kernels first
+// when asked (several seconds)
+bool equivalence(const char *file_path, const bool &kernels) {
+    if (kernels && !kernel_equivalence())
+        return false;
+    size_t size;
+    const std::vector<u8> program {read_instructions(file_path, size)};
+    ProfileScope profile {"program equivalence"};
+    constexpr u64 every {1000}, max_executed {1 << 26};
+    Cpu stepped, fused;
+    stepped.load_program(program.data(), size);
+    fused.load_program(program.data(), size);
+    while (stepped.executed < max_executed) {
+        const u64 done {stepped.run(every)};
+        fused.run_decoded(every, true);
+        const std::string diff {state_difference(stepped, fused, MEMORY_SIZE)};
+        if (!diff.empty()) {
+            std::cerr << std::format("{} differs fused, within instructions {}..{}:{}", file_path, stepped.executed - done, stepped.executed, diff) << std::endl;
+            return false;
+        }
+        if (done < every)
+            break;
+    }
+    std::cerr << std::format("program equivalence: {} instructions", stepped.executed) << std::endl;
+    return true;
+}
 
 
-void disassembly(const char *file_path, const bool &simulation, const bool &clocks) {
+// Runs a program under commands read from stdin, one per line, able to go
+// back: step N, back N, goto N, write ADDR (physical, hex) back to the last
+// instruction that wrote that byte, change REG (ax..ds or flags) back to the
+// last that changed it, regs, quit. Each answers with where the program is:
+// the count of instructions executed and the next one. A checkpoint is taken
+// every `every` instructions.
+void replay(const char *file_path, const u64 &every) {
+    static constexpr const char *names[] {"ax", "cx", "dx", "bx", "sp", "bp", "si", "di", "es", "cs", "ss", "ds", "flags"};
     size_t size;
-    read_instructions(file_path, size);
-    size_t offset;
+    const std::vector<u8> program {read_instructions(file_path, size)};
+    Cpu cpu;
+    cpu.load_program(program.data(), size);
+    History history {cpu, every, 64};
+
+    auto at = [&](const u16 &cs, const u16 &ip) {
+        Instr instr;
+        const u8 *b {&cpu.memory[phys_addr(cs, ip)]};
+        decode(b, instr);
+        return std::format("{:04x}:{:04x} {}", cs, ip, to_string(instr));
+    };
+    auto where = [&]() {
+        std::cout << std::format("{}: ", cpu.executed);
+        std::cout << (cpu.running() ? at(cpu.regs[8 + Cs], cpu.ip) : std::string{"stopped"}) << std::endl;
+    };
+    auto found = [&](const std::optional<u64> &before) {
+        if (!before)
+            std::cout << "not since " << history.oldest() << std::endl;
+    };
 
     std::cout << "; " << file_path << std::endl;
-    Instr instr;
-    const u8 *b;
-    u16 prev_IP;
-    while(static_cast<size_t>(IP) < size) {
-        b = &MEMORY[IP];
-        disassembly_table[*b](b, instr);
-        prev_IP = IP;
-        IP += (b - &MEMORY[IP]);  // add the amount of bytes read for disassembly
-        if (simulation)
-            std::cout << sim_instr(instr, prev_IP) << std::endl;
-        else if (clocks)
-            std::cout << estimate_clocks(instr) << std::endl;
-        else
-            std::cout << to_string(instr) << std::endl;
-    }
-    if(simulation) {
-        std::cout << std::endl;
-        print_all_regs();
-        std::cout << "\tflags: " << flags_to_string(FLAGS) << std::endl;
+    where();
+    std::string command;
+    while (std::cin >> command) {
+        if (command == "quit")
+            break;
+        if (command == "regs") {
+            for (u8 r = 0; r < 12; ++r)
+                std::cout << std::format("{} {:04x} ", names[r], cpu.regs[r]);
+            std::cout << std::format("ip {:04x} flags:{}", cpu.ip, flags_to_string(cpu.flags)) << std::endl;
+            continue;
+        }
+        std::string arg;
+        std::cin >> arg;
+        if (command == "step") {
+            history.run(strtoull(arg.c_str(), nullptr, 10));
+        } else if (command == "back") {
+            const u64 n {std::min<u64>(strtoull(arg.c_str(), nullptr, 10), cpu.executed)};
+            if (!history.go_to(cpu.executed - n))
+                std::cout << "not before " << history.oldest() << std::endl;
+        } else if (command == "goto") {
+            if (!history.go_to(strtoull(arg.c_str(), nullptr, 10)))
+                std::cout << "out of " << history.oldest() << ".." << std::endl;
+        } else if (command == "write") {
+            found(history.last_write(strtoul(arg.c_str(), nullptr, 16) & MEMORY_MASK));
+        } else if (command == "change") {
+            const auto name = std::find_if(std::begin(names), std::end(names), [&](const char *n) { return arg == n; });
+            if (name == std::end(names)) {
+                std::cout << "no register " << arg << std::endl;
+                continue;
+            }
+            found(history.last_change(name - std::begin(names)));
+        } else {
+            std::cout << "unknown command " << command << std::endl;
+            continue;
+        }
+        where();
     }
 }
 
 
 int main(int argc, char** argv) {
-    memset(MEMORY, 0, 1 << 16);
     if (argc < 2)
         throw std::runtime_error{"No binary input file provided"};
     bool simulation {false};
     bool dump {false};
+    bool framebuffer {false};
+    bool deltas {false};
+    u64 delta_every {0};
     bool clocks {false};
+    bool timing {false};
+    bool bulk {false};
+    bool equivalent {false};
+    bool kernels {false};
+    std::optional<Prefetch> queue;
+    bool analyze {false};
+    bool json {false};
+    bool replaying {false};
+    u64 checkpoint_every {10000};
+    size_t nb_threads {0};
     for (u8 i = 2; i < argc; ++i)
         if (std::string{argv[i]} == "-s")
             simulation = true;
         else if (std::string{argv[i]} == "-d")
             dump = true;
+        else if (std::string{argv[i]} == "-f")
+            framebuffer = true;
+        else if (std::string{argv[i]} == "-D") {
+            // optional period in instructions, only at the end by default
+            deltas = true;
+            if (i + 1 < argc && std::isdigit(argv[i + 1][0]))
+                delta_every = strtoull(argv[++i], nullptr, 10);
+        }
         else if (std::string{argv[i]} == "-c")
             clocks = true;
+        else if (std::string{argv[i]} == "-t")
+            timing = true;
+        else if (std::string{argv[i]} == "-b")
+            bulk = true;
+        else if (std::string{argv[i]} == "-e")
+            equivalent = true;
+        else if (std::string{argv[i]} == "-q") {
+            // prefetch queue clocks, of the 8086 unless followed by 8088
+            const bool i8088 {i + 1 < argc && std::string{argv[i + 1]} == "8088"};
+            i += i8088;
+            queue.emplace(i8088);
+        }
+        else if (std::string{argv[i]} == "-a") {
+            // text, or json when followed by it
+            analyze = true;
+            json = i + 1 < argc && std::string{argv[i + 1]} == "json";
+            i += json;
+        }
+        else if (std::string{argv[i]} == "-r") {
+            // optional checkpoint period in instructions
+            replaying = true;
+            if (i + 1 < argc && std::isdigit(argv[i + 1][0]))
+                checkpoint_every = strtoull(argv[++i], nullptr, 10);
+        }
+        else if (std::string{argv[i]} == "-k")
+            equivalent = kernels = true;
+        else if (std::string{argv[i]} == "-P")
+            start_profiling();  // regions on stderr at the end
+        else if (std::string{argv[i]} == "-p") {
+            // optional thread count, all hardware threads by default
+            nb_threads = std::max(1u, std::thread::hardware_concurrency());
+            if (i + 1 < argc && std::isdigit(argv[i + 1][0]))
+                nb_threads = std::max(1ul, strtoul(argv[++i], nullptr, 10));
+        }
         else
             throw std::runtime_error{"Invalid option"};
-    if (simulation && clocks)
+    if (timing) {
+        benchmark(argv[1]);
+    } else if (analyze) {
+        analysis(argv[1], json, queue && queue->bus_bytes == 1);
+    } else if (replaying) {
+        replay(argv[1], checkpoint_every);
+    } else if (equivalent) {
+        const bool same {equivalence(argv[1], kernels)};
+        print_profile(stderr);
+        return same ? 0 : 1;
+    } else if ((bulk || nb_threads > 0) && (simulation || clocks || queue)) {
+        throw std::runtime_error{"Bulk and parallel modes only disassemble"};
+    } else if (nb_threads > 0) {
+        parallel_disassembly(argv[1], nb_threads);
+    } else if (bulk) {
+        bulk_disassembly(argv[1]);
+    } else if (simulation && clocks) {
         throw std::runtime_error{"Cannot both simulate and estimate clocks (was lazy)"};
-    disassembly(argv[1], simulation, clocks);
-    if (dump) {
-        auto file = fopen("dump.data", "wb");
-        assert(fwrite(MEMORY, 1, 1 << 16, file) == 1 << 16);
-        fclose(file);
+    } else {
+        FILE *delta_file = deltas ? open_output("dump.delta") : nullptr;
+        Cpu cpu;
+        disassembly(cpu, argv[1], simulation, clocks, delta_file, delta_every, queue ? &*queue : nullptr);
+        ProfileScope profile {"dumps"};
+        if (delta_file != nullptr) {
+            if (cpu.executed == 0 || delta_every == 0 || cpu.executed % delta_every != 0)
+                write_snapshot(cpu, delta_file);  // unless the last one just was
+            fclose(delta_file);
+        }
+        if (dump) {
+            auto file = open_output("dump.data");
+            write_output(file, "dump.data", cpu.memory.data(), DUMP_SIZE);
+            fclose(file);
+        }
+        if (framebuffer)
+            write_framebuffer(cpu, "framebuffer.ppm");
     }
+    print_profile(stderr);
 }
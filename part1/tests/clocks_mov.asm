@@ -0,0 +1,18 @@
+; mov clocks against the 8086 manual, expected from sim8086 -c in clocks_mov.txt:
+; al and ax to and from a direct address take 10, other registers 9 + ea or
+; 8 + ea, and so do al and ax through a register address
+
+bits 16
+
+mov [1000], al
+mov [1000], ax
+mov al, [1000]
+mov ax, [1000]
+mov [1000], ah
+mov [1000], sp
+mov ah, [1000]
+mov cx, [1000]
+mov [bx], al
+mov ax, [bx]
+mov al, 5
+mov ax, ax
@@ -1,15 +1,44 @@
+#include <algorithm>
 #include <cassert>
+#include <chrono>
 #include <cmath>
+#include <condition_variable>
 #include <cstdio>
 #include <cstdint>
+#include <filesystem>
+#include <format>
+#include <functional>
+#include <iomanip>
 #include <iostream>
+#include <limits>
+#include <mutex>
+#include <numbers>
+#include <random>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <set>
 #include <sstream>
 #include <stdexcept>
 #include <stdio.h>
+#include <thread>
+#include <type_traits>
 #include <vector>
 
+#include "../common/profiler.h"
+#include "input.h"
+
+#ifndef MADV_POPULATE_WRITE
+#define MADV_POPULATE_WRITE 23  // linux 5.14
+#endif
+
+using f32 = float;
 using f64 = double;
+using u8 = uint8_t;
+using u32 = uint32_t;
 using u64 = uint64_t;
+using s64 = int64_t;
 
 
 static f64 EARTH_RADIUS {6372.8};
@@ -52,23 +81,226 @@ static f64 reference_haversine(f64 x0, f64 x1, f64 y0, f64 y1,
 }
 
 
+// Float path, for when a few metres are close enough: twice the lanes of the
+// f64 one and half the memory. HAVERSINE_F32_MAX_ERROR bounds its distance
+// from reference_haversine on the f64 coordinates, in km, coordinate rounding
+// to float included. --f32-sweep checks it over the whole domain, where the
+// largest error it finds is 4.9 m, about half from the rounding of the
+// coordinates and half from the float arithmetic.
+static constexpr f64 HAVERSINE_F32_MAX_ERROR {0.006};
+
+static constexpr f32 DEGREES_TO_RADIANS_F32 {0.01745329251994329577f};
+
+
+// |sin| and |cos| of an angle in [-180, 180] degrees. Folded to [0, 45] by
+// subtractions that are exact in float (Sterbenz), where the Taylor series
+// below are past float precision.
+[[gnu::always_inline]] inline static void sin_cos_abs(f32 degrees, f32 &s, f32 &c)
+{
+    f32 d = std::abs(degrees);
+    d = d > 90.0f ? 180.0f - d : d;
+    const bool swap = d > 45.0f;
+    d = swap ? 90.0f - d : d;
+    const f32 r = d * DEGREES_TO_RADIANS_F32;
+    const f32 r2 = r * r;
+    const f32 sin_r = r * (1.0f + r2 * (-1.0f / 6 + r2 * (1.0f / 120 + r2 * (-1.0f / 5040 + r2 * (1.0f / 362880)))));
+    const f32 cos_r = 1.0f + r2 * (-1.0f / 2 + r2 * (1.0f / 24 + r2 * (-1.0f / 720 + r2 * (1.0f / 40320 + r2 * (-1.0f / 3628800)))));
+    s = swap ? cos_r : sin_r;
+    c = swap ? sin_r : cos_r;
+}
+
+
+// atan of t in [0, 1], reduced to |u| <= tan(pi/8) for cephes' atanf polynomial
+[[gnu::always_inline]] inline static f32 atan_unit(f32 t)
+{
+    const bool reduce = t > 0.41421356f;
+    const f32 u = reduce ? (t - 1.0f) / (t + 1.0f) : t;
+    const f32 z = u * u;
+    const f32 p = u + u * z * (((8.05374449538e-2f * z - 1.38776856032e-1f) * z + 1.99777106478e-1f) * z - 3.33329491539e-1f);
+    return reduce ? std::numbers::pi_v<f32> / 4 + p : p;
+}
+
+
+// Same distance as reference_haversine, without its asin: near antipodes
+// sin^2 of half the angle is close to 1 and asin would turn the float rounding
+// of it into kilometres. The cos^2 is computed as well, as the haversine to the
+// antipode of the second point, both are then accurate relative to themselves
+// and the half angle is the atan of the smaller root over the larger one.
+// Branchless, so that the loops over the columns vectorize.
+[[gnu::always_inline]] inline static f64 haversine_f32(f32 x0, f32 x1, f32 y0, f32 y1, f64 earth_radius = EARTH_RADIUS)
+{
+    f32 sin_dlat, cos_dlat, sin_slat, cos_slat, sin_dlon, cos_dlon, sin_lat0, cos_lat0, sin_lat1, cos_lat1;
+    // halved first, the differences round on half the ulp
+    sin_cos_abs(y1 * 0.5f - y0 * 0.5f, sin_dlat, cos_dlat);
+    sin_cos_abs(y1 * 0.5f + y0 * 0.5f, sin_slat, cos_slat);
+    sin_cos_abs(x1 * 0.5f - x0 * 0.5f, sin_dlon, cos_dlon);
+    sin_cos_abs(y0, sin_lat0, cos_lat0);
+    sin_cos_abs(y1, sin_lat1, cos_lat1);
+
+    const f32 k = cos_lat0 * cos_lat1;
+    const f32 a = sin_dlat * sin_dlat + k * sin_dlon * sin_dlon;  // sin^2 of half the central angle
+    const f32 b = sin_slat * sin_slat + k * cos_dlon * cos_dlon;  // and its cos^2
+    const f32 root_a = std::sqrt(a), root_b = std::sqrt(b);
+    const f32 half = atan_unit(std::min(root_a, root_b) / std::max(root_a, root_b));
+    const f64 angle = root_a <= root_b ? f64(half) : std::numbers::pi / 2 - half;
+    return earth_radius * 2 * angle;
+}
+
+
+static constexpr u64 ARENA_ALIGN {64};
+
+
+// One anonymous mapping for all the columns, sized once up front and handed
+// out front to back. Its pages are faulted in where they are first written,
+// or ahead of that for the ranges given to populate, and in 2 MB pages with
+// huge_pages: hugetlbfs pages if some are reserved, else transparent huge pages.
+struct arena {
+    u8 *base {nullptr};
+    u64 size {0};
+    u64 used {0};
+    const char *page_kind {"4 KB"};
+
+    arena() = default;
+
+    arena(u64 bytes, bool huge_pages)
+    {
+        constexpr u64 huge_page {2 << 20};
+        size = huge_pages ? (bytes + huge_page - 1) / huge_page * huge_page : std::max<u64>(bytes, 1);
+        const int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+        void *p = MAP_FAILED;
+        if (huge_pages) {
+            p = mmap(nullptr, size, PROT_READ | PROT_WRITE, flags | MAP_HUGETLB, -1, 0);
+            page_kind = "2 MB hugetlbfs";
+        }
+        if (p == MAP_FAILED) {
+            p = mmap(nullptr, size, PROT_READ | PROT_WRITE, flags, -1, 0);
+            page_kind = "4 KB";
+            // transparent huge pages have to be asked for before the pages are populated
+            if (p != MAP_FAILED && huge_pages && madvise(p, size, MADV_HUGEPAGE) == 0)
+                page_kind = "transparent huge";
+        }
+        if (p == MAP_FAILED)
+            throw std::runtime_error{std::format("Cannot map an arena of {} bytes", size)};
+        base = static_cast<u8*>(p);
+    }
+
+    arena(arena &&other) noexcept { *this = std::move(other); }
+    arena &operator=(arena &&other) noexcept
+    {
+        std::swap(base, other.base);
+        std::swap(size, other.size);
+        std::swap(used, other.used);
+        std::swap(page_kind, other.page_kind);
+        return *this;
+    }
+
+    ~arena()
+    {
+        if (base != nullptr)
+            munmap(base, size);
+    }
+
+    // faults in the pages under [begin, begin + bytes) for writing
+    void populate(const void *begin, u64 bytes)
+    {
+        constexpr u64 page {4096};
+        const u64 first = (static_cast<const u8*>(begin) - base) / page * page;
+        const u64 last = std::min(static_cast<const u8*>(begin) - base + bytes, size);
+        if (last <= first || madvise(base + first, last - first, MADV_POPULATE_WRITE) == 0)
+            return;
+        for (u64 offset = first; offset < last; offset += page)
+            static_cast<volatile u8*>(base)[offset] = 0;
+    }
+
+    // cache line aligned, for aligned vector loads
+    template<typename T>
+    T *take(u64 count)
+    {
+        used = (used + ARENA_ALIGN - 1) / ARENA_ALIGN * ARENA_ALIGN;
+        if (used + count * sizeof(T) > size)
+            throw std::runtime_error{"Arena exhausted"};
+        T *p = reinterpret_cast<T*>(base + used);
+        used += count * sizeof(T);
+        return p;
+    }
+};
+
+
+// The four columns, in an arena with room for capacity pairs, as f64 or as f32
+template<typename T>
 struct points {
-    std::vector<f64> x0;
-    std::vector<f64> x1;
-    std::vector<f64> y0;
-    std::vector<f64> y1;
+    arena memory;
+    u64 count {0};
+    u64 capacity {0};
+    T *x0 {nullptr};
+    T *x1 {nullptr};
+    T *y0 {nullptr};
+    T *y1 {nullptr};
+
+    points() = default;
+
+    points(u64 nb_pairs, bool huge_pages)
+        : memory {4 * (nb_pairs * sizeof(T) + ARENA_ALIGN), huge_pages}, capacity {nb_pairs}
+    {
+        x0 = memory.take<T>(nb_pairs);
+        x1 = memory.take<T>(nb_pairs);
+        y0 = memory.take<T>(nb_pairs);
+        y1 = memory.take<T>(nb_pairs);
+    }
+
+    // the pages of the first nb_pairs of each column
+    void populate(u64 nb_pairs)
+    {
+        const u64 bytes = std::min(nb_pairs, capacity) * sizeof(T);
+        for (T *column : {x0, x1, y0, y1})
+            memory.populate(column, bytes);
+    }
+};
+
+
+// the shortest pair the parser takes, {"x0":0,"y0":0,"x1":0,"y1":0}, and a comma
+static constexpr u64 MIN_PAIR_BYTES {30};
+
+
+// The pairs of a file from the average length of those in its first 64 KB,
+// a little over so that the last pages of the columns are populated too
+u64 estimate_pairs(const std::string &json_file_path, u64 file_size)
+{
+    std::vector<char> head(64 << 10);
+    FILE *f = fopen(json_file_path.c_str(), "rb");
+    const u64 length = f != nullptr ? fread(head.data(), 1, head.size(), f) : 0;
+    if (f != nullptr)
+        fclose(f);
+    // the opening brace of every pair, less the one of the whole file
+    const u64 pairs = std::count(head.begin(), head.begin() + length, '{');
+    if (pairs < 2)
+        return file_size / MIN_PAIR_BYTES + 1;
+    return file_size / (length / (pairs - 1)) * 21 / 20 + 1024;
+}
+
+
+// Where the parser is in the chunks of the input, read in place
+struct cursor {
+    input &in;
+    const char *at {nullptr};
+    const char *end {nullptr};
 };
 
 
-void get_char(FILE* file, char* chr) {
-    if(int c = fgetc(file); c != EOF)
-        *chr = static_cast<char>(c);
+void get_char(cursor& file, char* chr) {
+    if (file.at == file.end) {
+        std::span<const char> chunk = file.in.next();
+        file.at = chunk.data();
+        file.end = chunk.data() + chunk.size();
+    }
+    if (file.at != file.end)
+        *chr = *file.at++;
     else
         *chr = '\0';
 }
 
 
-char get_next_token(FILE* file) {
+char get_next_token(cursor& file) {
     char next;
     get_char(file, &next);
     while(next == ' ' || next == '\n' || next == '\t')
@@ -87,7 +319,7 @@ char get_next_token(FILE* file) {
 }
 
 
-std::string get_key(FILE* file) {
+std::string get_key(cursor& file) {
     char next = {' '};
     while(next != '"')
         get_char(file, &next);
@@ -103,7 +335,7 @@ std::string get_key(FILE* file) {
 }
 
 
-f64 get_value_f64(FILE* file) {
+f64 get_value_f64(cursor& file) {
     char next = {' '};
     while(next == ' ')
         get_char(file, &next);
@@ -116,44 +348,872 @@ f64 get_value_f64(FILE* file) {
 }
 
 
-void add_point(FILE* file, points &ps) {
+template<typename T>
+void add_point(cursor& file, points<T> &ps) {
+    assert(ps.count < ps.capacity);
     assert(get_next_token(file) == '{');
     assert(get_key(file) == "x0");
-    ps.x0.emplace_back(get_value_f64(file));
+    ps.x0[ps.count] = static_cast<T>(get_value_f64(file));
     assert(get_key(file) == "y0");
-    ps.y0.emplace_back(get_value_f64(file));
+    ps.y0[ps.count] = static_cast<T>(get_value_f64(file));
     assert(get_key(file) == "x1");
-    ps.x1.emplace_back(get_value_f64(file));
+    ps.x1[ps.count] = static_cast<T>(get_value_f64(file));
     assert(get_key(file) == "y1");
-    ps.y1.emplace_back(get_value_f64(file));
+    ps.y1[ps.count] = static_cast<T>(get_value_f64(file));
+    ++ps.count;
 }
 
 
-points get_points(std::string json_file_path) {
-    FILE* file = fopen(json_file_path.c_str(), "r");
+// The arena is sized from the file, for as many pairs as it can hold at most,
+// its pages past the last pair are never touched. With populate, the pages of
+// the estimated pairs are faulted in before the parse, outside of its timing.
+template<typename T>
+points<T> get_points(std::string json_file_path, const std::string &engine, bool huge_pages, bool populate, bool report) {
+    const u64 file_size {std::filesystem::file_size(json_file_path)};
+    points<T> ps {file_size / MIN_PAIR_BYTES + 1, huge_pages};
+    if (populate) {
+        ProfileScope profile {"populate"};
+        auto start = std::chrono::steady_clock::now();
+        rusage usage_start;
+        getrusage(RUSAGE_SELF, &usage_start);
+        const u64 estimate = estimate_pairs(json_file_path, file_size);
+        ps.populate(estimate);
+        if (report) {
+            rusage usage_end;
+            getrusage(RUSAGE_SELF, &usage_end);
+            std::cerr << std::format(
+                "populate: {} of {} pairs, {:.3f} ms, {} minor page faults",
+                std::min(estimate, ps.capacity), ps.capacity,
+                std::chrono::duration<f64>(std::chrono::steady_clock::now() - start).count() * 1e3,
+                usage_end.ru_minflt - usage_start.ru_minflt
+            ) << std::endl;
+        }
+    }
+
+    ProfileScope profile {"parse"};
+    auto start = std::chrono::steady_clock::now();
+    rusage usage_start;
+    getrusage(RUSAGE_SELF, &usage_start);
+
+    std::unique_ptr<input> in = open_input(engine, json_file_path);
+    cursor file {*in};
     assert(get_next_token(file) == '{');
     assert(get_key(file) == "pairs");
     assert(get_next_token(file) == '[');
-    points ps;
     add_point(file, ps);
     while(get_next_token(file) == ',')
         add_point(file, ps);
+
+    if (report) {
+        rusage usage_end;
+        getrusage(RUSAGE_SELF, &usage_end);
+        std::cerr << std::format(
+            "load: {} pairs, {} input, {:.3f} ms, {} minor and {} major page faults, arena {:.1f} MB for {} pairs in {} pages{}",
+            ps.count, in->name(), std::chrono::duration<f64>(std::chrono::steady_clock::now() - start).count() * 1e3,
+            usage_end.ru_minflt - usage_start.ru_minflt, usage_end.ru_majflt - usage_start.ru_majflt,
+            ps.memory.size / 1e6, ps.capacity, ps.memory.page_kind, populate ? ", populated" : ""
+        ) << std::endl;
+    }
     return ps;
 }
 
 
+// cpus the process may run on, in order
+std::vector<int> allowed_cpus()
+{
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    std::vector<int> cpus;
+    if (sched_getaffinity(0, sizeof(set), &set) == 0)
+        for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+            if (CPU_ISSET(cpu, &set))
+                cpus.push_back(cpu);
+    if (cpus.empty())
+        cpus.push_back(0);
+    return cpus;
+}
+
+
+// NUMA node of a cpu from sysfs, 0 without NUMA
+int cpu_node(int cpu)
+{
+    std::error_code error;
+    std::filesystem::directory_iterator dir {std::format("/sys/devices/system/cpu/cpu{}", cpu), error};
+    for (; !error && dir != std::filesystem::directory_iterator{}; dir.increment(error)) {
+        std::string name = dir->path().filename().string();
+        if (name.starts_with("node"))
+            return std::stoi(name.substr(4));
+    }
+    return 0;
+}
+
+
+// Workers pinned one per cpu, in the order of the cpus the process may run on,
+// wrapping around past the last one. run has each of them call the task with
+// its index and returns once they all have.
+struct thread_pool {
+    std::vector<int> cpus;
+    std::vector<std::thread> workers;
+    std::mutex mutex;
+    std::condition_variable wake, done;
+    const std::function<void(u64)> *task {nullptr};
+    u64 generation {0};
+    u64 remaining {0};
+    bool stopping {false};
+
+    explicit thread_pool(u64 nb_threads)
+    {
+        const std::vector<int> allowed = allowed_cpus();
+        for (u64 w = 0; w < nb_threads; ++w)
+            cpus.push_back(allowed[w % allowed.size()]);
+        for (u64 w = 0; w < nb_threads; ++w)
+            workers.emplace_back([this, w]() { work(w); });
+    }
+
+    ~thread_pool()
+    {
+        {
+            std::lock_guard lock {mutex};
+            stopping = true;
+        }
+        wake.notify_all();
+        for (auto &worker : workers)
+            worker.join();
+    }
+
+    u64 size() const { return workers.size(); }
+
+    void run(const std::function<void(u64)> &f)
+    {
+        std::unique_lock lock {mutex};
+        task = &f;
+        remaining = workers.size();
+        ++generation;
+        wake.notify_all();
+        done.wait(lock, [this]() { return remaining == 0; });
+    }
+
+    void work(u64 w)
+    {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpus[w], &set);
+        pthread_setaffinity_np(pthread_self(), sizeof(set), &set);  // before it touches anything
+
+        u64 seen {0};
+        std::unique_lock lock {mutex};
+        while (true) {
+            wake.wait(lock, [&]() { return stopping || generation != seen; });
+            if (stopping)
+                return;
+            seen = generation;
+            lock.unlock();
+            (*task)(w);
+            lock.lock();
+            if (--remaining == 0)
+                done.notify_one();
+        }
+    }
+};
+
+
+// Deterministic reduction: the pairs are cut in blocks of a fixed size, each
+// summed on its own in SUM_LANES interleaved compensated sums, and the block
+// sums are combined in order. The result does not depend on the number of
+// threads nor on which one gets which block.
+static constexpr u64 SUM_BLOCK {1 << 12};
+static constexpr u64 SUM_LANES {8};
+
+
+struct compensated_sum {
+    f64 sum {0};
+    f64 compensation {0};
+};
+
+
+// Neumaier's variant of Kahan summation, also right when x is larger than the sum
+static void neumaier_add(f64 &sum, f64 &compensation, f64 x)
+{
+    f64 t = sum + x;
+    compensation += std::abs(sum) >= std::abs(x) ? (sum - t) + x : (x - t) + sum;
+    sum = t;
+}
+
+
+// n is a multiple of SUM_LANES, the lanes are independent and vectorize
+static compensated_sum sum_block(const f64 *values, u64 n)
+{
+    f64 sums[SUM_LANES] {}, compensations[SUM_LANES] {};
+    for (u64 i = 0; i < n; i += SUM_LANES)
+        for (u64 l = 0; l < SUM_LANES; ++l)
+            neumaier_add(sums[l], compensations[l], values[i + l]);
+
+    compensated_sum block;
+    for (u64 l = 0; l < SUM_LANES; ++l) {
+        neumaier_add(block.sum, block.compensation, sums[l]);
+        block.compensation += compensations[l];
+    }
+    return block;
+}
+
+
+// Pairs [begin, end) of worker w, cut on SUM_BLOCK boundaries so that the
+// blocks of the deterministic reduction are split the same way
+std::pair<u64, u64> worker_range(u64 n, u64 w, u64 nb_workers)
+{
+    const u64 nb_blocks = (n + SUM_BLOCK - 1) / SUM_BLOCK;
+    return {
+        std::min(n, nb_blocks * w / nb_workers * SUM_BLOCK),
+        std::min(n, nb_blocks * (w + 1) / nb_workers * SUM_BLOCK)
+    };
+}
+
+
+u64 pool_nodes(const thread_pool &pool)
+{
+    std::set<int> nodes;
+    for (int cpu : pool.cpus)
+        nodes.insert(cpu_node(cpu));
+    return nodes.size();
+}
+
+
+// Copies of the columns where each worker writes its own range first, so that
+// the pages it later reads are on its NUMA node. Only worth it when the pool
+// spans several nodes, the parsed columns are all on the parser's one.
+template<typename T>
+points<T> place_points(const points<T> &parsed, thread_pool &pool, bool huge_pages)
+{
+    ProfileScope profile {"place"};
+    const u64 n = parsed.count;
+    points<T> placed {n, huge_pages};
+    placed.count = n;
+    pool.run([&](u64 w) {
+        auto [begin, end] = worker_range(n, w, pool.size());
+        std::copy(parsed.x0 + begin, parsed.x0 + end, placed.x0 + begin);
+        std::copy(parsed.x1 + begin, parsed.x1 + end, placed.x1 + begin);
+        std::copy(parsed.y0 + begin, parsed.y0 + end, placed.y0 + begin);
+        std::copy(parsed.y1 + begin, parsed.y1 + end, placed.y1 + begin);
+    });
+    return placed;
+}
+
+
+// Distances of the pairs [begin, end) into out. The f32 ones in float vectors,
+// summed in f64 by the callers.
+template<typename T>
+void haversines(const points<T> &ps, u64 begin, u64 end, f64 *out)
+{
+    for (u64 i = begin; i < end; ++i)
+        if constexpr (std::is_same_v<T, f32>)
+            out[i - begin] = haversine_f32(ps.x0[i], ps.x1[i], ps.y0[i], ps.y1[i]);
+        else
+            out[i - begin] = reference_haversine(ps.x0[i], ps.x1[i], ps.y0[i], ps.y1[i]);
+}
+
+
+// plain sums per worker, added in worker order
+template<typename T>
+f64 mean_haversine(const points<T> &ps, thread_pool &pool)
+{
+    ProfileScope profile {"mean"};
+    const u64 n = ps.count;
+    std::vector<f64> sums(pool.size());
+    pool.run([&](u64 w) {
+        auto [first, last] = worker_range(n, w, pool.size());
+        f64 sum {0};
+        for (u64 begin = first; begin < last; begin += SUM_BLOCK) {
+            f64 distances[SUM_BLOCK];
+            const u64 end = std::min(last, begin + SUM_BLOCK);
+            haversines(ps, begin, end, distances);
+            for (u64 i = 0; i < end - begin; ++i)
+                sum += distances[i];
+        }
+        sums[w] = sum;
+    });
+    f64 mean {0};
+    for (f64 sum : sums)
+        mean += sum;
+    return mean / n;
+}
+
+
+// error_bound is the bound on the rounding error of the mean, from Higham's
+// |error| <= 2u|S| + O(n u^2) sum |x_i| for compensated summation, where with
+// distances all positive sum |x_i| is S, and u more for the division
+template<typename T>
+f64 deterministic_mean(const points<T> &ps, thread_pool &pool, f64 &error_bound)
+{
+    ProfileScope profile {"deterministic mean"};
+    const u64 n = ps.count;
+    const u64 nb_blocks = (n + SUM_BLOCK - 1) / SUM_BLOCK;
+    std::vector<compensated_sum> blocks(nb_blocks);
+    pool.run([&](u64 w) {
+        auto [first, last] = worker_range(n, w, pool.size());
+        for (u64 b = first / SUM_BLOCK; b * SUM_BLOCK < last; ++b) {
+            f64 distances[SUM_BLOCK];
+            const u64 begin = b * SUM_BLOCK, end = std::min(n, begin + SUM_BLOCK);
+            haversines(ps, begin, end, distances);
+            u64 len = end - begin;
+            for (; len % SUM_LANES != 0; ++len)
+                distances[len] = 0;  // adding zeros is exact
+            blocks[b] = sum_block(distances, len);
+        }
+    });
+
+    compensated_sum total;
+    for (const auto &block : blocks) {
+        neumaier_add(total.sum, total.compensation, block.sum);
+        total.compensation += block.compensation;
+    }
+    const f64 mean = (total.sum + total.compensation) / n;
+    const f64 u = std::numeric_limits<f64>::epsilon() / 2;
+    error_bound = (3 * u + 2 * n * u * u) * mean;
+    return mean;
+}
+
+
+// Throughput of the mean from 1 to max_threads workers, the points placed
+// again for each count spanning several NUMA nodes, best of 5 runs. One csv
+// line per count:
+// threads,nodes,seconds,pairs_per_s,pairs_per_s_per_thread,efficiency
+template<typename T>
+void scaling_report(const points<T> &parsed, u64 max_threads, bool deterministic, bool huge_pages)
+{
+    const u64 n = parsed.count;
+    f64 single {0};
+    std::cout << "threads,nodes,seconds,pairs_per_s,pairs_per_s_per_thread,efficiency" << std::endl;
+    for (u64 t = 1; t <= max_threads; ++t) {
+        thread_pool pool {t};
+        const u64 nodes = pool_nodes(pool);
+        const points<T> placed = nodes > 1 ? place_points(parsed, pool, huge_pages) : points<T>{};
+        const points<T> &ps = nodes > 1 ? placed : parsed;
+
+        f64 best {std::numeric_limits<f64>::max()};
+        f64 sink {0};
+        for (int r = 0; r < 5; ++r) {
+            auto start = std::chrono::steady_clock::now();
+            f64 error_bound;
+            sink += deterministic ? deterministic_mean(ps, pool, error_bound) : mean_haversine(ps, pool);
+            best = std::min(best, std::chrono::duration<f64>(std::chrono::steady_clock::now() - start).count());
+        }
+        const f64 throughput = n / best;
+        if (t == 1)
+            single = throughput;
+        std::cout << std::format(
+            "{},{},{:.6f},{:.0f},{:.0f},{:.3f}",
+            t, nodes, best, throughput, throughput / t, throughput / t / single
+        ) << std::endl;
+        assert(sink > 0);
+    }
+}
+
+
+// Largest distance from haversine_f32 to reference_haversine over a grid of
+// the whole domain, in steps that float cannot represent so that coordinates
+// get rounded, over pairs close to each other and close to antipodes around
+// each grid point, where haversines lose the most, and over uniform random
+// pairs, seeded per chunk so that the sweep is the same for any number of
+// threads. Prints the worst pair, false if it is past HAVERSINE_F32_MAX_ERROR.
+bool f32_sweep(thread_pool &pool)
+{
+    constexpr u64 LAT_STEPS {71}, LON_STEPS {143};
+    constexpr u64 RANDOM_CHUNKS {64}, RANDOM_CHUNK {1 << 20};
+    constexpr f64 OFFSETS[] {-1, -1e-2, -1e-4, -1e-6, 0, 1e-6, 1e-4, 1e-2, 1};
+    struct worst_pair {
+        f64 error {0}, x0 {0}, x1 {0}, y0 {0}, y1 {0};
+        u64 count {0};
+    };
+    std::vector<worst_pair> worst(pool.size());
+    auto lat = [](u64 i) { return -90.0 + 180.0 * i / LAT_STEPS; };
+    auto lon = [](u64 i) { return -180.0 + 360.0 * i / LON_STEPS; };
+
+    pool.run([&](u64 w) {
+        worst_pair &pair = worst[w];
+        auto check = [&](f64 x0, f64 x1, f64 y0, f64 y1) {
+            y0 = std::clamp(y0, -90.0, 90.0), y1 = std::clamp(y1, -90.0, 90.0);
+            x0 = std::clamp(x0, -180.0, 180.0), x1 = std::clamp(x1, -180.0, 180.0);
+            const f64 error = std::abs(haversine_f32(f32(x0), f32(x1), f32(y0), f32(y1)) - reference_haversine(x0, x1, y0, y1));
+            if (error > pair.error)
+                pair = {error, x0, x1, y0, y1, pair.count};
+            ++pair.count;
+        };
+        for (u64 i0 = w; i0 <= LAT_STEPS; i0 += pool.size())
+            for (u64 j0 = 0; j0 <= LON_STEPS; ++j0) {
+                const f64 y0 = lat(i0), x0 = lon(j0);
+                for (u64 i1 = 0; i1 <= LAT_STEPS; ++i1)
+                    for (u64 j1 = 0; j1 <= LON_STEPS; ++j1)
+                        check(x0, lon(j1), y0, lat(i1));
+                const f64 antipode_x = x0 <= 0 ? x0 + 180 : x0 - 180;
+                for (f64 dy : OFFSETS)
+                    for (f64 dx : OFFSETS) {
+                        check(x0, x0 + dx, y0, y0 + dy);
+                        check(x0, antipode_x + dx, y0, -y0 + dy);
+                    }
+            }
+        for (u64 chunk = w; chunk < RANDOM_CHUNKS; chunk += pool.size()) {
+            std::mt19937_64 generator {chunk};
+            std::uniform_real_distribution<f64> random_lat {-90, 90}, random_lon {-180, 180};
+            for (u64 i = 0; i < RANDOM_CHUNK; ++i) {
+                const f64 x0 = random_lon(generator), x1 = random_lon(generator);
+                const f64 y0 = random_lat(generator), y1 = random_lat(generator);
+                check(x0, x1, y0, y1);
+            }
+        }
+    });
+
+    worst_pair max;
+    u64 count {0};
+    for (const auto &pair : worst) {
+        count += pair.count;
+        if (pair.error >= max.error)
+            max = pair;
+    }
+    const bool within = max.error <= HAVERSINE_F32_MAX_ERROR;
+    std::cout << std::format(
+        "{} pairs, max error {:.3f} m at x0 {} y0 {} x1 {} y1 {}, bound {:.3f} m{}",
+        count, max.error * 1e3, max.x0, max.y0, max.x1, max.y1,
+        HAVERSINE_F32_MAX_ERROR * 1e3, within ? "" : ", EXCEEDED"
+    ) << std::endl;
+    return within;
+}
+
+
+// Both ends of every pair, bucketed in a grid of lat/lon cells: the cells of a
+// row one after the other, the points of a cell in f32 columns one after the
+// other, for haversine_f32 to go through them in vectors. Sized for about
+// GRID_OCCUPANCY points per cell on uniform points.
+static constexpr u64 GRID_OCCUPANCY {32};
+
+
+struct grid_index {
+    u64 rows {0}, cols {0};
+    f64 row_degrees {0}, col_degrees {0};
+    std::vector<u32> cell_start;  // rows * cols + 1, into the columns
+    std::vector<f32> lon, lat;
+    std::vector<u32> id;          // 2 * pair + end
+};
+
+
+static u64 grid_row(const grid_index &grid, f64 lat)
+{
+    return std::min<u64>(grid.rows - 1, static_cast<u64>((lat + 90) / grid.row_degrees));
+}
+
+static u64 grid_col(const grid_index &grid, f64 lon)
+{
+    return std::min<u64>(grid.cols - 1, static_cast<u64>((lon + 180) / grid.col_degrees));
+}
+
+
+grid_index build_grid(const points<f32> &ps)
+{
+    ProfileScope profile {"build grid"};
+    grid_index grid;
+    const u64 n = 2 * ps.count;
+    const f64 degrees = std::clamp(std::sqrt(180.0 * 360.0 * GRID_OCCUPANCY / std::max<u64>(n, 1)), 0.25, 30.0);
+    grid.rows = static_cast<u64>(std::ceil(180 / degrees));
+    grid.cols = static_cast<u64>(std::ceil(360 / degrees));
+    grid.row_degrees = 180.0 / grid.rows;
+    grid.col_degrees = 360.0 / grid.cols;
+
+    auto cell = [&](u64 p) {
+        const f32 x = p % 2 ? ps.x1[p / 2] : ps.x0[p / 2], y = p % 2 ? ps.y1[p / 2] : ps.y0[p / 2];
+        return grid_row(grid, y) * grid.cols + grid_col(grid, x);
+    };
+    grid.cell_start.assign(grid.rows * grid.cols + 1, 0);
+    for (u64 p = 0; p < n; ++p)
+        ++grid.cell_start[cell(p) + 1];
+    for (u64 c = 0; c < grid.rows * grid.cols; ++c)
+        grid.cell_start[c + 1] += grid.cell_start[c];
+
+    std::vector<u32> next {grid.cell_start.begin(), grid.cell_start.end() - 1};
+    grid.lon.resize(n);
+    grid.lat.resize(n);
+    grid.id.resize(n);
+    for (u64 p = 0; p < n; ++p) {
+        const u32 at = next[cell(p)]++;
+        grid.lon[at] = p % 2 ? ps.x1[p / 2] : ps.x0[p / 2];
+        grid.lat[at] = p % 2 ? ps.y1[p / 2] : ps.y0[p / 2];
+        grid.id[at] = p;
+    }
+    return grid;
+}
+
+
+// Smallest distance from (x, y) to a point lon_distance degrees of longitude
+// away with a latitude in [lat_min, lat_max]. Along a meridian, the cos of the
+// distance is a sinusoid of the latitude, largest at the atan2 below, so the
+// closest point is there if it is in range, else at an end.
+static f64 meridian_distance(f64 x, f64 y, f64 lon_distance, f64 lat_min, f64 lat_max)
+{
+    const f64 lat = y * std::numbers::pi / 180, lon = lon_distance * std::numbers::pi / 180;
+    const f64 peak = std::atan2(std::sin(lat), std::cos(lat) * std::cos(lon)) * 180 / std::numbers::pi;
+    f64 distance = std::min(reference_haversine(x, x + lon_distance, y, lat_min),
+                            reference_haversine(x, x + lon_distance, y, lat_max));
+    if (peak > lat_min && peak < lat_max)
+        distance = std::min(distance, reference_haversine(x, x + lon_distance, y, peak));
+    return distance;
+}
+
+
+// Degrees of longitude from lon to the nearest of [begin, end), 0 inside
+static f64 lon_distance(f64 lon, f64 begin, f64 end)
+{
+    if (lon >= begin && lon < end)
+        return 0;
+    auto around = [](f64 d) { d = std::fmod(std::abs(d), 360.0); return std::min(d, 360 - d); };
+    return std::min(around(lon - begin), around(lon - end));
+}
+
+
+// Goes through the cells of the grid that can hold a point closer to (x, y)
+// than limit() km, passing each to visit(first, last) as the range of its
+// points in the columns. The closest point of a cell is at its nearest
+// longitude, cells further along a row from the query are only further, and
+// so are rows further in latitude, so each walk stops at the first cell out of
+// reach. limit() may shrink between cells. haversine_f32 may be off by
+// HAVERSINE_F32_MAX_ERROR, cells are kept within that much more.
+template<typename Limit, typename Visit>
+void visit_cells(const grid_index &grid, f64 x, f64 y, Limit limit, Visit visit)
+{
+    const s64 rows = grid.rows, cols = grid.cols;
+    const s64 row0 = grid_row(grid, y), col0 = grid_col(grid, x);
+    auto reach = [&]() { return limit() + HAVERSINE_F32_MAX_ERROR; };
+
+    auto row = [&](s64 r) {
+        const f64 lat_min = -90 + r * grid.row_degrees, lat_max = lat_min + grid.row_degrees;
+        bool open[2] {true, true};  // going east, going west
+        for (s64 step = 0; step <= cols / 2 && (open[0] || open[1]); ++step)
+            for (int side = 0; side < 2; ++side) {
+                if (!open[side] || (side == 1 && (step == 0 || 2 * step == cols)))
+                    continue;  // the same cell as going east
+                const s64 col = ((col0 + (side == 0 ? step : -step)) % cols + cols) % cols;
+                const u64 c = r * cols + col;
+                if (grid.cell_start[c] == grid.cell_start[c + 1])
+                    continue;  // a bound is dearer than walking past
+                const f64 lon_begin = -180 + col * grid.col_degrees;
+                const f64 lon_away = lon_distance(x, lon_begin, lon_begin + grid.col_degrees);
+                if (meridian_distance(x, y, lon_away, lat_min, lat_max) > reach()) {
+                    open[side] = false;
+                    if (step == 0)
+                        open[1] = false;
+                    continue;
+                }
+                visit(grid.cell_start[c], grid.cell_start[c + 1]);
+            }
+    };
+    auto row_distance = [&](s64 r) {
+        if (r < 0 || r >= rows)
+            return std::numeric_limits<f64>::max();
+        const f64 lat_min = -90 + r * grid.row_degrees;
+        return reference_haversine(x, x, y, std::clamp(y, lat_min, lat_min + grid.row_degrees));
+    };
+
+    row(row0);
+    for (s64 below = row0 - 1, above = row0 + 1; below >= 0 || above < rows;) {
+        const f64 d_below = row_distance(below), d_above = row_distance(above);
+        if (std::min(d_below, d_above) > reach())
+            break;
+        if (d_below <= d_above)
+            row(below--);
+        else
+            row(above++);
+    }
+}
+
+
+struct neighbour {
+    f64 distance;
+    u32 id;
+    auto operator<=>(const neighbour&) const = default;
+};
+
+
+// Distances from (x, y) to the n points of the columns, those within limit()
+// passed to take(distance, index in the columns)
+template<typename Limit, typename Take>
+static void scan_points(f32 x, f32 y, const f32 *lon, const f32 *lat, u64 n, Limit limit, Take take)
+{
+    f64 distances[SUM_BLOCK];
+    for (u64 begin = 0; begin < n; begin += SUM_BLOCK) {
+        const u64 len = std::min(SUM_BLOCK, n - begin);
+        for (u64 i = 0; i < len; ++i)
+            distances[i] = haversine_f32(x, lon[begin + i], y, lat[begin + i]);
+        for (u64 i = 0; i < len; ++i)
+            if (distances[i] <= limit())
+                take(distances[i], begin + i);
+    }
+}
+
+
+// The k closest points given to it, in a heap with the furthest on top
+struct nearest {
+    u64 k;
+    std::vector<neighbour> heap;
+
+    f64 limit() const { return heap.size() < k ? std::numeric_limits<f64>::max() : heap.front().distance; }
+
+    void add(neighbour n)
+    {
+        if (heap.size() < k) {
+            heap.push_back(n);
+            std::push_heap(heap.begin(), heap.end());
+        } else if (n < heap.front()) {
+            std::pop_heap(heap.begin(), heap.end());
+            heap.back() = n;
+            std::push_heap(heap.begin(), heap.end());
+        }
+    }
+
+    std::vector<neighbour> sorted()
+    {
+        std::sort_heap(heap.begin(), heap.end());
+        return std::move(heap);
+    }
+};
+
+
+// The searches below also count the points they computed the distance to in examined
+struct query {
+    f32 x, y;
+};
+
+
+std::vector<neighbour> knn_brute(const points<f32> &ps, query q, u64 k, u64 &examined)
+{
+    nearest best {k};
+    auto limit = [&]() { return best.limit(); };
+    scan_points(q.x, q.y, ps.x0, ps.y0, ps.count, limit, [&](f64 d, u64 i) { best.add({d, u32(2 * i)}); });
+    scan_points(q.x, q.y, ps.x1, ps.y1, ps.count, limit, [&](f64 d, u64 i) { best.add({d, u32(2 * i + 1)}); });
+    examined += 2 * ps.count;
+    return best.sorted();
+}
+
+
+std::vector<neighbour> knn_grid(const grid_index &grid, query q, u64 k, u64 &examined)
+{
+    nearest best {k};
+    auto limit = [&]() { return best.limit(); };
+    visit_cells(grid, q.x, q.y, limit, [&](u64 first, u64 last) {
+        scan_points(q.x, q.y, &grid.lon[first], &grid.lat[first], last - first, limit,
+                    [&](f64 d, u64 i) { best.add({d, grid.id[first + i]}); });
+        examined += last - first;
+    });
+    return best.sorted();
+}
+
+
+std::vector<neighbour> within_brute(const points<f32> &ps, query q, f64 radius, u64 &examined)
+{
+    std::vector<neighbour> found;
+    auto limit = [&]() { return radius; };
+    scan_points(q.x, q.y, ps.x0, ps.y0, ps.count, limit, [&](f64 d, u64 i) { found.push_back({d, u32(2 * i)}); });
+    scan_points(q.x, q.y, ps.x1, ps.y1, ps.count, limit, [&](f64 d, u64 i) { found.push_back({d, u32(2 * i + 1)}); });
+    examined += 2 * ps.count;
+    std::sort(found.begin(), found.end());
+    return found;
+}
+
+
+std::vector<neighbour> within_grid(const grid_index &grid, query q, f64 radius, u64 &examined)
+{
+    std::vector<neighbour> found;
+    auto limit = [&]() { return radius; };
+    visit_cells(grid, q.x, q.y, limit, [&](u64 first, u64 last) {
+        scan_points(q.x, q.y, &grid.lon[first], &grid.lat[first], last - first, limit,
+                    [&](f64 d, u64 i) { found.push_back({d, grid.id[first + i]}); });
+        examined += last - first;
+    });
+    std::sort(found.begin(), found.end());
+    return found;
+}
+
+
+// Queries/s of the k nearest points and of the points within radius km, from
+// uniform random query points, by brute force over the columns and through
+// the grid, the queries split between the workers. Throws if the two ever
+// disagree. One csv line per query and method:
+// query,method,queries,seconds,queries_per_s,points_per_query
+void query_report(const points<f32> &ps, thread_pool &pool, u64 nb_queries, u64 k, f64 radius)
+{
+    const grid_index grid = build_grid(ps);
+    std::mt19937_64 generator {0};
+    std::uniform_real_distribution<f64> random_lat {-90, 90}, random_lon {-180, 180};
+    std::vector<query> queries(nb_queries);
+    for (auto &q : queries)
+        q = {f32(random_lon(generator)), f32(random_lat(generator))};
+
+    using method = std::function<std::vector<neighbour>(query, u64&)>;
+    const std::pair<const char*, method> methods[] {
+        {"knn,brute", [&](query q, u64 &examined) { return knn_brute(ps, q, k, examined); }},
+        {"knn,grid", [&](query q, u64 &examined) { return knn_grid(grid, q, k, examined); }},
+        {"radius,brute", [&](query q, u64 &examined) { return within_brute(ps, q, radius, examined); }},
+        {"radius,grid", [&](query q, u64 &examined) { return within_grid(grid, q, radius, examined); }},
+    };
+    std::vector<std::vector<neighbour>> brute(nb_queries);
+    std::cout << "query,method,queries,seconds,queries_per_s,points_per_query" << std::endl;
+    for (const auto &[name, run] : methods) {
+        ProfileScope profile {name};
+        std::vector<std::vector<neighbour>> results(nb_queries);
+        std::vector<u64> examined(pool.size());
+        auto start = std::chrono::steady_clock::now();
+        pool.run([&](u64 w) {
+            for (u64 i = nb_queries * w / pool.size(); i < nb_queries * (w + 1) / pool.size(); ++i)
+                results[i] = run(queries[i], examined[w]);
+        });
+        const f64 seconds = std::chrono::duration<f64>(std::chrono::steady_clock::now() - start).count();
+
+        if (std::string_view{name}.ends_with("brute"))
+            brute = std::move(results);
+        else
+            for (u64 i = 0; i < nb_queries; ++i)
+                if (results[i] != brute[i])
+                    throw std::runtime_error{std::format("{} disagrees with brute force on query {}", name, i)};
+        u64 total {0};
+        for (u64 e : examined)
+            total += e;
+        std::cout << std::format(
+            "{},{},{:.6f},{:.0f},{:.0f}", name, nb_queries, seconds, nb_queries / seconds, f64(total) / nb_queries
+        ) << std::endl;
+    }
+}
+
+
+// Throughput of each input engine over the file, doing the least a parser
+// could per byte: adding them up. Cold runs first drop the file from the page
+// cache, which only works on its clean pages. Best of 3, a csv line per engine
+// and cache state, named after the engine that ended up reading:
+// engine,cache,seconds,mb_per_s
+void input_benchmark(const std::string &path)
+{
+    const u64 size = std::filesystem::file_size(path);
+    u64 expected {0};
+    std::cout << "engine,cache,seconds,mb_per_s" << std::endl;
+    for (const char *engine : INPUT_ENGINES)
+        for (bool cold : {true, false}) {
+            f64 best {std::numeric_limits<f64>::max()};
+            std::string name;
+            for (int r = 0; r < 3; ++r) {
+                if (cold) {
+                    int fd = open(path.c_str(), O_RDONLY);
+                    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+                    close(fd);
+                }
+                auto start = std::chrono::steady_clock::now();
+                std::unique_ptr<input> in = open_input(engine, path);
+                u64 sum {0};
+                for (std::span<const char> chunk = in->next(); !chunk.empty(); chunk = in->next())
+                    for (char c : chunk)
+                        sum += static_cast<u8>(c);
+                best = std::min(best, std::chrono::duration<f64>(std::chrono::steady_clock::now() - start).count());
+                name = in->name();
+                if (expected == 0)
+                    expected = sum;
+                if (sum != expected)
+                    throw std::runtime_error{std::format("{} read the input wrong", name)};
+            }
+            std::cout << std::format("{},{},{:.6f},{:.1f}", name, cold ? "cold" : "warm", best, size / best / 1e6) << std::endl;
+        }
+}
+
+
+struct options {
+    std::string engine {"uring"};
+    u64 nb_threads {allowed_cpus().size()};
+    bool deterministic {false};
+    bool scaling {false};
+    bool huge_pages {false};
+    bool populate {false};
+    bool load_report {false};
+    bool single {false};  // f32 columns
+    u64 nb_queries {0};
+    u64 k {10};
+    f64 radius {100};     // km
+};
+
+
+// Mean of the pairs in the file, or the scaling report on them, with columns of T
+template<typename T>
+void report_mean(const std::string &json_file_path, const options &o)
+{
+    points<T> ps = get_points<T>(json_file_path, o.engine, o.huge_pages, o.populate, o.load_report);
+
+    if constexpr (std::is_same_v<T, f32>)
+        if (o.nb_queries > 0) {
+            thread_pool pool {o.nb_threads};
+            query_report(ps, pool, o.nb_queries, o.k, o.radius);
+            return;
+        }
+    if (o.scaling) {
+        scaling_report(ps, o.nb_threads, o.deterministic, o.huge_pages);
+        return;
+    }
+    thread_pool pool {o.nb_threads};
+    if (pool_nodes(pool) > 1)
+        ps = place_points(ps, pool, o.huge_pages);
+
+    if (o.deterministic) {
+        f64 error_bound;
+        f64 mean = deterministic_mean(ps, pool, error_bound);
+        std::cout << std::setprecision(17) << "mean: " << mean << std::endl;
+        std::cout << std::setprecision(3) << "rounding error: <= " << error_bound << std::endl;
+        if constexpr (std::is_same_v<T, f32>)
+            std::cout << "f32 error: <= " << HAVERSINE_F32_MAX_ERROR << std::endl;
+    } else {
+        f64 mean = mean_haversine(ps, pool);
+        std::cout << "mean: " << mean << std::endl;
+    }
+}
+
+
 int main(int argc, char** argv) {
     if (argc < 2)
         throw std::runtime_error{"Not enough arguments"};
 
-    std::string json_file_path {argv[1]};
-    auto ps = get_points(json_file_path);
+    if (std::string{argv[1]} == "--f32-sweep") {
+        thread_pool pool {allowed_cpus().size()};
+        return f32_sweep(pool) ? 0 : 1;
+    }
 
-    f64 mean {0};
-#pragma omp parallel for reduction(+:mean)
-    for(u64 i = 0; i < ps.x0.size(); ++i)
-        mean += reference_haversine(ps.x0[i], ps.x1[i], ps.y0[i], ps.y1[i]);
+    options o;
+    bool input_bench {false};
+    for (int i = 2; i < argc; ++i)
+        if (std::string{argv[i]} == "--deterministic")
+            o.deterministic = true;
+        else if (std::string{argv[i]} == "--scaling")
+            o.scaling = true;
+        else if (std::string{argv[i]} == "--threads" && i + 1 < argc)
+            o.nb_threads = std::max(1ul, strtoul(argv[++i], nullptr, 10));
+        else if (std::string{argv[i]} == "--profile")
+            start_profiling();
+        else if (std::string{argv[i]} == "--huge-pages")
+            o.huge_pages = true;
+        else if (std::string{argv[i]} == "--populate")
+            o.populate = true;
+        else if (std::string{argv[i]} == "--load-report")
+            o.load_report = true;
+        else if (std::string{argv[i]} == "--f32")
+            o.single = true;
+        else if (std::string{argv[i]} == "--input" && i + 1 < argc)
+            o.engine = argv[++i];
+        else if (std::string{argv[i]} == "--queries" && i + 1 < argc)
+            o.nb_queries = strtoul(argv[++i], nullptr, 10);
+        else if (std::string{argv[i]} == "--knn" && i + 1 < argc)
+            o.k = std::max(1ul, strtoul(argv[++i], nullptr, 10));
+        else if (std::string{argv[i]} == "--radius" && i + 1 < argc)
+            o.radius = strtod(argv[++i], nullptr);
+        else if (std::string{argv[i]} == "--input-bench")
+            input_bench = true;
+        else
+            throw std::runtime_error{"Invalid option"};
 
-    mean /= ps.x0.size();
-    std::cout << "mean: " << mean << std::endl;
+    std::string json_file_path {argv[1]};
+    if (input_bench)
+        input_benchmark(json_file_path);
+    else if (o.single || o.nb_queries > 0)
+        report_mean<f32>(json_file_path, o);
+    else
+        report_mean<f64>(json_file_path, o);
+    print_profile(stderr);
 }
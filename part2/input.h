@@ -0,0 +1,419 @@
+#pragma once
+
+// Ways to read the input file. Each hands it out as a sequence of chunks that
+// stay valid until the next one is asked for, the parser reads them in place.
+// The pread and io_uring ones keep INPUT_DEPTH reads of INPUT_CHUNK bytes in
+// flight ahead of the parser, into aligned buffers so that they can bypass the
+// page cache with O_DIRECT.
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <format>
+#include <linux/io_uring.h>
+#include <memory>
+#include <mutex>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <thread>
+#include <unistd.h>
+
+
+static constexpr size_t INPUT_CHUNK {1 << 20};
+static constexpr size_t INPUT_DEPTH {4};
+static constexpr size_t INPUT_ALIGN {4096};  // of O_DIRECT buffers, offsets and lengths
+static_assert(INPUT_CHUNK % INPUT_ALIGN == 0);
+
+static constexpr const char *INPUT_ENGINES[] {"fread", "mmap", "pread", "pread-direct", "uring", "uring-direct"};
+
+
+struct input {
+    virtual ~input() = default;
+    // The next chunk of the file, empty past its end. The previous one is given back.
+    virtual std::span<const char> next() = 0;
+    virtual std::string name() const = 0;
+};
+
+
+inline int open_file(const std::string &path, bool direct)
+{
+    int fd = open(path.c_str(), O_RDONLY | (direct ? O_DIRECT : 0));
+    if (fd < 0)
+        throw std::runtime_error{std::format("No file {} found", path)};
+    return fd;
+}
+
+
+inline size_t file_size(int fd)
+{
+    struct stat st;
+    if (fstat(fd, &st) != 0)
+        throw std::runtime_error{"Cannot stat the input"};
+    return st.st_size;
+}
+
+
+// Reads the chunk at offset into the buffer until it has length bytes, from
+// done on, in whole INPUT_ALIGN blocks as O_DIRECT needs, the buffers have
+// room for them. Also for the rest of a read that came back short.
+inline size_t fill_chunk(int fd, char *buffer, size_t done, size_t length, size_t offset)
+{
+    while (done < length) {
+        const size_t blocks = (length - done + INPUT_ALIGN - 1) / INPUT_ALIGN * INPUT_ALIGN;
+        ssize_t n = pread(fd, buffer + done, blocks, offset + done);
+        if (n < 0)
+            throw std::runtime_error{std::format("Cannot read the input: {}", strerror(errno))};
+        if (n == 0)
+            break;
+        done += n;
+    }
+    return std::min(done, length);
+}
+
+
+// INPUT_DEPTH chunks, page aligned
+struct input_buffers {
+    char *data;
+
+    input_buffers()
+    {
+        void *p = mmap(nullptr, INPUT_DEPTH * INPUT_CHUNK, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (p == MAP_FAILED)
+            throw std::runtime_error{"Cannot map the input buffers"};
+        data = static_cast<char*>(p);
+    }
+    input_buffers(const input_buffers&) = delete;
+    input_buffers &operator=(const input_buffers&) = delete;
+    ~input_buffers() { munmap(data, INPUT_DEPTH * INPUT_CHUNK); }
+
+    char *operator[](size_t slot) const { return data + slot * INPUT_CHUNK; }
+};
+
+
+// stdio, copied from its buffer into ours
+struct fread_input : input {
+    FILE *file;
+    std::unique_ptr<char[]> buffer {new char[INPUT_CHUNK]};
+
+    explicit fread_input(const std::string &path) : file {fopen(path.c_str(), "r")}
+    {
+        if (file == nullptr)
+            throw std::runtime_error{std::format("No file {} found", path)};
+    }
+    ~fread_input() override { fclose(file); }
+
+    std::span<const char> next() override
+    {
+        return {buffer.get(), fread(buffer.get(), 1, INPUT_CHUNK, file)};
+    }
+    std::string name() const override { return "fread"; }
+};
+
+
+// the whole file in one chunk, paged in as the parser reaches it
+struct mmap_input : input {
+    int fd;
+    size_t size;
+    char *data {nullptr};
+    bool given {false};
+
+    explicit mmap_input(const std::string &path) : fd {open_file(path, false)}, size {file_size(fd)}
+    {
+        if (size > 0) {
+            void *p = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (p == MAP_FAILED) {
+                close(fd);
+                throw std::runtime_error{"Cannot map the input"};
+            }
+            data = static_cast<char*>(p);
+            madvise(data, size, MADV_SEQUENTIAL);
+        }
+    }
+    ~mmap_input() override
+    {
+        if (data != nullptr)
+            munmap(data, size);
+        close(fd);
+    }
+
+    std::span<const char> next() override
+    {
+        if (given)
+            return {};
+        given = true;
+        return {data, size};
+    }
+    std::string name() const override { return "mmap"; }
+};
+
+
+// A thread reading chunks ahead into the buffers, as they are given back
+struct pread_input : input {
+    int fd;
+    bool direct;
+    size_t size;
+    size_t nb_chunks;
+    input_buffers buffers;
+    size_t lengths[INPUT_DEPTH] {};
+    bool full[INPUT_DEPTH] {};
+    size_t consumed {0};
+    bool stopping {false};
+    std::string error;
+    std::mutex mutex;
+    std::condition_variable filled, freed;
+    std::thread reader;
+
+    pread_input(const std::string &path, bool direct)
+        : fd {open_file(path, direct)}, direct {direct}, size {file_size(fd)},
+          nb_chunks {(size + INPUT_CHUNK - 1) / INPUT_CHUNK}
+    {
+        reader = std::thread {[this]() { read_ahead(); }};
+    }
+    ~pread_input() override
+    {
+        {
+            std::lock_guard lock {mutex};
+            stopping = true;
+        }
+        freed.notify_one();
+        reader.join();
+        close(fd);
+    }
+
+    void read_ahead()
+    {
+        for (size_t chunk = 0; chunk < nb_chunks; ++chunk) {
+            const size_t slot = chunk % INPUT_DEPTH;
+            {
+                std::unique_lock lock {mutex};
+                freed.wait(lock, [&]() { return stopping || !full[slot]; });
+                if (stopping)
+                    return;
+            }
+            size_t length;
+            try {
+                length = fill_chunk(fd, buffers[slot], 0, std::min(INPUT_CHUNK, size - chunk * INPUT_CHUNK), chunk * INPUT_CHUNK);
+            } catch (const std::exception &e) {
+                std::lock_guard lock {mutex};
+                error = e.what();
+                filled.notify_one();
+                return;
+            }
+            std::lock_guard lock {mutex};
+            lengths[slot] = length;
+            full[slot] = true;
+            filled.notify_one();
+        }
+    }
+
+    std::span<const char> next() override
+    {
+        std::unique_lock lock {mutex};
+        if (consumed > 0 && consumed <= nb_chunks) {
+            full[(consumed - 1) % INPUT_DEPTH] = false;
+            freed.notify_one();
+        }
+        if (consumed >= nb_chunks) {
+            consumed = nb_chunks + 1;
+            return {};
+        }
+        const size_t slot = consumed % INPUT_DEPTH;
+        filled.wait(lock, [&]() { return full[slot] || !error.empty(); });
+        if (!full[slot])
+            throw std::runtime_error{error};
+        ++consumed;
+        return {buffers[slot], lengths[slot]};
+    }
+    std::string name() const override { return direct ? "pread-direct" : "pread"; }
+};
+
+
+// io_uring through its system calls: a read per buffer submitted up front,
+// and each buffer submitted again for the next chunk once the parser gives it
+// back. Throws on kernels or sandboxes without io_uring.
+struct uring_input : input {
+    int fd;
+    bool direct;
+    size_t size;
+    size_t nb_chunks;
+    input_buffers buffers;
+    int ring {-1};
+    size_t sq_size {0}, cq_size {0}, sqes_size {0};
+    void *sq {MAP_FAILED};
+    void *cq {MAP_FAILED};
+    io_uring_sqe *sqes {static_cast<io_uring_sqe*>(MAP_FAILED)};
+    unsigned *sq_tail, *sq_mask, *sq_array, *cq_head, *cq_tail, *cq_mask;
+    io_uring_cqe *cqes;
+    int results[INPUT_DEPTH] {};
+    bool done[INPUT_DEPTH] {};
+    size_t submitted {0};
+    size_t consumed {0};
+
+    uring_input(const std::string &path, bool direct)
+        : fd {open_file(path, direct)}, direct {direct}, size {file_size(fd)},
+          nb_chunks {(size + INPUT_CHUNK - 1) / INPUT_CHUNK}
+    {
+        io_uring_params params {};
+        ring = syscall(__NR_io_uring_setup, INPUT_DEPTH, &params);
+        if (ring < 0) {
+            close(fd);
+            throw std::runtime_error{std::format("No io_uring: {}", strerror(errno))};
+        }
+        sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        cq_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        if (params.features & IORING_FEAT_SINGLE_MMAP)
+            sq_size = cq_size = std::max(sq_size, cq_size);
+        sq = mmap(nullptr, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring, IORING_OFF_SQ_RING);
+        cq = params.features & IORING_FEAT_SINGLE_MMAP
+            ? sq : mmap(nullptr, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring, IORING_OFF_CQ_RING);
+        sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+        sqes = static_cast<io_uring_sqe*>(
+            mmap(nullptr, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring, IORING_OFF_SQES));
+        if (sq == MAP_FAILED || cq == MAP_FAILED || sqes == MAP_FAILED) {
+            release();
+            throw std::runtime_error{"Cannot map the io_uring"};
+        }
+        char *sq_base = static_cast<char*>(sq), *cq_base = static_cast<char*>(cq);
+        sq_tail = reinterpret_cast<unsigned*>(sq_base + params.sq_off.tail);
+        sq_mask = reinterpret_cast<unsigned*>(sq_base + params.sq_off.ring_mask);
+        sq_array = reinterpret_cast<unsigned*>(sq_base + params.sq_off.array);
+        cq_head = reinterpret_cast<unsigned*>(cq_base + params.cq_off.head);
+        cq_tail = reinterpret_cast<unsigned*>(cq_base + params.cq_off.tail);
+        cq_mask = reinterpret_cast<unsigned*>(cq_base + params.cq_off.ring_mask);
+        cqes = reinterpret_cast<io_uring_cqe*>(cq_base + params.cq_off.cqes);
+
+        while (submitted < std::min(INPUT_DEPTH, nb_chunks))
+            queue(submitted++);
+        enter(submitted, 0);
+    }
+    ~uring_input() override
+    {
+        // the kernel may still write into the buffers
+        while (reaped() < submitted)
+            enter(0, 1);
+        release();
+    }
+
+    void release()
+    {
+        if (sqes != MAP_FAILED)
+            munmap(sqes, sqes_size);
+        if (cq != MAP_FAILED && cq != sq)
+            munmap(cq, cq_size);
+        if (sq != MAP_FAILED)
+            munmap(sq, sq_size);
+        close(ring);
+        close(fd);
+    }
+
+    size_t reaped() const
+    {
+        size_t n {consumed};
+        for (size_t chunk = consumed; chunk < submitted; ++chunk)
+            n += done[chunk % INPUT_DEPTH];
+        return n;
+    }
+
+    void queue(size_t chunk)
+    {
+        const size_t slot = chunk % INPUT_DEPTH;
+        const unsigned tail = *sq_tail;
+        const unsigned index = tail & *sq_mask;
+        io_uring_sqe &sqe = sqes[index];
+        memset(&sqe, 0, sizeof(sqe));
+        sqe.opcode = IORING_OP_READ;
+        sqe.fd = fd;
+        sqe.addr = reinterpret_cast<uint64_t>(buffers[slot]);
+        sqe.len = INPUT_CHUNK;
+        sqe.off = chunk * INPUT_CHUNK;
+        sqe.user_data = chunk;
+        sq_array[index] = index;
+        done[slot] = false;
+        std::atomic_ref<unsigned>{*sq_tail}.store(tail + 1, std::memory_order_release);
+    }
+
+    void enter(unsigned to_submit, unsigned min_complete)
+    {
+        const unsigned flags = min_complete > 0 ? IORING_ENTER_GETEVENTS : 0;
+        while (syscall(__NR_io_uring_enter, ring, to_submit, min_complete, flags, nullptr, 0) < 0)
+            if (errno != EINTR)
+                throw std::runtime_error{std::format("io_uring_enter: {}", strerror(errno))};
+        reap();
+    }
+
+    void reap()
+    {
+        unsigned head = *cq_head;
+        while (head != std::atomic_ref<unsigned>{*cq_tail}.load(std::memory_order_acquire)) {
+            const io_uring_cqe &cqe = cqes[head & *cq_mask];
+            const size_t slot = cqe.user_data % INPUT_DEPTH;
+            results[slot] = cqe.res;
+            done[slot] = true;
+            ++head;
+        }
+        std::atomic_ref<unsigned>{*cq_head}.store(head, std::memory_order_release);
+    }
+
+    std::span<const char> next() override
+    {
+        unsigned to_submit {0};
+        if (consumed > 0 && submitted < nb_chunks) {
+            queue(submitted++);  // into the buffer just given back
+            to_submit = 1;
+        }
+        if (consumed >= nb_chunks)
+            return {};
+        const size_t slot = consumed % INPUT_DEPTH;
+        reap();
+        if (to_submit > 0 || !done[slot])
+            enter(to_submit, done[slot] ? 0 : 1);
+        while (!done[slot])
+            enter(0, 1);
+        if (results[slot] < 0)
+            throw std::runtime_error{std::format("Cannot read the input: {}", strerror(-results[slot]))};
+        const size_t offset = consumed * INPUT_CHUNK;
+        const size_t length = fill_chunk(fd, buffers[slot], results[slot], std::min(INPUT_CHUNK, size - offset), offset);
+        ++consumed;
+        return {buffers[slot], length};
+    }
+    std::string name() const override { return direct ? "uring-direct" : "uring"; }
+};
+
+
+// One of INPUT_ENGINES. io_uring falls back to the pread thread where it is
+// not available, and O_DIRECT to the page cache where the file system refuses it.
+inline std::unique_ptr<input> open_input(const std::string &engine, const std::string &path)
+{
+    const bool direct = engine.ends_with("-direct");
+    if (direct) {
+        int fd = open(path.c_str(), O_RDONLY | O_DIRECT);
+        if (fd < 0 && errno == EINVAL)
+            return open_input(engine.substr(0, engine.find("-direct")), path);
+        if (fd >= 0)
+            close(fd);
+    }
+    if (engine == "fread")
+        return std::make_unique<fread_input>(path);
+    if (engine == "mmap")
+        return std::make_unique<mmap_input>(path);
+    if (engine.starts_with("pread"))
+        return std::make_unique<pread_input>(path, direct);
+    if (engine.starts_with("uring")) {
+        try {
+            return std::make_unique<uring_input>(path, direct);
+        } catch (const std::runtime_error&) {
+            return std::make_unique<pread_input>(path, direct);
+        }
+    }
+    throw std::runtime_error{std::format("Unknown input engine {}", engine)};
+}